@@ -457,7 +457,7 @@ static void handle_ipv4(uint8_t *packet, size_t len, int dns_resolv, int latitud
 	struct iphdr *iph = (struct iphdr *) packet;
 	struct sockaddr_in sd;
 	struct hostent *hent;
-	const char *as, *country, *city;
+	struct geoip_info info;
 
 	memset(hbuff, 0, sizeof(hbuff));
 	memset(&sd, 0, sizeof(sd));
@@ -467,9 +467,7 @@ static void handle_ipv4(uint8_t *packet, size_t len, int dns_resolv, int latitud
 	getnameinfo((struct sockaddr *) &sd, sizeof(sd),
 		    hbuff, NI_MAXHOST, NULL, 0, NI_NUMERICHOST);
 
-	as = geoip4_as_name(sd);
-	country = geoip4_country_name(sd);
-	city = geoip4_city_name(sd);
+	geoip4_lookup(sd, &info);
 
 	if (dns_resolv) {
 		hent = gethostbyaddr(&sd.sin_addr, sizeof(sd.sin_addr), PF_INET);
@@ -480,15 +478,15 @@ static void handle_ipv4(uint8_t *packet, size_t len, int dns_resolv, int latitud
 	} else {
 		printf(" %s", hbuff);
 	}
-	if (as)
-		printf(" in %s", as);
-	if (country) {
-		printf(" in %s", country);
-		if (city)
-			printf(", %s", city);
+	if (info.as[0])
+		printf(" in %s", info.as);
+	if (info.country[0]) {
+		printf(" in %s", info.country);
+		if (info.city[0])
+			printf(", %s", info.city);
 	}
 	if (latitude)
-		printf(" (%f/%f)", geoip4_latitude(sd), geoip4_longitude(sd));
+		printf(" (%f/%f)", info.latitude, info.longitude);
 }
 
 static int check_ipv6(uint8_t *packet, size_t len, int ttl, int id,
@@ -523,7 +521,7 @@ static void handle_ipv6(uint8_t *packet, size_t len, int dns_resolv, int latitud
 	struct ip6_hdr *ip6h = (struct ip6_hdr *) packet;
 	struct sockaddr_in6 sd;
 	struct hostent *hent;
-	const char *as, *country, *city;
+	struct geoip_info info;
 
 	memset(hbuff, 0, sizeof(hbuff));
 	memset(&sd, 0, sizeof(sd));
@@ -533,9 +531,7 @@ static void handle_ipv6(uint8_t *packet, size_t len, int dns_resolv, int latitud
 	getnameinfo((struct sockaddr *) &sd, sizeof(sd),
 		    hbuff, NI_MAXHOST, NULL, 0, NI_NUMERICHOST);
 
-	as = geoip6_as_name(sd);
-	country = geoip6_country_name(sd);
-	city = geoip6_city_name(sd);
+	geoip6_lookup(sd, &info);
 
 	if (dns_resolv) {
 		hent = gethostbyaddr(&sd.sin6_addr, sizeof(sd.sin6_addr), PF_INET6);
@@ -546,15 +542,15 @@ static void handle_ipv6(uint8_t *packet, size_t len, int dns_resolv, int latitud
 	} else {
 		printf(" %s", hbuff);
 	}
-	if (as)
-		printf(" in %s", as);
-	if (country) {
-		printf(" in %s", country);
-		if (city)
-			printf(", %s", city);
+	if (info.as[0])
+		printf(" in %s", info.as);
+	if (info.country[0]) {
+		printf(" in %s", info.country);
+		if (info.city[0])
+			printf(", %s", info.city);
 	}
 	if (latitude)
-		printf(" (%f/%f)", geoip6_latitude(sd), geoip6_longitude(sd));
+		printf(" (%f/%f)", info.latitude, info.longitude);
 }
 
 static void show_trace_info(struct ctx *ctx, const struct sockaddr_storage *ss,
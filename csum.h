@@ -41,6 +41,78 @@ static inline uint16_t csum_expected(uint16_t sum, uint16_t computed_sum)
 	return shouldbe;
 }
 
+/*
+ * One's complement sum over len bytes in native word order, unfolded. The
+ * inner loop works on independent 32 bit lanes into a 64 bit accumulator,
+ * so that gcc can vectorize it on -O3; used for checksumming large regions.
+ */
+static inline uint64_t csum_partial(const void *addr, size_t len, uint64_t sum)
+{
+	const uint8_t *p = addr;
+	uint32_t w[8];
+	uint16_t h;
+	int i;
+
+	while (len >= sizeof(w)) {
+		fmemcpy(w, p, sizeof(w));
+		for (i = 0; i < 8; ++i)
+			sum += w[i];
+		p += sizeof(w);
+		len -= sizeof(w);
+	}
+
+	while (len >= sizeof(h)) {
+		fmemcpy(&h, p, sizeof(h));
+		sum += h;
+		p += sizeof(h);
+		len -= sizeof(h);
+	}
+
+	if (len) {
+		h = 0;
+		*(uint8_t *) &h = *p;
+		sum += h;
+	}
+
+	return sum;
+}
+
+static inline uint16_t csum_fold(uint64_t sum)
+{
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+
+	return (uint16_t) ~sum;
+}
+
+/*
+ * Incremental checksum update, RFC 1624. A byte changing from old to new
+ * at an even (odd) offset relative to the start of the checksummed area
+ * is the high (low) byte of its 16 bit word in network order. csum_diff8()
+ * yields ~m + m' for that word; csum_update() applies the summed diffs to
+ * a checksum hc in network order: HC' = ~(~HC + ~m + m'), eqn. 3.
+ */
+static inline uint32_t csum_diff8(uint8_t old, uint8_t new, int odd)
+{
+	uint32_t m = odd ? old : old << 8, n = odd ? new : new << 8;
+
+	return (~m & 0xffff) + n;
+}
+
+static inline uint16_t csum_update(uint16_t hc, uint32_t diff)
+{
+	uint32_t sum = (uint16_t) ~hc;
+
+	sum += (diff & 0xffff) + (diff >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+
+	return (uint16_t) ~sum;
+}
+
 /* Taken and modified from tcpdump, Copyright belongs to them! */
 
 struct cksum_vec {
@@ -176,4 +248,18 @@ static inline u16 p4_csum(const struct ip *ip, const u8 *data, u16 len,
 	return __in_cksum(vec, 2);
 }
 
+/* Same as p4_csum(), but with the csum_partial() kernel. */
+static inline u16 p4_csum_partial(const struct ip *ip, const u8 *data, u16 len,
+				  u8 next_proto)
+{
+	uint64_t sum;
+
+	sum = csum_partial(&ip->ip_src, sizeof(ip->ip_src), 0);
+	sum = csum_partial(&ip->ip_dst, sizeof(ip->ip_dst), sum);
+	sum += htons(next_proto);
+	sum += htons(len);
+
+	return csum_fold(csum_partial(data, len, sum));
+}
+
 #endif /* CSUM_H */
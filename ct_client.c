@@ -51,13 +51,11 @@ static void handler_udp_tun_to_net(int sfd, int dfd, struct curve25519_proto *p,
 	if (!buff || len <= off)
 		return;
 
-	memset(buff, 0, len);
 	while ((rlen = read(sfd, buff + off, len - off)) > 0) {
-		hdr = (struct ct_proto *) buff;
-
-		memset(hdr, 0, sizeof(*hdr));
-		hdr->flags = 0;
+		/* Header and the zero padding NaCl wants in front */
+		memset(buff, 0, off);
 
+		/* Ciphertext lands in place, right behind the header */
 		clen = curve25519_encode(c, p, (unsigned char *) (buff + off -
 					 crypto_box_zerobytes), (rlen +
 					 crypto_box_zerobytes), (unsigned char **)
@@ -65,16 +63,10 @@ static void handler_udp_tun_to_net(int sfd, int dfd, struct curve25519_proto *p,
 		if (unlikely(clen <= 0))
 			goto close;
 
+		hdr = (struct ct_proto *) buff;
 		hdr->payload = htons((uint16_t) clen);
 
-		set_udp_cork(dfd);
-
-		write_exact(dfd, hdr, sizeof(struct ct_proto), 0);
-		write_exact(dfd, cbuff, clen, 0);
-
-		set_udp_uncork(dfd);
-
-		memset(buff, 0, len);
+		write_exact(dfd, buff, sizeof(struct ct_proto) + clen, 0);
 	}
 
 	return;
@@ -140,12 +132,8 @@ static void handler_tcp_tun_to_net(int sfd, int dfd, struct curve25519_proto *p,
 	if (!buff || len <= off)
 		return;
 
-	memset(buff, 0, len);
 	while ((rlen = read(sfd, buff + off, len - off)) > 0) {
-		hdr = (struct ct_proto *) buff;
-
-		memset(hdr, 0, sizeof(*hdr));
-		hdr->flags = 0;
+		memset(buff, 0, off);
 
 		clen = curve25519_encode(c, p, (unsigned char *) (buff + off -
 					 crypto_box_zerobytes), (rlen +
@@ -154,16 +142,10 @@ static void handler_tcp_tun_to_net(int sfd, int dfd, struct curve25519_proto *p,
 		if (unlikely(clen <= 0))
 			goto close;
 
+		hdr = (struct ct_proto *) buff;
 		hdr->payload = htons((uint16_t) clen);
 
-		set_tcp_cork(dfd);
-
-		write_exact(dfd, hdr, sizeof(struct ct_proto), 0);
-		write_exact(dfd, cbuff, clen, 0);
-
-		set_tcp_uncork(dfd);
-
-		memset(buff, 0, len);
+		write_exact(dfd, buff, sizeof(struct ct_proto) + clen, 0);
 	}
 
 	return;
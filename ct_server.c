@@ -38,18 +38,50 @@
 #include "ct_usermgmt.h"
 #include "cpusched.h"
 #include "trie.h"
+#include "locking.h"
+
+#ifndef IFF_MULTI_QUEUE
+# define IFF_MULTI_QUEUE	0x0100
+#endif
+
+/* Kernel limit on queues per tun device, see MAX_TAP_QUEUES */
+#define MAX_TUN_QUEUES		256
+#define MAX_WORKER_EVENTS	64
+
+/* Striped locks serializing frame writes to a TCP connection, since
+ * every worker may read packets for it from its own tun queue.
+ */
+#define CONN_LOCKS		64
+
+/* Datagrams per recvmmsg()/sendmmsg() call in UDP mode */
+#define UDP_BATCH		32
 
 struct parent_info {
-	int efd;
-	int refd;
-	int tunfd;
 	int ipv4;
 	int udp;
 };
 
+/* Each slot holds one datagram, header directly before the payload. */
+struct udp_batch {
+	struct mmsghdr msg[UDP_BATCH];
+	struct iovec iov[UDP_BATCH];
+	struct sockaddr_storage addr[UDP_BATCH];
+	char *buff[UDP_BATCH];
+	size_t len;
+};
+
+/*
+ * Every worker owns an epoll instance, a tun queue and, with UDP, its
+ * own SO_REUSEPORT socket, so packets never pass through the main thread.
+ * TCP connections are handed to a worker's epoll at accept time.
+ */
 struct worker_struct {
 	pthread_t trid;
 	int efd[2];
+	int epfd;
+	int tunfd;
+	int sock;
+	struct udp_batch *batch;
 	unsigned int cpu;
 	struct parent_info parent;
 	int (*handler)(int fd, const struct worker_struct *ws,
@@ -59,7 +91,9 @@ struct worker_struct {
 
 static struct worker_struct *threadpool = NULL;
 
-static int auth_log = 1;
+static struct mutexlock conn_locks[CONN_LOCKS];
+
+static int auth_log = 1, conns = 0;
 
 extern volatile sig_atomic_t sigint;
 
@@ -78,66 +112,101 @@ static int handler_tcp(int fd, const struct worker_struct *ws,
 ssize_t handler_tcp_read(int fd, char *buff, size_t len);
 static void *worker(void *self) __pure;
 
+static struct udp_batch *udp_batch_alloc(size_t len)
+{
+	int i;
+	struct udp_batch *b = xzmalloc(sizeof(*b));
+
+	b->len = len;
+	b->buff[0] = xmalloc_aligned(UDP_BATCH * len, 64);
+
+	for (i = 0; i < UDP_BATCH; ++i) {
+		b->buff[i] = b->buff[0] + i * len;
+
+		b->iov[i].iov_base = b->buff[i];
+		b->msg[i].msg_hdr.msg_iov = &b->iov[i];
+		b->msg[i].msg_hdr.msg_iovlen = 1;
+		b->msg[i].msg_hdr.msg_name = &b->addr[i];
+	}
+
+	return b;
+}
+
+static void udp_batch_free(struct udp_batch *b)
+{
+	xfree(b->buff[0]);
+	xfree(b);
+}
+
+static void udp_batch_send(int fd, struct udp_batch *b, int n)
+{
+	int ret, done = 0;
+
+	while (done < n) {
+		ret = sendmmsg(fd, &b->msg[done], n - done, 0);
+		/* As with sendto() before, drop what the stack refuses */
+		done += ret > 0 ? ret : 1;
+	}
+}
+
 static int handler_udp_tun_to_net(int fd, const struct worker_struct *ws,
 				  char *buff, size_t len)
 {
-	int dfd, keep = 1;
-	char *cbuff;
+	int dfd, n, keep = 1;
+	char *cbuff, *slot;
 	ssize_t rlen, err, clen;
 	struct ct_proto *hdr;
 	struct curve25519_proto *p;
-	struct sockaddr_storage naddr;
-	socklen_t nlen;
+	struct udp_batch *b = ws->batch;
+	size_t nlen;
 	size_t off = sizeof(struct ct_proto) + crypto_box_zerobytes;
 
-	if (!buff || len <= off)
+	if (!b || b->len <= off)
 		return 0;
 
-	memset(buff, 0, len);
-	while ((rlen = read(fd, buff + off, len - off)) > 0) {
+	n = 0;
+	while ((rlen = read(fd, b->buff[n] + off, b->len - off)) > 0) {
 		dfd = -1; nlen = 0; p = NULL;
+		slot = b->buff[n];
 
-		memset(&naddr, 0, sizeof(naddr));
-
-		hdr = (struct ct_proto *) buff;
-		memset(hdr, 0, sizeof(*hdr));
-		hdr->flags = 0;
-
-		trie_addr_lookup(buff + off, rlen, ws->parent.ipv4, &dfd, &naddr,
-				 (size_t *) &nlen);
-		if (unlikely(dfd < 0 || nlen == 0)) {
-			memset(buff, 0, len);
+		trie_addr_lookup(slot + off, rlen, ws->parent.ipv4, &dfd,
+				 &b->addr[n], &nlen);
+		if (unlikely(dfd < 0 || nlen == 0))
 			continue;
-		}
 
-		err = get_user_by_sockaddr(&naddr, nlen, &p);
-		if (unlikely(err || !p)) {
-			memset(buff, 0, len);
+		err = get_user_by_sockaddr(&b->addr[n], nlen, &p);
+		if (unlikely(err || !p))
 			continue;
-		}
 
-		clen = curve25519_encode(ws->c, p, (unsigned char *) (buff + off -
+		/* Header and the zero padding NaCl wants in front */
+		memset(slot, 0, off);
+
+		/* Ciphertext lands in place, right behind the header */
+		clen = curve25519_encode(ws->c, p, (unsigned char *) (slot + off -
 					 crypto_box_zerobytes), (rlen +
 					 crypto_box_zerobytes), (unsigned char **)
 					 &cbuff);
-		if (unlikely(clen <= 0)) {
-			memset(buff, 0, len);
+		if (unlikely(clen <= 0))
 			continue;
-		}
 
+		hdr = (struct ct_proto *) slot;
 		hdr->payload = htons((uint16_t) clen);
 
-		set_udp_cork(dfd);
-
-		sendto(dfd, hdr, sizeof(struct ct_proto), 0, (struct sockaddr *)
-		       &naddr, nlen);
-		sendto(dfd, cbuff, clen, 0, (struct sockaddr *) &naddr, nlen);
-
-		set_udp_uncork(dfd);
+		/* Header and ciphertext leave as one datagram. Any socket of
+		 * the reuseport group reaches the client, we use our own.
+		 */
+		b->iov[n].iov_len = sizeof(struct ct_proto) + clen;
+		b->msg[n].msg_hdr.msg_namelen = nlen;
 
-		memset(buff, 0, len);
+		if (++n == UDP_BATCH) {
+			udp_batch_send(ws->sock, b, n);
+			n = 0;
+		}
 	}
 
+	if (n)
+		udp_batch_send(ws->sock, b, n);
+
 	return keep;
 }
 
@@ -153,83 +222,95 @@ static void handler_udp_notify_close(int fd, struct sockaddr_storage *addr)
 	       sizeof(*addr));
 }
 
-static int handler_udp_net_to_tun(int fd, const struct worker_struct *ws,
-				  char *buff, size_t len)
+static void handler_udp_net_to_tun_one(int fd, const struct worker_struct *ws,
+				       char *buff, ssize_t rlen,
+				       struct sockaddr_storage *naddr,
+				       socklen_t nlen)
 {
-	int keep = 1;
 	char *cbuff;
-	ssize_t rlen, err, clen;
+	ssize_t err, clen;
 	struct ct_proto *hdr;
-	struct curve25519_proto *p;
-	struct sockaddr_storage naddr;
-	socklen_t nlen = sizeof(naddr);
+	struct curve25519_proto *p = NULL;
 
-	if (!buff || !len)
-		return 0;
+	hdr = (struct ct_proto *) buff;
 
-	memset(&naddr, 0, sizeof(naddr));
-	while ((rlen = recvfrom(fd, buff, len, 0, (struct sockaddr *) &naddr,
-				&nlen)) > 0) {
-		p = NULL;
+	if (unlikely(rlen < sizeof(struct ct_proto)))
+		goto close;
+	if (unlikely(rlen - sizeof(*hdr) != ntohs(hdr->payload)))
+		goto close;
+	if (unlikely(ntohs(hdr->payload) == 0))
+		goto close;
+	if (hdr->flags & PROTO_FLAG_EXIT) {
+close:
+		remove_user_by_sockaddr(naddr, nlen);
+		trie_addr_remove_addr(naddr, nlen);
+		handler_udp_notify_close(fd, naddr);
 
-		hdr = (struct ct_proto *) buff;
+		return;
+	}
+	if (hdr->flags & PROTO_FLAG_INIT) {
+		syslog_maybe(auth_log, LOG_INFO, "Got initial userhash "
+			     "from remote end!\n");
 
-		if (unlikely(rlen < sizeof(struct ct_proto)))
-			goto close;
-		if (unlikely(rlen - sizeof(*hdr) != ntohs(hdr->payload)))
+		if (unlikely(rlen - sizeof(*hdr) <
+			     sizeof(struct username_struct)))
 			goto close;
-		if (unlikely(ntohs(hdr->payload) == 0))
+
+		err = try_register_user_by_sockaddr(ws->c,
+				buff + sizeof(struct ct_proto),
+				rlen - sizeof(struct ct_proto),
+				naddr, nlen, auth_log);
+		if (unlikely(err))
 			goto close;
-		if (hdr->flags & PROTO_FLAG_EXIT) {
-close:
-			remove_user_by_sockaddr(&naddr, nlen);
-			trie_addr_remove_addr(&naddr, nlen);
-			handler_udp_notify_close(fd, &naddr);
 
-			return keep;
-		}
-		if (hdr->flags & PROTO_FLAG_INIT) {
-			syslog_maybe(auth_log, LOG_INFO, "Got initial userhash "
-				     "from remote end!\n");
+		return;
+	}
 
-			if (unlikely(rlen - sizeof(*hdr) <
-				     sizeof(struct username_struct)))
-				goto close;
+	err = get_user_by_sockaddr(naddr, nlen, &p);
+	if (unlikely(err || !p))
+		goto close;
 
-			err = try_register_user_by_sockaddr(ws->c,
-					buff + sizeof(struct ct_proto),
-					rlen - sizeof(struct ct_proto),
-					&naddr, nlen, auth_log);
-			if (unlikely(err))
-				goto close;
+	clen = curve25519_decode(ws->c, p, (unsigned char *) buff +
+				 sizeof(struct ct_proto),
+				 rlen - sizeof(struct ct_proto),
+				 (unsigned char **) &cbuff, NULL);
+	if (unlikely(clen <= 0))
+		goto close;
 
-			goto next;
-		}
+	cbuff += crypto_box_zerobytes;
+	clen -= crypto_box_zerobytes;
 
-		err = get_user_by_sockaddr(&naddr, nlen, &p);
-		if (unlikely(err || !p))
-			goto close;
+	err = trie_addr_maybe_update(cbuff, clen, ws->parent.ipv4,
+				     fd, naddr, nlen);
+	if (unlikely(err))
+		return;
 
-		clen = curve25519_decode(ws->c, p, (unsigned char *) buff +
-					 sizeof(struct ct_proto),
-					 rlen - sizeof(struct ct_proto),
-					 (unsigned char **) &cbuff, NULL);
-                if (unlikely(clen <= 0))
-			goto close;
+	err = write(ws->tunfd, cbuff, clen);
+}
 
-		cbuff += crypto_box_zerobytes;
-		clen -= crypto_box_zerobytes;
+static int handler_udp_net_to_tun(int fd, const struct worker_struct *ws,
+				  char *buff, size_t len)
+{
+	int i, n, keep = 1;
+	struct udp_batch *b = ws->batch;
 
-		err = trie_addr_maybe_update(cbuff, clen, ws->parent.ipv4,
-					     fd, &naddr, nlen);
-		if (unlikely(err))
-			goto next;
+	if (!b)
+		return 0;
 
-		err = write(ws->parent.tunfd, cbuff, clen);
-next:
-		nlen = sizeof(naddr);
-		memset(&naddr, 0, sizeof(naddr));
-	}
+	do {
+		for (i = 0; i < UDP_BATCH; ++i) {
+			b->iov[i].iov_len = b->len;
+			b->msg[i].msg_hdr.msg_namelen = sizeof(b->addr[i]);
+		}
+
+		n = recvmmsg(fd, b->msg, UDP_BATCH, 0, NULL);
+
+		for (i = 0; i < n; ++i)
+			handler_udp_net_to_tun_one(fd, ws, b->buff[i],
+						   b->msg[i].msg_len,
+						   &b->addr[i],
+						   b->msg[i].msg_hdr.msg_namelen);
+	} while (n == UDP_BATCH);
 
 	return keep;
 }
@@ -239,7 +320,7 @@ static int handler_udp(int fd, const struct worker_struct *ws,
 {
 	int ret = 0;
 
-	if (fd == ws->parent.tunfd)
+	if (fd == ws->tunfd)
 		ret = handler_udp_tun_to_net(fd, ws, buff, len);
 	else
 		ret = handler_udp_net_to_tun(fd, ws, buff, len);
@@ -247,6 +328,11 @@ static int handler_udp(int fd, const struct worker_struct *ws,
 	return ret;
 }
 
+static inline struct mutexlock *conn_lock(int fd)
+{
+	return &conn_locks[fd & (CONN_LOCKS - 1)];
+}
+
 static int handler_tcp_tun_to_net(int fd, const struct worker_struct *ws,
 				  char *buff, size_t len)
 {
@@ -254,53 +340,52 @@ static int handler_tcp_tun_to_net(int fd, const struct worker_struct *ws,
 	char *cbuff;
 	ssize_t rlen, err, clen;
 	struct ct_proto *hdr;
-	struct curve25519_proto *p;
-	socklen_t nlen;
+	struct curve25519_proto *p, *pn;
+	struct mutexlock *lock;
+	size_t nlen;
 	size_t off = sizeof(struct ct_proto) + crypto_box_zerobytes;
 
 	if (!buff || len <= off)
 		return 0;
 
-	memset(buff, 0, len);
 	while ((rlen = read(fd, buff + off, len - off)) > 0) {
 		dfd = -1; p = NULL;
 
-		hdr = (struct ct_proto *) buff;
-		memset(hdr, 0, sizeof(*hdr));
-		hdr->flags = 0;
-
 		trie_addr_lookup(buff + off, rlen, ws->parent.ipv4, &dfd, NULL,
-				 (size_t *) &nlen);
-		if (unlikely(dfd < 0)) {
-			memset(buff, 0, len);
+				 &nlen);
+		if (unlikely(dfd < 0))
 			continue;
-		}
 
 		err = get_user_by_socket(dfd, &p);
-		if (unlikely(err || !p)) {
-			memset(buff, 0, len);
+		if (unlikely(err || !p))
 			continue;
-		}
+
+		/* Header and the zero padding NaCl wants in front */
+		memset(buff, 0, off);
 
 		clen = curve25519_encode(ws->c, p, (unsigned char *) (buff + off -
 					 crypto_box_zerobytes), (rlen +
 					 crypto_box_zerobytes), (unsigned char **)
 					 &cbuff);
-		if (unlikely(clen <= 0)) {
-			memset(buff, 0, len);
+		if (unlikely(clen <= 0))
 			continue;
-		}
 
+		hdr = (struct ct_proto *) buff;
 		hdr->payload = htons((uint16_t) clen);
 
-		set_tcp_cork(dfd);
-
-		write_exact(dfd, hdr, sizeof(struct ct_proto), 0);
-		write_exact(dfd, cbuff, clen, 0);
+		lock = conn_lock(dfd);
+		mutexlock_lock(lock);
 
-		set_tcp_uncork(dfd);
+		/*
+		 * Owner may have closed it since the lookup, and a new accept
+		 * may have got the same fd. Only send if the frame was sealed
+		 * for whoever holds it now.
+		 */
+		err = get_user_by_socket(dfd, &pn);
+		if (likely(!err && pn == p))
+			write_exact(dfd, buff, sizeof(struct ct_proto) + clen, 0);
 
-		memset(buff, 0, len);
+		mutexlock_unlock(lock);
 	}
 
 	return keep;
@@ -343,6 +428,27 @@ static void handler_tcp_notify_close(int fd)
 	if (write(fd, &hdr, sizeof(hdr))) { ; }
 }
 
+static void handler_tcp_close(const struct worker_struct *ws, int fd)
+{
+	struct mutexlock *lock = conn_lock(fd);
+
+	mutexlock_lock(lock);
+
+	remove_user_by_socket(fd);
+	trie_addr_remove(fd);
+	handler_tcp_notify_close(fd);
+
+	set_epoll_descriptor2(ws->epfd, EPOLL_CTL_DEL, fd, 0);
+	unregister_socket(fd);
+	close(fd);
+
+	mutexlock_unlock(lock);
+
+	syslog_maybe(auth_log, LOG_INFO, "Closed connection with id %d (%d "
+		     "active client connections remain)\n", fd,
+		     __atomic_sub_fetch(&conns, 1, __ATOMIC_RELAXED));
+}
+
 static int handler_tcp_net_to_tun(int fd, const struct worker_struct *ws,
 				  char *buff, size_t len)
 {
@@ -368,10 +474,7 @@ static int handler_tcp_net_to_tun(int fd, const struct worker_struct *ws,
 			goto close;
 		if (hdr->flags & PROTO_FLAG_EXIT) {
 close:
-			remove_user_by_socket(fd);
-			trie_addr_remove(fd);
-			handler_tcp_notify_close(fd);
-			rlen = write(ws->parent.efd, &fd, sizeof(fd));
+			handler_tcp_close(ws, fd);
 
 			keep = 0;
 			return keep;
@@ -413,16 +516,21 @@ close:
 		if (unlikely(err))
 			continue;
 
-		err = write(ws->parent.tunfd, cbuff, clen);
+		err = write(ws->tunfd, cbuff, clen);
 
 		count++;
 		if (count == 10) {
-			write_exact(ws->efd[1], &fd, sizeof(fd), 1);
-			/* Read later next data and let others process */
+			/* Read later next data and let others process,
+			 * epoll is level-triggered and reports us again.
+			 */
 			return keep;
 		}
 	}
 
+	/* Peer went away, don't leave a readable EOF in our epoll */
+	if (rlen == 0 || (rlen < 0 && errno != EAGAIN))
+		goto close;
+
 	return keep;
 }
 
@@ -431,7 +539,7 @@ static int handler_tcp(int fd, const struct worker_struct *ws,
 {
 	int ret = 0;
 
-	if (fd == ws->parent.tunfd)
+	if (fd == ws->tunfd)
 		ret = handler_tcp_tun_to_net(fd, ws, buff, len);
 	else
 		ret = handler_tcp_net_to_tun(fd, ws, buff, len);
@@ -441,16 +549,12 @@ static int handler_tcp(int fd, const struct worker_struct *ws,
 
 static void *worker(void *self)
 {
-	int fd, old_state;
-	ssize_t ret;
+	int fd, i, nfds, old_state;
 	size_t blen = TUNBUFF_SIZ; //FIXME
 	const struct worker_struct *ws = self;
-	struct pollfd fds;
+	struct epoll_event events[MAX_WORKER_EVENTS];
 	char *buff;
 
-	fds.fd = ws->efd[0];
-	fds.events = POLLIN;
-
 	curve25519_alloc_or_maybe_die(ws->c);
 
 	buff = xmalloc_aligned(blen, 64);
@@ -462,21 +566,24 @@ static void *worker(void *self)
 	pthread_cleanup_push(xfree_func, buff);
 
 	while (likely(!sigint)) {
-		poll(&fds, 1, -1);
-		if ((fds.revents & POLLIN) != POLLIN)
-			continue;
+		nfds = epoll_wait(ws->epfd, events, array_size(events), -1);
+		if (nfds < 0) {
+			if (errno == EINTR)
+				continue;
+			syslog(LOG_ERR, "epoll_wait error: %s\n",
+			       strerror(errno));
+			break;
+		}
 
 		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old_state);
 
-		while ((ret = read_exact(ws->efd[0], &fd, sizeof(fd), 1)) > 0) {
-			if (ret != sizeof(fd)) {
-				sched_yield();
+		for (i = 0; i < nfds; ++i) {
+			fd = events[i].data.fd;
+			/* Only written to for waking us up on shutdown */
+			if (fd == ws->efd[0])
 				continue;
-			}
 
-			ret = ws->handler(fd, ws, buff, blen);
-			if (ret)
-				write_exact(ws->parent.refd, &fd, sizeof(fd), 1);
+			ws->handler(fd, ws, buff, blen);
 		}
 
 		pthread_setcancelstate(old_state, NULL);
@@ -491,70 +598,141 @@ static void *worker(void *self)
 	pthread_exit((void *) ((long) ws->cpu));
 }
 
-static void thread_spawn_or_panic(unsigned int cpus, int efd, int refd,
-				  int tunfd, int ipv4, int udp)
+static int udp_socket_clone_or_panic(int lfd)
+{
+	int fd, ret;
+	struct sockaddr_storage addr;
+	socklen_t alen = sizeof(addr);
+
+	ret = getsockname(lfd, (struct sockaddr *) &addr, &alen);
+	if (ret < 0)
+		syslog_panic("Cannot get socket address!\n");
+
+	fd = socket(addr.ss_family, SOCK_DGRAM, IPPROTO_UDP);
+	if (fd < 0)
+		syslog_panic("Cannot create socket!\n");
+
+	if (addr.ss_family == AF_INET6 && set_ipv6_only(fd) < 0)
+		syslog_panic("Cannot set IPv6 only!\n");
+
+	set_reuseaddr(fd);
+	set_reuseport(fd);
+	set_mtu_disc_dont(fd);
+
+	ret = bind(fd, (struct sockaddr *) &addr, alen);
+	if (ret < 0)
+		syslog_panic("Cannot bind reuseport socket: %s\n",
+			     strerror(errno));
+
+	set_nonblocking(fd);
+
+	return fd;
+}
+
+static void thread_spawn_or_panic(unsigned int threads, unsigned int cpus,
+				  char *dev, int lfd, int ipv4, int udp)
 {
 	int i, ret;
 	cpu_set_t cpuset;
-	unsigned int threads;
+	sigset_t block, old;
+	struct worker_struct *ws;
 
-	threads = cpus * THREADS_PER_CPU;
+	for (i = 0; i < CONN_LOCKS; ++i)
+		mutexlock_init(&conn_locks[i]);
+
+	/* Signals are for the main thread, it wakes the workers up */
+	sigfillset(&block);
+	pthread_sigmask(SIG_BLOCK, &block, &old);
 
 	for (i = 0; i < threads; ++i) {
+		ws = &threadpool[i];
+
 		CPU_ZERO(&cpuset);
-		threadpool[i].cpu = i % cpus;
-		CPU_SET(threadpool[i].cpu, &cpuset);
+		ws->cpu = i % cpus;
+		CPU_SET(ws->cpu, &cpuset);
 
-		ret = pipe2(threadpool[i].efd, O_NONBLOCK);
+		ret = pipe2(ws->efd, O_NONBLOCK);
 		if (ret < 0)
 			syslog_panic("Cannot create event socket!\n");
 
-		threadpool[i].c = xmalloc_aligned(sizeof(*threadpool[i].c), 64);
-		threadpool[i].parent.efd = efd;
-		threadpool[i].parent.refd = refd;
-		threadpool[i].parent.tunfd = tunfd;
-		threadpool[i].parent.ipv4 = ipv4;
-		threadpool[i].parent.udp = udp;
-		threadpool[i].handler = udp ? handler_udp : handler_tcp;
+		ws->epfd = epoll_create(MAX_EPOLL_SIZE);
+		if (ws->epfd < 0)
+			syslog_panic("Cannot create epoll instance!\n");
+
+		set_epoll_descriptor(ws->epfd, EPOLL_CTL_ADD, ws->efd[0],
+				     EPOLLIN);
+
+		/* Beyond the queue limit, workers only serve the network
+		 * side and hand decrypted packets to a sibling's queue.
+		 */
+		if (i < MAX_TUN_QUEUES) {
+			ws->tunfd = tun_open_or_die(dev, IFF_TUN | IFF_NO_PI |
+						    IFF_MULTI_QUEUE);
+			set_epoll_descriptor(ws->epfd, EPOLL_CTL_ADD,
+					     ws->tunfd, EPOLLIN);
+		} else {
+			ws->tunfd = threadpool[i % MAX_TUN_QUEUES].tunfd;
+		}
+
+		ws->sock = -1;
+		if (udp) {
+			ws->sock = i == 0 ? lfd : udp_socket_clone_or_panic(lfd);
+			set_epoll_descriptor(ws->epfd, EPOLL_CTL_ADD, ws->sock,
+					     EPOLLIN);
+
+			ws->batch = udp_batch_alloc(TUNBUFF_SIZ);
+		}
+
+		ws->c = xmalloc_aligned(sizeof(*ws->c), 64);
+		ws->parent.ipv4 = ipv4;
+		ws->parent.udp = udp;
+		ws->handler = udp ? handler_udp : handler_tcp;
 
-		ret = pthread_create(&threadpool[i].trid, NULL,
-				     worker, &threadpool[i]);
+		ret = pthread_create(&ws->trid, NULL, worker, ws);
 		if (ret < 0)
 			syslog_panic("Thread creation failed!\n");
 
-		ret = pthread_setaffinity_np(threadpool[i].trid,
-					     sizeof(cpuset), &cpuset);
+		ret = pthread_setaffinity_np(ws->trid, sizeof(cpuset), &cpuset);
 		if (ret < 0)
 			syslog_panic("Thread CPU migration failed!\n");
-
-		pthread_detach(threadpool[i].trid);
 	}
 
-	sleep(1);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
 }
 
-static void thread_finish(unsigned int cpus)
+static void thread_finish(unsigned int threads, int lfd)
 {
 	int i;
-	unsigned int threads;
-
-	threads = cpus * THREADS_PER_CPU;
+	struct worker_struct *ws;
 
 	for (i = 0; i < threads; ++i) {
-		while (pthread_join(threadpool[i].trid, NULL) < 0)
-			;
+		ws = &threadpool[i];
 
-		close(threadpool[i].efd[0]);
-		close(threadpool[i].efd[1]);
+		if (write(ws->efd[1], &i, sizeof(i))) { ; }
+		pthread_join(ws->trid, NULL);
+
+		close(ws->efd[0]);
+		close(ws->efd[1]);
+		close(ws->epfd);
+
+		if (i < MAX_TUN_QUEUES)
+			close(ws->tunfd);
+		if (ws->sock >= 0 && ws->sock != lfd)
+			close(ws->sock);
+		if (ws->batch)
+			udp_batch_free(ws->batch);
 	}
+
+	for (i = 0; i < CONN_LOCKS; ++i)
+		mutexlock_destroy(&conn_locks[i]);
 }
 
 int server_main(char *home, char *dev, char *port, int udp, int ipv4, int log)
 {
-	int lfd = -1, kdpfd, nfds, nfd, curfds, efd[2], refd[2], tunfd, i;
-	unsigned int cpus = 0, threads, udp_cpu = 0;
+	int lfd = -1, kdpfd, nfds, nfd, i;
+	unsigned int cpus = 0, threads;
 	ssize_t ret;
-	struct epoll_event *events;
+	struct epoll_event events[1];
 	struct addrinfo hints, *ahead, *ai;
 
 	auth_log = !!log;
@@ -595,6 +773,8 @@ int server_main(char *home, char *dev, char *port, int udp, int ipv4, int log)
 		}
 
 		set_reuseaddr(lfd);
+		if (udp)
+			set_reuseport(lfd);
 		set_mtu_disc_dont(lfd);
 
 		ret = bind(lfd, ai->ai_addr, ai->ai_addrlen);
@@ -630,173 +810,95 @@ int server_main(char *home, char *dev, char *port, int udp, int ipv4, int log)
 	if (lfd < 0 || ipv4 < 0)
 		syslog_panic("Cannot create socket!\n");
 
-	tunfd = tun_open_or_die(dev ? dev : DEVNAME_SERVER, IFF_TUN | IFF_NO_PI);
-
-	pipe_or_die(efd, O_NONBLOCK);
-	pipe_or_die(refd, O_NONBLOCK);
-
 	set_nonblocking(lfd);
 
-	events = xzmalloc(MAX_EPOLL_SIZE * sizeof(*events));
-	for (i = 0; i < MAX_EPOLL_SIZE; ++i)
-		events[i].data.fd = -1;
-
-	kdpfd = epoll_create(MAX_EPOLL_SIZE);
+	/* With UDP the main thread only waits for signals */
+	kdpfd = epoll_create(1);
 	if (kdpfd < 0)
 		syslog_panic("Cannot create socket!\n");
-
-	set_epoll_descriptor(kdpfd, EPOLL_CTL_ADD, lfd,
-			     udp ? EPOLLIN | EPOLLET | EPOLLONESHOT : EPOLLIN);
-	set_epoll_descriptor(kdpfd, EPOLL_CTL_ADD, efd[0], EPOLLIN);
-	set_epoll_descriptor(kdpfd, EPOLL_CTL_ADD, refd[0], EPOLLIN);
-	set_epoll_descriptor(kdpfd, EPOLL_CTL_ADD, tunfd,
-			     EPOLLIN | EPOLLET | EPOLLONESHOT);
-	curfds = 4;
+	if (!udp)
+		set_epoll_descriptor(kdpfd, EPOLL_CTL_ADD, lfd, EPOLLIN);
 
 	trie_init();
 
 	cpus = get_number_cpus_online();
 	threads = cpus * THREADS_PER_CPU;
-	if (!ispow2(threads))
-		syslog_panic("Thread number not power of two!\n");
 
 	threadpool = xzmalloc(sizeof(*threadpool) * threads);
-	thread_spawn_or_panic(cpus, efd[1], refd[1], tunfd, ipv4, udp);
+	thread_spawn_or_panic(threads, cpus, dev ? dev : DEVNAME_SERVER,
+			      lfd, ipv4, udp);
 
 	init_cpusched(threads);
 
-	register_socket(tunfd);
-	register_socket(lfd);
-
 	syslog(LOG_INFO, "curvetun up and running!\n");
 
 	while (likely(!sigint)) {
-		nfds = epoll_wait(kdpfd, events, curfds, -1);
+		nfds = epoll_wait(kdpfd, events, array_size(events), -1);
 		if (nfds < 0) {
+			if (errno == EINTR)
+				continue;
 			syslog(LOG_ERR, "epoll_wait error: %s\n",
 			       strerror(errno));
 			break;
 		}
 
 		for (i = 0; i < nfds; ++i) {
-			if (unlikely(events[i].data.fd < 0))
+			int thread;
+			char hbuff[256], sbuff[256];
+			struct sockaddr_storage taddr;
+			socklen_t tlen;
+
+			tlen = sizeof(taddr);
+			nfd = accept(lfd, (struct sockaddr *) &taddr, &tlen);
+			if (nfd < 0) {
+				syslog(LOG_ERR, "accept error: %s\n",
+				       strerror(errno));
 				continue;
+			}
+
+			if (__atomic_load_n(&conns, __ATOMIC_RELAXED) + 1 >
+			    MAX_EPOLL_SIZE) {
+				close(nfd);
+				continue;
+			}
 
-			if (events[i].data.fd == lfd && !udp) {
-				int ncpu;
-				char hbuff[256], sbuff[256];
-				struct sockaddr_storage taddr;
-				socklen_t tlen;
-
-				tlen = sizeof(taddr);
-				nfd = accept(lfd, (struct sockaddr *) &taddr,
-					     &tlen);
-				if (nfd < 0) {
-					syslog(LOG_ERR, "accept error: %s\n",
-					       strerror(errno));
-					continue;
-				}
-
-				if (curfds + 1 > MAX_EPOLL_SIZE) {
-					close(nfd);
-					continue;
-				}
-
-				curfds++;
-
-				ncpu = register_socket(nfd);
-
-				memset(hbuff, 0, sizeof(hbuff));
-				memset(sbuff, 0, sizeof(sbuff));
-				getnameinfo((struct sockaddr *) &taddr, tlen,
-					    hbuff, sizeof(hbuff),
-					    sbuff, sizeof(sbuff),
-					    NI_NUMERICHOST | NI_NUMERICSERV);
-
-				syslog_maybe(auth_log, LOG_INFO, "New connection "
-					     "from %s:%s (%d active client connections) -  id %d on CPU%d",
-					     hbuff, sbuff, curfds-4, nfd, ncpu);
-
-				set_nonblocking(nfd);
-				set_socket_keepalive(nfd);
-				set_tcp_nodelay(nfd);
-				ret = set_epoll_descriptor2(kdpfd, EPOLL_CTL_ADD,
-						nfd, EPOLLIN | EPOLLET | EPOLLONESHOT);
-				if (ret < 0) {
-					close(nfd);
-					curfds--;
-					continue;
-				}
-			} else if (events[i].data.fd == refd[0]) {
-				int fd_one;
-
-				ret = read_exact(refd[0], &fd_one,
-						 sizeof(fd_one), 1);
-				if (ret != sizeof(fd_one) || fd_one <= 0)
-					continue;
-
-				ret = set_epoll_descriptor2(kdpfd, EPOLL_CTL_MOD,
-						fd_one, EPOLLIN | EPOLLET | EPOLLONESHOT);
-				if (ret < 0) {
-					close(fd_one);
-					continue;
-				}
-			} else if (events[i].data.fd == efd[0]) {
-				int fd_del, test;
-
-				ret = read_exact(efd[0], &fd_del,
-						 sizeof(fd_del), 1);
-				if (ret != sizeof(fd_del) || fd_del <= 0)
-					continue;
-
-				ret = read(fd_del, &test, sizeof(test));
-				if (ret < 0 && errno == EBADF)
-					continue;
-
-				ret = set_epoll_descriptor2(kdpfd, EPOLL_CTL_DEL,
-						fd_del, 0);
-				if (ret < 0) {
-					close(fd_del);
-					continue;
-				}
-
-				close(fd_del);
-				curfds--;
-				unregister_socket(fd_del);
-
-				syslog_maybe(auth_log, LOG_INFO, "Closed connection "
-					     "with id %d (%d active client connections remain)\n", fd_del,
-					     curfds-4);
-			} else {
-				int cpu, fd_work = events[i].data.fd;
-
-				if (!udp)
-					cpu = socket_to_cpu(fd_work);
-				else
-					udp_cpu = (udp_cpu + 1) & (threads - 1);
-
-				write_exact(threadpool[udp ? udp_cpu : cpu].efd[1],
-					    &fd_work, sizeof(fd_work), 1);
+			thread = register_socket(nfd);
+
+			memset(hbuff, 0, sizeof(hbuff));
+			memset(sbuff, 0, sizeof(sbuff));
+			getnameinfo((struct sockaddr *) &taddr, tlen,
+				    hbuff, sizeof(hbuff),
+				    sbuff, sizeof(sbuff),
+				    NI_NUMERICHOST | NI_NUMERICSERV);
+
+			syslog_maybe(auth_log, LOG_INFO, "New connection "
+				     "from %s:%s (%d active client connections) -  id %d on CPU%d",
+				     hbuff, sbuff,
+				     __atomic_add_fetch(&conns, 1, __ATOMIC_RELAXED),
+				     nfd, threadpool[thread].cpu);
+
+			set_nonblocking(nfd);
+			set_socket_keepalive(nfd);
+			set_tcp_nodelay(nfd);
+			ret = set_epoll_descriptor2(threadpool[thread].epfd,
+						    EPOLL_CTL_ADD, nfd, EPOLLIN);
+			if (ret < 0) {
+				unregister_socket(nfd);
+				close(nfd);
+				__atomic_sub_fetch(&conns, 1, __ATOMIC_RELAXED);
+				continue;
 			}
 		}
 	}
 
 	syslog(LOG_INFO, "curvetun prepare shut down!\n");
 
-	close(lfd);
-	close(efd[0]);
-	close(efd[1]);
-	close(refd[0]);
-	close(refd[1]);
-	close(tunfd);
+	thread_finish(threads, lfd);
 
-	thread_finish(cpus);
+	close(kdpfd);
+	close(lfd);
 
 	xfree(threadpool);
-	xfree(events);
-
-	unregister_socket(lfd);
-	unregister_socket(tunfd);
 
 	destroy_cpusched();
 
@@ -23,7 +23,6 @@
 #include "xio.h"
 #include "die.h"
 #include "curvetun.h"
-#include "locking.h"
 #include "crypto_verify_32.h"
 #include "crypto_box_curve25519xsalsa20poly1305.h"
 #include "crypto_scalarmult_curve25519.h"
@@ -131,27 +130,14 @@ int curve25519_pubkey_hexparse_32(unsigned char *bin, size_t blen,
 
 void curve25519_alloc_or_maybe_die(struct curve25519_struct *curve)
 {
-	curve->enc_buf_size = curve->dec_buf_size = TUNBUFF_SIZ;
-
-	curve->enc_buf = xmalloc_aligned(curve->enc_buf_size, 16);
-	curve->dec_buf = xmalloc_aligned(curve->dec_buf_size, 16);
-
-	spinlock_init(&curve->enc_lock);
-	spinlock_init(&curve->dec_lock);
+	curve->enc_size = curve->dec_size = TUNBUFF_SIZ;
 }
 
 void curve25519_free(void *curvep)
 {
 	struct curve25519_struct *curve = curvep;
 
-	memset(curve->enc_buf, 0, curve->enc_buf_size);
-	memset(curve->dec_buf, 0, curve->dec_buf_size);
-
-        xfree(curve->enc_buf);
-        xfree(curve->dec_buf);
-
-        spinlock_destroy(&curve->enc_lock);
-        spinlock_destroy(&curve->dec_lock);
+	curve->enc_size = curve->dec_size = 0;
 }
 
 int curve25519_proto_init(struct curve25519_proto *proto, unsigned char *pubkey_remote,
@@ -199,60 +185,56 @@ int curve25519_proto_init(struct curve25519_proto *proto, unsigned char *pubkey_
 	return 0;
 }
 
+/*
+ * Encrypts in place: the first crypto_box_zerobytes of plaintext must be
+ * zero, the ciphertext starts at plaintext again on return.
+ */
 ssize_t curve25519_encode(struct curve25519_struct *curve, struct curve25519_proto *proto,
 			  unsigned char *plaintext, size_t size, unsigned char **chipertext)
 {
 	int ret, i;
-	ssize_t done = size;
 	struct taia packet_taia;
+	/* Workers may encrypt for the same peer concurrently */
+	unsigned char nonce[crypto_box_noncebytes];
 
-	spinlock_lock(&curve->enc_lock);
-
-	if (unlikely(size > curve->enc_buf_size)) {
-		done = -ENOMEM;
-		goto out;
-	}
+	if (unlikely(size > curve->enc_size))
+		return -ENOMEM;
 
 	taia_now(&packet_taia);
-	taia_pack(proto->enonce + NONCE_OFFSET, &packet_taia);
+	fmemcpy(nonce, proto->enonce, sizeof(nonce));
+	taia_pack(nonce + NONCE_OFFSET, &packet_taia);
 
-	memset(curve->enc_buf, 0, curve->enc_buf_size);
-	ret = crypto_box_afternm(curve->enc_buf, plaintext, size, proto->enonce, proto->key);
-	if (unlikely(ret)) {
-		done = -EIO;
-		goto out;
-	}
+	ret = crypto_box_afternm(plaintext, plaintext, size, nonce, proto->key);
+	if (unlikely(ret))
+		return -EIO;
 
-	fmemcpy(curve->enc_buf + crypto_box_boxzerobytes - NONCE_LENGTH,
-	       proto->enonce + NONCE_OFFSET, NONCE_LENGTH);
+	fmemcpy(plaintext + crypto_box_boxzerobytes - NONCE_LENGTH,
+	       nonce + NONCE_OFFSET, NONCE_LENGTH);
 
 	for (i = 0; i < crypto_box_boxzerobytes - NONCE_LENGTH; ++i)
-		curve->enc_buf[i] = (uint8_t) secrand();
+		plaintext[i] = (uint8_t) secrand();
+
+	(*chipertext) = plaintext;
 
-	(*chipertext) = curve->enc_buf;
-out:
-	spinlock_unlock(&curve->enc_lock);
-	return done;
+	return size;
 }
 
+/*
+ * Decrypts in place. The ciphertext is only overwritten if it
+ * authenticates, so callers may try several peers on the same buffer.
+ */
 ssize_t curve25519_decode(struct curve25519_struct *curve, struct curve25519_proto *proto,
 			  unsigned char *chipertext, size_t size, unsigned char **plaintext,
 			  struct taia *arrival_taia)
 {
 	int ret;
-	ssize_t done = size;
 	struct taia packet_taia, arrival_taia2;
 
-	spinlock_lock(&curve->dec_lock);
+	if (unlikely(size > curve->dec_size))
+		return -ENOMEM;
+	if (unlikely(size < crypto_box_boxzerobytes + NONCE_LENGTH))
+		return 0;
 
-	if (unlikely(size > curve->dec_buf_size)) {
-		done = -ENOMEM;
-		goto out;
-	}
-	if (unlikely(size < crypto_box_boxzerobytes + NONCE_LENGTH)) {
-		done = 0;
-		goto out;
-	}
 	if (arrival_taia == NULL) {
 		taia_now(&arrival_taia2);
 		arrival_taia = &arrival_taia2;
@@ -261,21 +243,16 @@ ssize_t curve25519_decode(struct curve25519_struct *curve, struct curve25519_pro
 	taia_unpack(chipertext + crypto_box_boxzerobytes - NONCE_LENGTH, &packet_taia);
         if (is_good_taia(arrival_taia, &packet_taia) == 0) {
 		syslog(LOG_ERR, "Bad packet time! Dropping connection!\n");
-		done = 0;
-		goto out;
+		return 0;
 	}
 
 	memcpy(proto->dnonce + NONCE_OFFSET, chipertext + crypto_box_boxzerobytes - NONCE_LENGTH, NONCE_LENGTH);
-	memset(curve->dec_buf, 0, curve->dec_buf_size);
 
-	ret = crypto_box_open_afternm(curve->dec_buf, chipertext, size, proto->dnonce, proto->key);
-	if (unlikely(ret)) {
-		done = -EIO;
-		goto out;
-	}
+	ret = crypto_box_open_afternm(chipertext, chipertext, size, proto->dnonce, proto->key);
+	if (unlikely(ret))
+		return -EIO;
+
+	(*plaintext) = chipertext;
 
-	(*plaintext) = curve->dec_buf;
-out:
-	spinlock_unlock(&curve->dec_lock);
-	return done;
+	return size;
 }
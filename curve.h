@@ -10,7 +10,6 @@
 #include <stdint.h>
 #include <sys/time.h>
 
-#include "locking.h"
 #include "built_in.h"
 #include "xio.h"
 #include "crypto_box_curve25519xsalsa20poly1305.h"
@@ -43,13 +42,10 @@ struct curve25519_proto {
 	unsigned char key[crypto_box_noncebytes] __aligned_16;
 };
 
+/* Per-thread, en/decoding works in place on the caller's buffer. */
 struct curve25519_struct {
-	unsigned char *enc_buf;
-	unsigned char *dec_buf;
-	size_t enc_buf_size;
-	size_t dec_buf_size;
-	struct spinlock enc_lock;
-	struct spinlock dec_lock;
+	size_t enc_size;
+	size_t dec_size;
 };
 
 extern void curve25519_selftest(void);
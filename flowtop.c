@@ -31,8 +31,14 @@
 #include <dirent.h>
 #include <sys/stat.h>
 #include <sys/fsuid.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <arpa/inet.h>
 #include <urcu.h>
 #include <libgen.h>
+#include <time.h>
 
 #include "die.h"
 #include "xmalloc.h"
@@ -44,25 +50,72 @@
 #include "dissector_eth.h"
 #include "pkt_buff.h"
 
+/* Hot part of a flow: what every conntrack event updates and what the
+ * presenter filters on. Kept small so that walking the table touches as
+ * few cache lines as possible.
+ */
 struct flow_entry {
 	uint32_t flow_id, use, status;
 	uint8_t  l3_proto, l4_proto;
+	uint8_t  tcp_state, tcp_flags, sctp_state, dccp_state;
+	uint16_t port_src, port_dst;
+	uint8_t  active, proc_gen;
 	uint32_t ip4_src_addr, ip4_dst_addr;
 	uint32_t ip6_src_addr[4], ip6_dst_addr[4];
-	uint16_t port_src, port_dst;
-	uint8_t  tcp_state, tcp_flags, sctp_state, dccp_state;
 	uint64_t counter_pkts, counter_bytes;
 	uint64_t timestamp_start, timestamp_stop;
+	/* Rates, maintained by the presenter: rate_id tells whose counters
+	 * last_* are, so a recycled slot starts over.
+	 */
+	uint64_t last_pkts, last_bytes;
+	float rate_pps, rate_bps;
+	uint32_t rate_id, first_seen;
+};
+
+/* Cold part: enrichment that is looked up once per flow and only read
+ * for lines that are actually drawn. Lives at the same slot index as
+ * its hot counterpart, but in a separate array.
+ */
+struct flow_entry_ext {
 	char country_src[128], country_dst[128];
 	char city_src[128], city_dst[128];
 	char rev_dns_src[256], rev_dns_dst[256];
 	char cmdline[256];
-	struct flow_entry *next;
 	int procnum, inode;
+	uint32_t dump_gen;	/* last conntrack dump that listed us */
+};
+
+#define FLOW_CHUNK_SHIFT	12
+#define FLOW_CHUNK_SIZE		(1 << FLOW_CHUNK_SHIFT)
+#define FLOW_CHUNK_MAX		2048
+#define FLOW_TABLE_MIN		1024
+
+#define PROCIDX_IVAL		2
+#define PROCIDX_DONE		0xff	/* proc_gen: owner found, or n/a */
+
+struct flow_bucket {
+	uint32_t flow_id;
+	uint32_t slot;		/* slot + 1, 0 marks an empty bucket */
 };
 
 struct flow_list {
-	struct flow_entry *head;
+	/* Entries are allocated from fixed-size chunks that never move, so
+	 * the presenter can walk slots 0 .. used - 1 without the lock.
+	 */
+	struct flow_entry *hot[FLOW_CHUNK_MAX];
+	struct flow_entry_ext *cold[FLOW_CHUNK_MAX];
+	uint32_t chunks, used, count;
+	/* Slots freed in the current batch are collected in dead and
+	 * handed to call_rcu() as a whole once the batch is done.
+	 */
+	uint32_t *free, nfree, *dead, ndead;
+	/* Open addressing with linear probing, keyed by ATTR_ID, only
+	 * touched by the collector.
+	 */
+	struct flow_bucket *table;
+	uint32_t mask;
+	/* Bumped per conntrack dump, to sweep what a dump did not list */
+	uint32_t dump_gen;
 	struct spinlock lock;
 };
 
@@ -75,6 +128,21 @@ struct flow_list {
 
 #define SCROLL_MAX 1000
 
+/* Screen refresh and rate sampling interval, EWMA time constant */
+#define REFRESH_IVAL	1.0
+#define RATE_TAU	3.0
+
+enum flow_sort {
+	SORT_RATE,
+	SORT_BYTES,
+	SORT_AGE,
+};
+
+struct flow_top {
+	uint64_t key;
+	uint32_t slot;
+};
+
 #define INCLUDE_IPV4	(1 << 0)
 #define INCLUDE_IPV6	(1 << 1)
 #define INCLUDE_UDP	(1 << 2)
@@ -86,10 +154,18 @@ struct flow_list {
 volatile sig_atomic_t sigint = 0;
 
 static int what = INCLUDE_IPV4 | INCLUDE_IPV6 | INCLUDE_TCP, show_src = 0;
+static enum flow_sort sort_by = SORT_RATE;
+static unsigned int nl_bufsize = 0, nl_rcvbuf = 0, nl_overruns = 0;
+
+static const char *const sort2str[] = {
+	[SORT_RATE]	= "rate",
+	[SORT_BYTES]	= "bytes",
+	[SORT_AGE]	= "age",
+};
 
 static struct flow_list flow_list;
 
-static const char *short_options = "vhTUsDIS46u";
+static const char *short_options = "vhTUsDIS46ub:e:F:i:";
 static const struct option long_options[] = {
 	{"ipv4",	no_argument,		NULL, '4'},
 	{"ipv6",	no_argument,		NULL, '6'},
@@ -100,6 +176,10 @@ static const struct option long_options[] = {
 	{"sctp",	no_argument,		NULL, 'S'},
 	{"show-src",	no_argument,		NULL, 's'},
 	{"update",	no_argument,		NULL, 'u'},
+	{"bufsize",	required_argument,	NULL, 'b'},
+	{"export",	required_argument,	NULL, 'e'},
+	{"format",	required_argument,	NULL, 'F'},
+	{"interval",	required_argument,	NULL, 'i'},
 	{"version",	no_argument,		NULL, 'v'},
 	{"help",	no_argument,		NULL, 'h'},
 	{NULL, 0, NULL, 0}
@@ -145,19 +225,6 @@ static const char *const tcp_state2str[TCP_CONNTRACK_MAX] = {
 	[TCP_CONNTRACK_SYN_SENT2]	= "SYN_SENT2",
 };
 
-static const uint8_t tcp_states[] = {
-	TCP_CONNTRACK_SYN_SENT,
-	TCP_CONNTRACK_SYN_RECV,
-	TCP_CONNTRACK_ESTABLISHED,
-	TCP_CONNTRACK_FIN_WAIT,
-	TCP_CONNTRACK_CLOSE_WAIT,
-	TCP_CONNTRACK_LAST_ACK,
-	TCP_CONNTRACK_TIME_WAIT,
-	TCP_CONNTRACK_CLOSE,
-	TCP_CONNTRACK_SYN_SENT2,
-	TCP_CONNTRACK_NONE,
-};
-
 static const char *const dccp_state2str[DCCP_CONNTRACK_MAX] = {
 	[DCCP_CONNTRACK_NONE]		= "NOSTATE",
 	[DCCP_CONNTRACK_REQUEST]	= "REQUEST",
@@ -171,19 +238,6 @@ static const char *const dccp_state2str[DCCP_CONNTRACK_MAX] = {
 	[DCCP_CONNTRACK_INVALID]	= "INVALID",
 };
 
-static const uint8_t dccp_states[] = {
-	DCCP_CONNTRACK_NONE,
-	DCCP_CONNTRACK_REQUEST,
-	DCCP_CONNTRACK_RESPOND,
-	DCCP_CONNTRACK_PARTOPEN,
-	DCCP_CONNTRACK_OPEN,
-	DCCP_CONNTRACK_CLOSEREQ,
-	DCCP_CONNTRACK_CLOSING,
-	DCCP_CONNTRACK_TIMEWAIT,
-	DCCP_CONNTRACK_IGNORE,
-	DCCP_CONNTRACK_INVALID,
-};
-
 static const char *const sctp_state2str[SCTP_CONNTRACK_MAX] = {
 	[SCTP_CONNTRACK_NONE]		= "NOSTATE",
 	[SCTP_CONNTRACK_CLOSED]		= "CLOSED",
@@ -195,17 +249,6 @@ static const char *const sctp_state2str[SCTP_CONNTRACK_MAX] = {
 	[SCTP_CONNTRACK_SHUTDOWN_ACK_SENT] = "SHUTDOWN_ACK_SENT",
 };
 
-static const uint8_t sctp_states[] = {
-	SCTP_CONNTRACK_NONE,
-	SCTP_CONNTRACK_CLOSED,
-	SCTP_CONNTRACK_COOKIE_WAIT,
-	SCTP_CONNTRACK_COOKIE_ECHOED,
-	SCTP_CONNTRACK_ESTABLISHED,
-	SCTP_CONNTRACK_SHUTDOWN_SENT,
-	SCTP_CONNTRACK_SHUTDOWN_RECD,
-	SCTP_CONNTRACK_SHUTDOWN_ACK_SENT,
-};
-
 static const struct nfct_filter_ipv4 filter_ipv4 = {
 	.addr = __constant_htonl(INADDR_LOOPBACK),
 	.mask = 0xffffffff,
@@ -229,7 +272,10 @@ static void signal_handler(int number)
 }
 
 static void flow_entry_from_ct(struct flow_entry *n, struct nf_conntrack *ct);
-static void flow_entry_get_extended(struct flow_entry *n);
+static void flow_entry_get_extended(struct flow_entry *n,
+				    struct flow_entry_ext *e, uint32_t slot);
+static void flow_entry_get_process(struct flow_entry *n,
+				   struct flow_entry_ext *e);
 
 static void help(void)
 {
@@ -247,11 +293,23 @@ static void help(void)
 	     "  -S|--sctp              Show only SCTP flows\n"
 	     "  -s|--show-src          Also show source, not only dest\n"
 	     "  -u|--update            Update GeoIP databases\n"
+	     "  -b|--bufsize <bytes>   Netlink receive buffer size for events\n"
+	     "  -e|--export <dest>     No screen, write flow records to a file,\n"
+	     "                         - (stdout) or udp:<host>:<port>\n"
+	     "  -F|--format <fmt>      Export as json (default), csv or ipfix\n"
+	     "  -i|--interval <sec>    Export all flows every <sec> seconds,\n"
+	     "                         default: only when flows end\n"
 	     "  -v|--version           Print version\n"
 	     "  -h|--help              Print this help\n\n"
+	     "Keys:\n"
+	     "  r/b/a                  Order flows by rate, bytes or age\n"
+	     "  j/k, up/down           Scroll\n"
+	     "  q                      Quit\n\n"
 	     "Examples:\n"
 	     "  flowtop\n"
-	     "  flowtop -46UTDISs\n\n"
+	     "  flowtop -46UTDISs\n"
+	     "  flowtop -TU -e - -i 10\n"
+	     "  flowtop -e udp:127.0.0.1:4739 -F ipfix -i 60\n\n"
 	     "Note:\n"
 	     "  If netfilter is not running, you can activate it with e.g.:\n"
 	     "   iptables -A INPUT -p tcp -m state --state ESTABLISHED -j ACCEPT\n"
@@ -281,229 +339,573 @@ static void version(void)
 	die();
 }
 
-static inline struct flow_entry *flow_entry_xalloc(void)
+static inline struct flow_entry *flow_list_entry(struct flow_list *fl,
+						uint32_t slot)
 {
-	return xzmalloc(sizeof(struct flow_entry));
+	return &rcu_dereference(fl->hot[slot >> FLOW_CHUNK_SHIFT])
+		[slot & (FLOW_CHUNK_SIZE - 1)];
 }
 
-static inline void flow_entry_xfree(struct flow_entry *n)
+static inline struct flow_entry_ext *flow_list_ext(struct flow_list *fl,
+						   uint32_t slot)
 {
-	xfree(n);
+	return &rcu_dereference(fl->cold[slot >> FLOW_CHUNK_SHIFT])
+		[slot & (FLOW_CHUNK_SIZE - 1)];
 }
 
-static inline void flow_list_init(struct flow_list *fl)
+static inline uint32_t flow_list_used(struct flow_list *fl)
 {
-	fl->head = NULL;
-	spinlock_init(&fl->lock);
+	uint32_t used = uatomic_read(&fl->used);
+
+	cmm_smp_rmb();
+	return used;
 }
 
-static void flow_list_new_entry(struct flow_list *fl, struct nf_conntrack *ct)
+static inline uint32_t flow_hash(uint32_t id)
 {
-	struct flow_entry *n = flow_entry_xalloc();
+	id ^= id >> 16;
+	id *= 0x85ebca6b;
+	id ^= id >> 13;
+	id *= 0xc2b2ae35;
+	id ^= id >> 16;
 
-	flow_entry_from_ct(n, ct);
-	flow_entry_get_extended(n);
+	return id;
+}
+
+static void flow_list_init(struct flow_list *fl)
+{
+	fmemset(fl, 0, sizeof(*fl));
 
-	rcu_assign_pointer(n->next, fl->head);
-	rcu_assign_pointer(fl->head, n);
+	fl->mask = FLOW_TABLE_MIN - 1;
+	fl->table = xzmalloc(FLOW_TABLE_MIN * sizeof(*fl->table));
+
+	spinlock_init(&fl->lock);
 }
 
-static struct flow_entry *flow_list_find_id(struct flow_list *fl,
-					    uint32_t id)
+static struct flow_bucket *flow_table_find(struct flow_list *fl, uint32_t id)
 {
-	struct flow_entry *n = rcu_dereference(fl->head);
+	uint32_t i = flow_hash(id) & fl->mask;
 
-	while (n != NULL) {
-		if (n->flow_id == id)
-			return n;
+	while (fl->table[i].slot) {
+		if (fl->table[i].flow_id == id)
+			return &fl->table[i];
 
-		n = rcu_dereference(n->next);
+		i = (i + 1) & fl->mask;
 	}
 
 	return NULL;
 }
 
-static struct flow_entry *flow_list_find_prev_id(struct flow_list *fl,
-						 uint32_t id)
+static void flow_table_put(struct flow_bucket *table, uint32_t mask,
+			   uint32_t id, uint32_t slot)
 {
-	struct flow_entry *n = rcu_dereference(fl->head), *tmp;
+	uint32_t i = flow_hash(id) & mask;
 
-	if (n->flow_id == id)
-		return NULL;
+	while (table[i].slot)
+		i = (i + 1) & mask;
+
+	table[i].flow_id = id;
+	table[i].slot = slot + 1;
+}
+
+static void flow_table_insert(struct flow_list *fl, uint32_t id, uint32_t slot)
+{
+	/* Keep the load factor at or below 1/2, probe chains stay short */
+	if ((fl->count + 1) * 2 > fl->mask + 1) {
+		uint32_t i, mask = (fl->mask << 1) | 1;
+		struct flow_bucket *table;
+
+		table = xzmalloc((mask + 1) * sizeof(*table));
 
-	while ((tmp = rcu_dereference(n->next)) != NULL) {
-		if (tmp->flow_id == id)
-			return n;
+		for (i = 0; i <= fl->mask; i++) {
+			if (fl->table[i].slot)
+				flow_table_put(table, mask, fl->table[i].flow_id,
+					       fl->table[i].slot - 1);
+		}
 
-		n = tmp;
+		xfree(fl->table);
+		fl->table = table;
+		fl->mask = mask;
 	}
 
-	return NULL;
+	flow_table_put(fl->table, fl->mask, id, slot);
+	fl->count++;
+}
+
+static void flow_table_remove(struct flow_list *fl, struct flow_bucket *b)
+{
+	uint32_t i = b - fl->table, j = i, k;
+
+	/* Backward shift deletion, so that no tombstones are needed */
+	for (;;) {
+		j = (j + 1) & fl->mask;
+		if (!fl->table[j].slot)
+			break;
+
+		k = flow_hash(fl->table[j].flow_id) & fl->mask;
+		if ((j > i && (k <= i || k > j)) ||
+		    (j < i && (k <= i && k > j))) {
+			fl->table[i] = fl->table[j];
+			i = j;
+		}
+	}
+
+	fl->table[i].slot = 0;
+	fl->count--;
+}
+
+static uint32_t flow_list_slot_alloc(struct flow_list *fl)
+{
+	uint32_t slot, chunk;
+
+	if (fl->nfree > 0)
+		return fl->free[--fl->nfree];
+
+	slot = fl->used;
+	chunk = slot >> FLOW_CHUNK_SHIFT;
+
+	if (chunk == fl->chunks) {
+		size_t slots = (fl->chunks + 1) * FLOW_CHUNK_SIZE;
+
+		if (fl->chunks == FLOW_CHUNK_MAX)
+			panic("Too many flows to track!\n");
+
+		rcu_assign_pointer(fl->hot[chunk],
+				   xzmalloc(FLOW_CHUNK_SIZE * sizeof(struct flow_entry)));
+		rcu_assign_pointer(fl->cold[chunk],
+				   xzmalloc(FLOW_CHUNK_SIZE * sizeof(struct flow_entry_ext)));
+
+		fl->free = xrealloc(fl->free, 1, slots * sizeof(*fl->free));
+		fl->dead = xrealloc(fl->dead, 1, slots * sizeof(*fl->dead));
+		fl->chunks++;
+	}
+
+	cmm_smp_wmb();
+	uatomic_set(&fl->used, slot + 1);
+
+	return slot;
+}
+
+struct flow_dead {
+	struct rcu_head rcu;
+	struct flow_list *fl;
+	uint32_t len;
+	uint32_t slots[0];
+};
+
+/* Runs after a grace period: nobody looks at these slots anymore. */
+static void flow_list_reclaim_rcu(struct rcu_head *head)
+{
+	struct flow_dead *d = caa_container_of(head, struct flow_dead, rcu);
+	struct flow_list *fl = d->fl;
+
+	spinlock_lock(&fl->lock);
+	fmemcpy(&fl->free[fl->nfree], d->slots, d->len * sizeof(*d->slots));
+	fl->nfree += d->len;
+	spinlock_unlock(&fl->lock);
+
+	xfree(d);
+}
+
+/* Called with fl->lock held at the end of a batch of events. */
+static void flow_list_reclaim(struct flow_list *fl)
+{
+	struct flow_dead *d;
+
+	if (fl->ndead == 0)
+		return;
+
+	d = xmalloc(sizeof(*d) + fl->ndead * sizeof(*d->slots));
+	d->fl = fl;
+	d->len = fl->ndead;
+	fmemcpy(d->slots, fl->dead, fl->ndead * sizeof(*fl->dead));
+
+	fl->ndead = 0;
+
+	call_rcu(&d->rcu, flow_list_reclaim_rcu);
+}
+
+static void flow_list_new_entry(struct flow_list *fl, struct nf_conntrack *ct)
+{
+	uint32_t slot = flow_list_slot_alloc(fl);
+	struct flow_entry *n = flow_list_entry(fl, slot);
+	struct flow_entry_ext *e = flow_list_ext(fl, slot);
+
+	fmemset(n, 0, sizeof(*n));
+	fmemset(e, 0, sizeof(*e));
+
+	n->first_seen = time(NULL);
+	flow_entry_from_ct(n, ct);
+	flow_entry_get_extended(n, e, slot);
+
+	flow_table_insert(fl, n->flow_id, slot);
+
+	cmm_smp_wmb();
+	n->active = 1;
 }
 
 static void flow_list_update_entry(struct flow_list *fl,
 				   struct nf_conntrack *ct)
 {
-	int do_ext = 0;
+	struct flow_bucket *b;
 	struct flow_entry *n;
 
-	n = flow_list_find_id(fl, nfct_get_attr_u32(ct, ATTR_ID));
-	if (n == NULL) {
-		n = flow_entry_xalloc();
-		do_ext = 1;
+	b = flow_table_find(fl, nfct_get_attr_u32(ct, ATTR_ID));
+	if (b == NULL) {
+		flow_list_new_entry(fl, ct);
+		return;
 	}
 
+	n = flow_list_entry(fl, b->slot - 1);
 	flow_entry_from_ct(n, ct);
-	if (do_ext) {
-		flow_entry_get_extended(n);
 
-		rcu_assign_pointer(n->next, fl->head);
-		rcu_assign_pointer(fl->head, n);
-	}
+	if (n->proc_gen != PROCIDX_DONE)
+		flow_entry_get_process(n, flow_list_ext(fl, b->slot - 1));
 }
 
-static void flow_list_destroy_entry(struct flow_list *fl,
-				    struct nf_conntrack *ct)
+static void flow_list_remove(struct flow_list *fl, struct flow_bucket *b)
 {
-	struct flow_entry *n1, *n2;
-	uint32_t id = nfct_get_attr_u32(ct, ATTR_ID);
+	uint32_t slot = b->slot - 1;
 
-	n1 = flow_list_find_id(fl, id);
-	if (n1) {
-		n2 = flow_list_find_prev_id(fl, id);
-		if (n2) {
-			rcu_assign_pointer(n2->next, n1->next);
-			rcu_assign_pointer(n1->next, NULL);
+	flow_list_entry(fl, slot)->active = 0;
 
-			flow_entry_xfree(n1);
-		} else {
-			flow_entry_xfree(fl->head);
+	flow_table_remove(fl, b);
+	fl->dead[fl->ndead++] = slot;
+}
 
-			rcu_assign_pointer(fl->head, NULL);
-		}
-	}
+static void flow_list_destroy_entry(struct flow_list *fl,
+				    struct nf_conntrack *ct)
+{
+	struct flow_bucket *b;
+
+	b = flow_table_find(fl, nfct_get_attr_u32(ct, ATTR_ID));
+	if (b != NULL)
+		flow_list_remove(fl, b);
 }
 
 static void flow_list_destroy(struct flow_list *fl)
 {
-	struct flow_entry *n;
+	uint32_t i;
 
-	while (fl->head != NULL) {
-		n = rcu_dereference(fl->head->next);
-		rcu_assign_pointer(fl->head->next, NULL);
+	uatomic_set(&fl->used, 0);
+	synchronize_rcu();
+	rcu_barrier();
 
-		flow_entry_xfree(fl->head);
-		rcu_assign_pointer(fl->head, n);
+	for (i = 0; i < fl->chunks; i++) {
+		xfree(fl->hot[i]);
+		xfree(fl->cold[i]);
 	}
 
-	synchronize_rcu();
+	xfree(fl->table);
+	xfree(fl->free);
+	xfree(fl->dead);
+
 	spinlock_destroy(&fl->lock);
 }
 
-static int walk_process(char *process, struct flow_entry *n)
-{
-	int ret;
-	DIR *dir;
-	struct dirent *ent;
-	char path[1024];
+/* Which process owns the local end of a flow is answered from an index
+ * that a background thread rebuilds every PROCIDX_IVAL seconds: local
+ * port to socket inode from /proc/net/{tcp,udp,udplite}[6] and socket
+ * inode to process from /proc/<pid>/fd. A lookup is two hash probes.
+ * Flows whose socket was not in the index yet retry once per rebuild.
+ */
+struct procidx_map {
+	uint64_t *key;
+	uint32_t *val;
+	uint32_t mask, count;
+};
+
+struct procidx_proc {
+	int pid;
+	char exe[256];
+};
 
-	if (snprintf(path, sizeof(path), "/proc/%s/fd", process) == -1)
-		panic("giant process name! %s\n", process);
+struct procidx {
+	struct procidx_map ports, inodes, pids;
+	struct procidx_proc *procs;
+	uint32_t nprocs, maxprocs;
+	uint8_t gen;
+};
 
-	dir = opendir(path);
-	if (!dir)
-        	return 0;
+static struct procidx *procidx;
 
-	while ((ent = readdir(dir))) {
-		struct stat statbuf;
+static void procidx_map_init(struct procidx_map *m, uint32_t size)
+{
+	m->key = xzmalloc(size * sizeof(*m->key));
+	m->val = xzmalloc(size * sizeof(*m->val));
+	m->mask = size - 1;
+	m->count = 0;
+}
 
-		if (snprintf(path, sizeof(path), "/proc/%s/fd/%s",
-			     process, ent->d_name) < 0)
-			continue;
+static void procidx_map_free(struct procidx_map *m)
+{
+	xfree(m->key);
+	xfree(m->val);
+}
 
-		if (stat(path, &statbuf) < 0)
-			continue;
+static inline uint32_t procidx_map_slot(const struct procidx_map *m,
+					uint64_t key)
+{
+	uint32_t i = flow_hash(key ^ (key >> 32)) & m->mask;
+
+	while (m->key[i] && m->key[i] != key)
+		i = (i + 1) & m->mask;
 
-		if (S_ISSOCK(statbuf.st_mode) && n->inode == statbuf.st_ino) {
-			memset(n->cmdline, 0, sizeof(n->cmdline));
+	return i;
+}
 
-            		snprintf(path, sizeof(path), "/proc/%s/exe", process);
+/* Keys must not be 0, the first value stored for a key wins. */
+static void procidx_map_put(struct procidx_map *m, uint64_t key, uint32_t val)
+{
+	uint32_t i;
 
-			ret = readlink(path, n->cmdline,
-				       sizeof(n->cmdline) - 1);
-			if (ret < 0)
-				panic("readlink error: %s\n", strerror(errno));
+	if ((m->count + 1) * 2 > m->mask + 1) {
+		struct procidx_map old = *m;
 
-			n->procnum = atoi(process);
-			return 1;
+		procidx_map_init(m, (old.mask + 1) * 2);
+		for (i = 0; i <= old.mask; i++) {
+			if (old.key[i])
+				procidx_map_put(m, old.key[i], old.val[i]);
 		}
+
+		procidx_map_free(&old);
 	}
 
-	closedir(dir);
-	return 0;
+	i = procidx_map_slot(m, key);
+	if (m->key[i])
+		return;
+
+	m->key[i] = key;
+	m->val[i] = val;
+	m->count++;
+}
+
+static inline uint32_t procidx_map_get(const struct procidx_map *m,
+				       uint64_t key)
+{
+	return m->val[procidx_map_slot(m, key)];
+}
+
+static inline uint64_t procidx_port_key(uint8_t proto, int is_ip6,
+					uint16_t port)
+{
+	return ((uint64_t) proto << 17) | (!!is_ip6 << 16) | port;
+}
+
+static void procidx_scan_ports(struct procidx *idx)
+{
+	static const uint8_t protos[] = {
+		IPPROTO_TCP, IPPROTO_UDP, IPPROTO_UDPLITE,
+	};
+	char path[128], buff[1024];
+	int i, is_ip6;
+	FILE *proc;
+
+	for (i = 0; i < array_size(protos); i++) {
+		for (is_ip6 = 0; is_ip6 < 2; is_ip6++) {
+			snprintf(path, sizeof(path), "/proc/net/%s%s",
+				 l4proto2str[protos[i]], is_ip6 ? "6" : "");
+
+			proc = fopen(path, "r");
+			if (!proc)
+				continue;
+
+			while (fgets(buff, sizeof(buff), proc) != NULL) {
+				unsigned int lport = 0, inode = 0;
+
+				buff[sizeof(buff) - 1] = 0;
+				if (sscanf(buff, "%*u: %*X:%X %*X:%*X %*X "
+					   "%*X:%*X %*X:%*X %*X %*u %*u %u",
+					   &lport, &inode) != 2 || inode == 0)
+					continue;
+
+				procidx_map_put(&idx->ports,
+						procidx_port_key(protos[i], is_ip6,
+								 lport), inode);
+			}
+
+			fclose(proc);
+		}
+	}
 }
 
-static void walk_processes(struct flow_entry *n)
+/* Returns the process' position in idx->procs plus one. The executable
+ * is taken over from the previous index if the pid was known there.
+ */
+static uint32_t procidx_add_proc(struct procidx *idx, const struct procidx *prev,
+				 const char *process)
 {
 	int ret;
-	DIR *dir;
-	struct dirent *ent;
+	uint32_t i;
+	char path[128];
+	struct procidx_proc *p;
+
+	if (idx->nprocs == idx->maxprocs) {
+		idx->maxprocs = idx->maxprocs ? idx->maxprocs * 2 : 256;
+		idx->procs = xrealloc(idx->procs, 1, idx->maxprocs *
+				      sizeof(*idx->procs));
+	}
 
-	/* n->inode must be set */
-	if (n->inode <= 0) {
-		memset(n->cmdline, 0, sizeof(n->cmdline));
-		return;
+	p = &idx->procs[idx->nprocs++];
+	p->pid = atoi(process);
+
+	i = prev ? procidx_map_get(&prev->pids, p->pid) : 0;
+	if (i) {
+		memcpy(p->exe, prev->procs[i - 1].exe, sizeof(p->exe));
+	} else {
+		slprintf(path, sizeof(path), "/proc/%s/exe", process);
+
+		ret = readlink(path, p->exe, sizeof(p->exe) - 1);
+		p->exe[ret > 0 ? ret : 0] = 0;
 	}
 
+	procidx_map_put(&idx->pids, p->pid, idx->nprocs);
+
+	return idx->nprocs;
+}
+
+static void procidx_scan_procs(struct procidx *idx, const struct procidx *prev)
+{
+	int ret;
+	uint32_t proc;
+	unsigned long inode;
+	DIR *dir, *fds;
+	struct dirent *ent, *fd;
+	char path[1024], link[64];
+
 	dir = opendir("/proc");
 	if (!dir)
-		panic("Cannot open /proc!\n");
+		return;
 
 	while ((ent = readdir(dir))) {
-		if (strspn(ent->d_name, "0123456789") == strlen(ent->d_name)) {
-			ret = walk_process(ent->d_name, n);
-			if (ret > 0)
-				break;
+		if (strspn(ent->d_name, "0123456789") != strlen(ent->d_name))
+			continue;
+
+		slprintf(path, sizeof(path), "/proc/%s/fd", ent->d_name);
+		fds = opendir(path);
+		if (!fds)
+			continue;
+
+		proc = 0;
+		while ((fd = readdir(fds))) {
+			slprintf(path, sizeof(path), "/proc/%s/fd/%s",
+				 ent->d_name, fd->d_name);
+
+			ret = readlink(path, link, sizeof(link) - 1);
+			if (ret <= 0)
+				continue;
+
+			link[ret] = 0;
+			if (sscanf(link, "socket:[%lu]", &inode) != 1 ||
+			    inode == 0)
+				continue;
+
+			if (proc == 0)
+				proc = procidx_add_proc(idx, prev, ent->d_name);
+
+			procidx_map_put(&idx->inodes, inode, proc);
 		}
+
+		closedir(fds);
 	}
 
 	closedir(dir);
 }
 
-static int get_port_inode(uint16_t port, int proto, int is_ip6)
+static void procidx_free(struct procidx *idx)
 {
-	int ret = -ENOENT;
-	char path[128], buff[1024];
-	FILE *proc;
-
-	memset(path, 0, sizeof(path));
-	snprintf(path, sizeof(path), "/proc/net/%s%s",
-		 l4proto2str[proto], is_ip6 ? "6" : "");
+	procidx_map_free(&idx->ports);
+	procidx_map_free(&idx->inodes);
+	procidx_map_free(&idx->pids);
 
-	proc = fopen(path, "r");
-	if (!proc)
-		return -EIO;
+	xfree(idx->procs);
+	xfree(idx);
+}
 
-	memset(buff, 0, sizeof(buff));
+static void *procidx_builder(void *null)
+{
+	int i;
+	uint8_t gen = 0;
+	struct procidx *idx, *old;
 
-	while (fgets(buff, sizeof(buff), proc) != NULL) {
-		int inode = 0;
-		unsigned int lport = 0;
+	rcu_register_thread();
 
-		buff[sizeof(buff) - 1] = 0;
-		if (sscanf(buff, "%*u: %*X:%X %*X:%*X %*X %*X:%*X %*X:%*X "
-			   "%*X %*u %*u %u", &lport, &inode) == 2) {
-			if ((uint16_t) lport == port) {
-				ret = inode;
-				break;
-			}
+	while (!sigint) {
+		idx = xzmalloc(sizeof(*idx));
+		if (++gen == PROCIDX_DONE)
+			gen = 1;
+		idx->gen = gen;
+
+		procidx_map_init(&idx->ports, 1024);
+		procidx_map_init(&idx->inodes, 1024);
+		procidx_map_init(&idx->pids, 256);
+
+		/* Ports first: a socket seen there is still open, and thus
+		 * found, when its process is walked afterwards.
+		 */
+		old = procidx;
+		procidx_scan_ports(idx);
+		procidx_scan_procs(idx, old);
+
+		rcu_assign_pointer(procidx, idx);
+		if (old) {
+			synchronize_rcu();
+			procidx_free(old);
 		}
 
-		memset(buff, 0, sizeof(buff));
+		for (i = 0; i < PROCIDX_IVAL && !sigint; i++)
+			sleep(1);
 	}
 
-	fclose(proc);
-	return ret;
+	rcu_unregister_thread();
+	pthread_exit(0);
+}
+
+static void procidx_init(void)
+{
+	int ret;
+	pthread_t tid;
+
+	ret = pthread_create(&tid, NULL, procidx_builder, NULL);
+	if (ret)
+		panic("Cannot create process index thread!\n");
+
+	pthread_detach(tid);
+}
+
+static void flow_entry_get_process(struct flow_entry *n,
+				   struct flow_entry_ext *e)
+{
+	uint32_t i;
+	struct procidx *idx;
+	struct procidx_proc *p;
+
+	rcu_read_lock();
+
+	idx = rcu_dereference(procidx);
+	if (idx == NULL) {
+		n->proc_gen = 0;
+		goto out;
+	}
+	if (n->proc_gen == idx->gen)
+		goto out;
+
+	e->inode = procidx_map_get(&idx->ports,
+				   procidx_port_key(n->l4_proto,
+						    n->l3_proto == AF_INET6,
+						    n->port_src));
+	i = e->inode > 0 ? procidx_map_get(&idx->inodes, e->inode) : 0;
+	if (i) {
+		p = &idx->procs[i - 1];
+
+		strlcpy(e->cmdline, p->exe, sizeof(e->cmdline));
+		e->procnum = p->pid;
+		n->proc_gen = PROCIDX_DONE;
+	} else {
+		n->proc_gen = idx->gen;
+	}
+out:
+	rcu_read_unlock();
 }
 
 #define CP_NFCT(elem, attr, x)				\
@@ -566,6 +968,8 @@ static inline int flow_entry_get_extended_is_dns(struct flow_entry *n)
 
 #define SELFLD(dir,src_member,dst_member)	\
 	(((dir) == flow_entry_src) ? n->src_member : n->dst_member)
+#define SELEXT(dir,src_member,dst_member)	\
+	(((dir) == flow_entry_src) ? e->src_member : e->dst_member)
 
 static struct sockaddr_in *
 flow_entry_get_sain4_obj(struct flow_entry *n, enum flow_entry_direction dir,
@@ -591,13 +995,13 @@ flow_entry_get_sain6_obj(struct flow_entry *n, enum flow_entry_direction dir,
 	return sa;
 }
 
-static void
-flow_entry_geo_city_lookup_generic(struct flow_entry *n,
-				   enum flow_entry_direction dir)
+static void flow_entry_get_extended_geo(struct flow_entry *n,
+					struct flow_entry_ext *e,
+					enum flow_entry_direction dir)
 {
 	struct sockaddr_in sa4;
 	struct sockaddr_in6 sa6;
-	const char *city = NULL;
+	struct geoip_info info;
 
 	switch (n->l3_proto) {
 	default:
@@ -605,123 +1009,364 @@ flow_entry_geo_city_lookup_generic(struct flow_entry *n,
 
 	case AF_INET:
 		flow_entry_get_sain4_obj(n, dir, &sa4);
-		city = geoip4_city_name(sa4);
+		geoip4_lookup(sa4, &info);
 		break;
 
 	case AF_INET6:
 		flow_entry_get_sain6_obj(n, dir, &sa6);
-		city = geoip6_city_name(sa6);
+		geoip6_lookup(sa6, &info);
 		break;
 	}
 
-	bug_on(sizeof(n->city_src) != sizeof(n->city_dst));
-
-	if (city) {
-		memcpy(SELFLD(dir, city_src, city_dst), city,
-		       min(sizeof(n->city_src), strlen(city)));
-	} else {
-		memset(SELFLD(dir, city_src, city_dst), 0,
-		       sizeof(n->city_src));
-	}
+	strlcpy(SELEXT(dir, city_src, city_dst), info.city,
+		sizeof(e->city_src));
+	strlcpy(SELEXT(dir, country_src, country_dst), info.country,
+		sizeof(e->country_src));
 }
 
-static void
-flow_entry_geo_country_lookup_generic(struct flow_entry *n,
-				      enum flow_entry_direction dir)
-{
-	struct sockaddr_in sa4;
-	struct sockaddr_in6 sa6;
-	const char *country = NULL;
-
-	switch (n->l3_proto) {
-	default:
-		bug();
+/* Reverse DNS must never block the collector: it only consults a bounded
+ * LRU cache and otherwise queues a request. Flows show the numeric address
+ * until one of the workers has written the name back into their entry.
+ * Failed lookups are cached as well, but only for a short while.
+ */
+#define REVDNS_WORKERS		4
+#define REVDNS_CACHE_SIZE	4096
+#define REVDNS_QUEUE_SIZE	1024
+#define REVDNS_TTL_POS		3600
+#define REVDNS_TTL_NEG		60
+
+struct revdns_entry {
+	struct revdns_entry *hnext, *prev, *next;
+	time_t expires;
+	int family, resolved;
+	uint8_t addr[16];
+	char name[256];
+};
 
-	case AF_INET:
-		flow_entry_get_sain4_obj(n, dir, &sa4);
-		country = geoip4_country_name(sa4);
-		break;
+struct revdns_req {
+	struct sockaddr_storage sa;
+	socklen_t sa_len;
+	uint32_t slot, flow_id;
+	enum flow_entry_direction dir;
+};
 
-	case AF_INET6:
-		flow_entry_get_sain6_obj(n, dir, &sa6);
-		country = geoip6_country_name(sa6);
-		break;
-	}
+static struct revdns {
+	struct revdns_entry entries[REVDNS_CACHE_SIZE];
+	struct revdns_entry *table[REVDNS_CACHE_SIZE];
+	struct revdns_entry *mru, *lru;
+	uint32_t used;
+	struct revdns_req queue[REVDNS_QUEUE_SIZE];
+	uint32_t qhead, qlen;
+	struct mutexlock lock;
+	pthread_cond_t wait;
+} revdns;
+
+static int revdns_key(const struct sockaddr *sa, uint8_t addr[16])
+{
+	memset(addr, 0, 16);
 
-	bug_on(sizeof(n->country_src) != sizeof(n->country_dst));
+	if (sa->sa_family == AF_INET)
+		memcpy(addr, &((struct sockaddr_in *) sa)->sin_addr, 4);
+	else
+		memcpy(addr, &((struct sockaddr_in6 *) sa)->sin6_addr, 16);
 
-	if (country) {
-		memcpy(SELFLD(dir, country_src, country_dst), country,
-		       min(sizeof(n->country_src), strlen(country)));
-	} else {
-		memset(SELFLD(dir, country_src, country_dst), 0,
-		       sizeof(n->country_src));
-	}
+	return sa->sa_family;
 }
 
-static void flow_entry_get_extended_geo(struct flow_entry *n,
-					enum flow_entry_direction dir)
+static inline uint32_t revdns_hash(int family, const uint8_t addr[16])
 {
-	flow_entry_geo_city_lookup_generic(n, dir);
-	flow_entry_geo_country_lookup_generic(n, dir);
-}
+	uint32_t w[4];
 
-static void flow_entry_get_extended_revdns(struct flow_entry *n,
-					   enum flow_entry_direction dir)
-{
-	size_t sa_len;
-	struct sockaddr_in sa4;
-	struct sockaddr_in6 sa6;
-	struct sockaddr *sa;
-	struct hostent *hent;
+	memcpy(w, addr, sizeof(w));
 
-	switch (n->l3_proto) {
-	default:
-		bug();
+	return flow_hash(w[0] ^ w[1] ^ w[2] ^ w[3] ^ family) &
+	       (REVDNS_CACHE_SIZE - 1);
+}
 
-	case AF_INET:
-		flow_entry_get_sain4_obj(n, dir, &sa4);
-		sa = (struct sockaddr *) &sa4;
-		sa_len = sizeof(sa4);
-		hent = gethostbyaddr(&sa4.sin_addr, sizeof(sa4.sin_addr), AF_INET);
-		break;
+static struct revdns_entry *revdns_find(int family, const uint8_t addr[16])
+{
+	struct revdns_entry *r = revdns.table[revdns_hash(family, addr)];
 
-	case AF_INET6:
-		flow_entry_get_sain6_obj(n, dir, &sa6);
-		sa = (struct sockaddr *) &sa6;
-		sa_len = sizeof(sa6);
-		hent = gethostbyaddr(&sa6.sin6_addr, sizeof(sa6.sin6_addr), AF_INET6);
-		break;
-	}
+	while (r && (r->family != family || memcmp(r->addr, addr, 16)))
+		r = r->hnext;
 
-	bug_on(sizeof(n->rev_dns_src) != sizeof(n->rev_dns_dst));
-	getnameinfo(sa, sa_len, SELFLD(dir, rev_dns_src, rev_dns_dst),
-		    sizeof(n->rev_dns_src), NULL, 0, NI_NUMERICHOST);
+	return r;
+}
 
-	if (hent) {
-		memset(n->rev_dns_dst, 0, sizeof(n->rev_dns_dst));
-		memcpy(SELFLD(dir, rev_dns_src, rev_dns_dst),
-		       hent->h_name, min(sizeof(n->rev_dns_src),
-					 strlen(hent->h_name)));
-	}
+static void revdns_lru_unlink(struct revdns_entry *r)
+{
+	if (r->prev)
+		r->prev->next = r->next;
+	else
+		revdns.mru = r->next;
+	if (r->next)
+		r->next->prev = r->prev;
+	else
+		revdns.lru = r->prev;
 }
 
-static void flow_entry_get_extended(struct flow_entry *n)
+static void revdns_lru_push(struct revdns_entry *r)
 {
+	r->prev = NULL;
+	r->next = revdns.mru;
+	if (revdns.mru)
+		revdns.mru->prev = r;
+	else
+		revdns.lru = r;
+	revdns.mru = r;
+}
+
+static void revdns_insert(int family, const uint8_t addr[16],
+			  const char *name)
+{
+	struct revdns_entry *r = revdns_find(family, addr), **pp;
+
+	if (r) {
+		revdns_lru_unlink(r);
+	} else {
+		if (revdns.used < REVDNS_CACHE_SIZE) {
+			r = &revdns.entries[revdns.used++];
+		} else {
+			r = revdns.lru;
+			revdns_lru_unlink(r);
+
+			pp = &revdns.table[revdns_hash(r->family, r->addr)];
+			while (*pp != r)
+				pp = &(*pp)->hnext;
+			*pp = r->hnext;
+		}
+
+		r->family = family;
+		memcpy(r->addr, addr, sizeof(r->addr));
+
+		pp = &revdns.table[revdns_hash(family, addr)];
+		r->hnext = *pp;
+		*pp = r;
+	}
+
+	r->resolved = name != NULL;
+	r->expires = time(NULL) + (name ? REVDNS_TTL_POS : REVDNS_TTL_NEG);
+	if (name)
+		strlcpy(r->name, name, sizeof(r->name));
+
+	revdns_lru_push(r);
+}
+
+/* Called with revdns.lock held, returns the cache entry if it is still
+ * valid and marks it as most recently used.
+ */
+static struct revdns_entry *revdns_lookup(int family, const uint8_t addr[16])
+{
+	struct revdns_entry *r = revdns_find(family, addr);
+
+	if (r == NULL || r->expires <= time(NULL))
+		return NULL;
+
+	revdns_lru_unlink(r);
+	revdns_lru_push(r);
+
+	return r;
+}
+
+static void revdns_write_back(const struct revdns_req *q, const char *name)
+{
+	struct flow_entry_ext *e;
+
+	/* The collector recycles slots under the lock, so the id check
+	 * and the copy must not be split by it.
+	 */
+	spinlock_lock(&flow_list.lock);
+
+	if (q->slot < flow_list_used(&flow_list) &&
+	    flow_list_entry(&flow_list, q->slot)->flow_id == q->flow_id) {
+		e = flow_list_ext(&flow_list, q->slot);
+		strlcpy(SELEXT(q->dir, rev_dns_src, rev_dns_dst), name,
+			sizeof(e->rev_dns_src));
+	}
+
+	spinlock_unlock(&flow_list.lock);
+}
+
+static void *revdns_worker(void *null)
+{
+	int family, hit, resolved;
+	uint8_t addr[16];
+	char name[256];
+	struct revdns_req q;
+	struct revdns_entry *r;
+
+	for (;;) {
+		mutexlock_lock(&revdns.lock);
+		while (revdns.qlen == 0 && !sigint)
+			pthread_cond_wait(&revdns.wait, &revdns.lock.lock);
+		if (sigint) {
+			mutexlock_unlock(&revdns.lock);
+			break;
+		}
+
+		q = revdns.queue[revdns.qhead];
+		revdns.qhead = (revdns.qhead + 1) % REVDNS_QUEUE_SIZE;
+		revdns.qlen--;
+
+		/* Somebody else may have resolved it in the meantime */
+		family = revdns_key((struct sockaddr *) &q.sa, addr);
+		r = revdns_lookup(family, addr);
+		hit = r != NULL;
+		resolved = hit && r->resolved;
+		if (resolved)
+			strlcpy(name, r->name, sizeof(name));
+
+		mutexlock_unlock(&revdns.lock);
+
+		if (!hit) {
+			resolved = getnameinfo((struct sockaddr *) &q.sa,
+					       q.sa_len, name, sizeof(name),
+					       NULL, 0, NI_NAMEREQD) == 0;
+
+			mutexlock_lock(&revdns.lock);
+			revdns_insert(family, addr, resolved ? name : NULL);
+			mutexlock_unlock(&revdns.lock);
+		}
+
+		if (resolved)
+			revdns_write_back(&q, name);
+	}
+
+	pthread_exit(0);
+}
+
+static void revdns_init(void)
+{
+	int i, ret;
+	pthread_t tid;
+
+	mutexlock_init(&revdns.lock);
+	pthread_cond_init(&revdns.wait, NULL);
+
+	for (i = 0; i < REVDNS_WORKERS; i++) {
+		ret = pthread_create(&tid, NULL, revdns_worker, NULL);
+		if (ret)
+			panic("Cannot create resolver thread!\n");
+
+		pthread_detach(tid);
+	}
+}
+
+/* Workers may sit in a slow lookup, so they are not waited for. */
+static void revdns_stop(void)
+{
+	mutexlock_lock(&revdns.lock);
+	pthread_cond_broadcast(&revdns.wait);
+	mutexlock_unlock(&revdns.lock);
+}
+
+static void revdns_request(const struct sockaddr *sa, socklen_t sa_len,
+			   char *name, size_t len, uint32_t slot,
+			   uint32_t flow_id, enum flow_entry_direction dir)
+{
+	int family;
+	uint8_t addr[16];
+	struct revdns_req *q;
+	struct revdns_entry *r;
+
+	family = revdns_key(sa, addr);
+
+	mutexlock_lock(&revdns.lock);
+
+	r = revdns_lookup(family, addr);
+	if (r) {
+		if (r->resolved)
+			strlcpy(name, r->name, len);
+	} else if (revdns.qlen < REVDNS_QUEUE_SIZE) {
+		/* Queue full: the flow just stays numeric */
+		q = &revdns.queue[(revdns.qhead + revdns.qlen++) %
+				  REVDNS_QUEUE_SIZE];
+
+		memcpy(&q->sa, sa, sa_len);
+		q->sa_len = sa_len;
+		q->slot = slot;
+		q->flow_id = flow_id;
+		q->dir = dir;
+
+		pthread_cond_signal(&revdns.wait);
+	}
+
+	mutexlock_unlock(&revdns.lock);
+}
+
+static void flow_entry_get_extended_revdns(struct flow_entry *n,
+					   struct flow_entry_ext *e,
+					   uint32_t slot,
+					   enum flow_entry_direction dir)
+{
+	size_t sa_len;
+	struct sockaddr_in sa4;
+	struct sockaddr_in6 sa6;
+	struct sockaddr *sa;
+
+	switch (n->l3_proto) {
+	default:
+		bug();
+
+	case AF_INET:
+		flow_entry_get_sain4_obj(n, dir, &sa4);
+		sa = (struct sockaddr *) &sa4;
+		sa_len = sizeof(sa4);
+		break;
+
+	case AF_INET6:
+		flow_entry_get_sain6_obj(n, dir, &sa6);
+		sa = (struct sockaddr *) &sa6;
+		sa_len = sizeof(sa6);
+		break;
+	}
+
+	bug_on(sizeof(e->rev_dns_src) != sizeof(e->rev_dns_dst));
+	getnameinfo(sa, sa_len, SELEXT(dir, rev_dns_src, rev_dns_dst),
+		    sizeof(e->rev_dns_src), NULL, 0, NI_NUMERICHOST);
+
+	revdns_request(sa, sa_len, SELEXT(dir, rev_dns_src, rev_dns_dst),
+		       sizeof(e->rev_dns_src), slot, n->flow_id, dir);
+}
+
+static void flow_entry_get_extended(struct flow_entry *n,
+				    struct flow_entry_ext *e, uint32_t slot)
+{
+	n->proc_gen = PROCIDX_DONE;
+
 	if (n->flow_id == 0 || flow_entry_get_extended_is_dns(n))
 		return;
 
-	flow_entry_get_extended_revdns(n, flow_entry_src);
-	flow_entry_get_extended_geo(n, flow_entry_src);
+	flow_entry_get_extended_revdns(n, e, slot, flow_entry_src);
+	flow_entry_get_extended_geo(n, e, flow_entry_src);
 
-	flow_entry_get_extended_revdns(n, flow_entry_dst);
-	flow_entry_get_extended_geo(n, flow_entry_dst);
+	flow_entry_get_extended_revdns(n, e, slot, flow_entry_dst);
+	flow_entry_get_extended_geo(n, e, flow_entry_dst);
 
 	/* Lookup application */
-	n->inode = get_port_inode(n->port_src, n->l4_proto,
-				  n->l3_proto == AF_INET6);
-	if (n->inode > 0)
-		walk_processes(n);
+	flow_entry_get_process(n, e);
+}
+
+static const char *flow_entry_state_str(const struct flow_entry *n)
+{
+	const char *state = NULL;
+
+	switch (n->l4_proto) {
+	case IPPROTO_TCP:
+		if (n->tcp_state < TCP_CONNTRACK_MAX)
+			state = tcp_state2str[n->tcp_state];
+		break;
+	case IPPROTO_SCTP:
+		if (n->sctp_state < SCTP_CONNTRACK_MAX)
+			state = sctp_state2str[n->sctp_state];
+		break;
+	case IPPROTO_DCCP:
+		if (n->dccp_state < DCCP_CONNTRACK_MAX)
+			state = dccp_state2str[n->dccp_state];
+		break;
+	}
+
+	return state ? state : "NOSTATE";
 }
 
 static uint16_t presenter_get_port(uint16_t src, uint16_t dst, int tcp)
@@ -763,7 +1408,22 @@ static void presenter_screen_init(WINDOW **screen)
 	wrefresh(*screen);
 }
 
+static char *presenter_rate_str(double bps, char *buff, size_t len)
+{
+	if (bps >= 1e9)
+		slprintf(buff, len, "%.1f Gbit/s", bps / 1e9);
+	else if (bps >= 1e6)
+		slprintf(buff, len, "%.1f Mbit/s", bps / 1e6);
+	else if (bps >= 1e3)
+		slprintf(buff, len, "%.1f kbit/s", bps / 1e3);
+	else
+		slprintf(buff, len, "%.0f bit/s", bps);
+
+	return buff;
+}
+
 static void presenter_screen_do_line(WINDOW *screen, struct flow_entry *n,
+				     struct flow_entry_ext *e,
 				     unsigned int *line)
 {
 	char tmp[128], *pname = NULL;
@@ -772,9 +1432,9 @@ static void presenter_screen_do_line(WINDOW *screen, struct flow_entry *n,
 	mvwprintw(screen, *line, 2, "");
 
 	/* PID, application name */
-	if (n->procnum > 0) {
-		slprintf(tmp, sizeof(tmp), "%s(%u)", basename(n->cmdline),
-			 n->procnum);
+	if (e->procnum > 0) {
+		slprintf(tmp, sizeof(tmp), "%s(%u)", basename(e->cmdline),
+			 e->procnum);
 
 		printw("[");
 		attron(COLOR_PAIR(3));
@@ -787,23 +1447,7 @@ static void presenter_screen_do_line(WINDOW *screen, struct flow_entry *n,
 	printw("%s:%s", l3proto2str[n->l3_proto], l4proto2str[n->l4_proto]);
 	printw("[");
 	attron(COLOR_PAIR(3));
-	switch (n->l4_proto) {
-	case IPPROTO_TCP:
-		printw("%s", tcp_state2str[n->tcp_state]);
-		break;
-	case IPPROTO_SCTP:
-		printw("%s", sctp_state2str[n->sctp_state]);
-		break;
-	case IPPROTO_DCCP:
-		printw("%s", dccp_state2str[n->dccp_state]);
-		break;
-	case IPPROTO_UDP:
-	case IPPROTO_UDPLITE:
-	case IPPROTO_ICMP:
-	case IPPROTO_ICMPV6:
-		printw("NOSTATE");
-		break;
-	}
+	printw("%s", flow_entry_state_str(n));
 	attroff(COLOR_PAIR(3));
 	printw("]");
 
@@ -826,28 +1470,34 @@ static void presenter_screen_do_line(WINDOW *screen, struct flow_entry *n,
 	}
 	printw(" ->");
 
-	/* Number packets, bytes */
-	if (n->counter_pkts > 0 && n->counter_bytes > 0)
-		printw(" (%llu pkts, %llu bytes) ->",
-		       n->counter_pkts, n->counter_bytes);
+	/* Number packets, bytes, current rates */
+	if (n->counter_pkts > 0 && n->counter_bytes > 0) {
+		printw(" (%llu pkts, %llu bytes", n->counter_pkts,
+		       n->counter_bytes);
+		if (n->rate_pps >= 0.05)
+			printw(", %.1f pps, %s", n->rate_pps,
+			       presenter_rate_str(n->rate_bps, tmp,
+						  sizeof(tmp)));
+		printw(") ->");
+	}
 
 	/* Show source information: reverse DNS, port, country, city */
 	if (show_src) {
 		attron(COLOR_PAIR(1));
-		mvwprintw(screen, ++(*line), 8, "src: %s", n->rev_dns_src);
+		mvwprintw(screen, ++(*line), 8, "src: %s", e->rev_dns_src);
 		attroff(COLOR_PAIR(1));
 
 		printw(":%u", n->port_src);
 
-		if (n->country_src[0]) {
+		if (e->country_src[0]) {
 			printw(" (");
 
 			attron(COLOR_PAIR(4));
-			printw("%s", n->country_src);
+			printw("%s", e->country_src);
 			attroff(COLOR_PAIR(4));
 
-			if (n->city_src[0])
-				printw(", %s", n->city_src);
+			if (e->city_src[0])
+				printw(", %s", e->city_src);
 
 			printw(")");
 		}
@@ -857,77 +1507,123 @@ static void presenter_screen_do_line(WINDOW *screen, struct flow_entry *n,
 
 	/* Show dest information: reverse DNS, port, country, city */
 	attron(COLOR_PAIR(2));
-	mvwprintw(screen, ++(*line), 8, "dst: %s", n->rev_dns_dst);
+	mvwprintw(screen, ++(*line), 8, "dst: %s", e->rev_dns_dst);
 	attroff(COLOR_PAIR(2));
 
 	printw(":%u", n->port_dst);
 
-	if (n->country_dst[0]) {
+	if (e->country_dst[0]) {
 		printw(" (");
 
 		attron(COLOR_PAIR(4));
-		printw("%s", n->country_dst);
+		printw("%s", e->country_dst);
 		attroff(COLOR_PAIR(4));
 
-		if (n->city_dst[0])
-			printw(", %s", n->city_dst);
+		if (e->city_dst[0])
+			printw(", %s", e->city_dst);
 
 		printw(")");
 	}
 }
 
-static inline int presenter_flow_wrong_state(struct flow_entry *n, int state)
+static void presenter_flow_rate(struct flow_entry *n, double dt)
 {
-	int ret = 1;
+	uint64_t pkts = n->counter_pkts, bytes = n->counter_bytes;
+	double alpha = dt / (RATE_TAU + dt);
+
+	/* Counters may also go backwards on events that lack them */
+	if (n->rate_id != n->flow_id || pkts < n->last_pkts ||
+	    bytes < n->last_bytes || dt <= 0) {
+		if (n->rate_id != n->flow_id)
+			n->rate_pps = n->rate_bps = 0;
+
+		n->rate_id = n->flow_id;
+		n->last_pkts = pkts;
+		n->last_bytes = bytes;
+		return;
+	}
 
-	switch (n->l4_proto) {
-	case IPPROTO_TCP:
-		if (n->tcp_state == state)
-			ret = 0;
-		break;
-	case IPPROTO_SCTP:
-		if (n->sctp_state == state)
-			ret = 0;
-		break;
-	case IPPROTO_DCCP:
-		if (n->dccp_state == state)
-			ret = 0;
-		break;
-	case IPPROTO_UDP:
-	case IPPROTO_UDPLITE:
-	case IPPROTO_ICMP:
-	case IPPROTO_ICMPV6:
-		ret = 0;
-		break;
+	n->rate_pps += alpha * ((pkts - n->last_pkts) / dt - n->rate_pps);
+	n->rate_bps += alpha * ((bytes - n->last_bytes) * 8 / dt -
+				n->rate_bps);
+
+	n->last_pkts = pkts;
+	n->last_bytes = bytes;
+}
+
+static inline uint64_t presenter_flow_key(const struct flow_entry *n,
+					  time_t now)
+{
+	switch (sort_by) {
+	default:
+	case SORT_RATE:
+		return (uint64_t) n->rate_bps;
+	case SORT_BYTES:
+		return n->counter_bytes;
+	case SORT_AGE:
+		return now - n->first_seen;
+	}
+}
+
+/* top[] is a min-heap of the best flows so far, top[0] is the weakest. */
+static void presenter_top_sift(struct flow_top *top, uint32_t len, uint32_t i)
+{
+	struct flow_top tmp;
+	uint32_t l, m;
+
+	for (;;) {
+		l = 2 * i + 1;
+		m = i;
+
+		if (l < len && top[l].key < top[m].key)
+			m = l;
+		if (l + 1 < len && top[l + 1].key < top[m].key)
+			m = l + 1;
+		if (m == i)
+			break;
+
+		tmp = top[i];
+		top[i] = top[m];
+		top[m] = tmp;
+		i = m;
 	}
+}
 
-	return ret;
+static void presenter_top_push(struct flow_top *top, uint32_t *len,
+			       uint32_t max, uint64_t key, uint32_t slot)
+{
+	struct flow_top tmp;
+	uint32_t i;
+
+	if (*len < max) {
+		i = (*len)++;
+		top[i].key = key;
+		top[i].slot = slot;
+
+		while (i > 0 && top[(i - 1) / 2].key > top[i].key) {
+			tmp = top[i];
+			top[i] = top[(i - 1) / 2];
+			top[(i - 1) / 2] = tmp;
+			i = (i - 1) / 2;
+		}
+	} else if (max > 0 && key > top[0].key) {
+		top[0].key = key;
+		top[0].slot = slot;
+
+		presenter_top_sift(top, *len, 0);
+	}
 }
 
 static void presenter_screen_update(WINDOW *screen, struct flow_list *fl,
-				    int skip_lines)
+				    int skip_lines, double dt)
 {
-	int i, j, maxy;
+	int maxy;
 	unsigned int line = 3;
+	uint32_t i, slot, used, len = 0, max;
+	time_t now = time(NULL);
 	struct flow_entry *n;
-	uint8_t protocols[] = {
-		IPPROTO_TCP,
-		IPPROTO_DCCP,
-		IPPROTO_SCTP,
-		IPPROTO_UDP,
-		IPPROTO_UDPLITE,
-		IPPROTO_ICMP,
-		IPPROTO_ICMPV6,
-	};
-	size_t protocol_state_size[] = {
-		[IPPROTO_TCP] = array_size(tcp_states),
-		[IPPROTO_DCCP] = array_size(dccp_states),
-		[IPPROTO_SCTP] = array_size(sctp_states),
-		[IPPROTO_UDP] = 1,
-		[IPPROTO_UDPLITE] = 1,
-		[IPPROTO_ICMP] = 1,
-		[IPPROTO_ICMPV6] = 1,
-	};
+	static struct flow_top *top;
+	static uint32_t top_size;
 
 	curs_set(0);
 
@@ -944,50 +1640,70 @@ static void presenter_screen_update(WINDOW *screen, struct flow_list *fl,
 	clear();
 
 	mvwprintw(screen, 1, 2, "Kernel netfilter flows for %s%s%s%s%s%s"
-		  "[+%d]", what & INCLUDE_TCP ? "TCP, " : "" ,
+		  "[+%d] by %s", what & INCLUDE_TCP ? "TCP, " : "" ,
 		  what & INCLUDE_UDP ? "UDP, " : "",
 		  what & INCLUDE_SCTP ? "SCTP, " : "",
 		  what & INCLUDE_DCCP ? "DCCP, " : "",
 		  what & INCLUDE_ICMP && what & INCLUDE_IPV4 ? "ICMP, " : "",
 		  what & INCLUDE_ICMP && what & INCLUDE_IPV6 ? "ICMP6, " : "",
-		  skip_lines);
+		  skip_lines, sort2str[sort_by]);
+
+	/* Overruns mean lost events, a bigger --bufsize helps */
+	mvwprintw(screen, 2, 2, "Netlink buffer %u KiB, %u overruns",
+		  uatomic_read(&nl_rcvbuf) >> 10, uatomic_read(&nl_overruns));
+
+	/* Only as many flows as can be scrolled to and shown are kept */
+	max = skip_lines;
+	if (maxy > 0)
+		max += (maxy + 1 + show_src) / (2 + show_src);
+	if (max > top_size) {
+		top_size = max;
+		top = xrealloc(top, 1, top_size * sizeof(*top));
+	}
 
 	rcu_read_lock();
 
-	if (rcu_dereference(fl->head) == NULL)
+	if (uatomic_read(&fl->count) == 0)
 		mvwprintw(screen, line, 2, "(No active sessions! "
 			  "Is netfilter running?)");
 
-	for (i = 0; i < array_size(protocols); i++) {
-		for (j = 0; j < protocol_state_size[protocols[i]]; j++) {
-			n = rcu_dereference(fl->head);
-			while (n && maxy > 0) {
-				int skip_entry = 0;
-
-				if (n->l4_proto != protocols[i])
-					skip_entry = 1;
-				if (presenter_flow_wrong_state(n, j))
-					skip_entry = 1;
-				if (presenter_get_port(n->port_src,
-						       n->port_dst, 0) == 53)
-					skip_entry = 1;
-				if (skip_entry) {
-					n = rcu_dereference(n->next);
-					continue;
-				}
-				if (skip_lines > 0) {
-					n = rcu_dereference(n->next);
-					skip_lines--;
-					continue;
-				}
+	used = flow_list_used(fl);
 
-				presenter_screen_do_line(screen, n, &line);
+	for (slot = 0; slot < used; slot++) {
+		n = flow_list_entry(fl, slot);
 
-				line++;
-				maxy -= (2 + 1 * show_src);
-				n = rcu_dereference(n->next);
-			}
-		}
+		if (!n->active)
+			continue;
+
+		presenter_flow_rate(n, dt);
+
+		if (presenter_get_port(n->port_src, n->port_dst, 0) == 53)
+			continue;
+
+		presenter_top_push(top, &len, max, presenter_flow_key(n, now),
+				   slot);
+	}
+
+	/* Heap sort the survivors, best first */
+	for (i = len; i > 1; i--) {
+		struct flow_top tmp = top[0];
+
+		top[0] = top[i - 1];
+		top[i - 1] = tmp;
+
+		presenter_top_sift(top, i - 1, 0);
+	}
+
+	for (i = skip_lines; i < len && maxy > 0; i++) {
+		n = flow_list_entry(fl, top[i].slot);
+		if (!n->active)
+			continue;
+
+		presenter_screen_do_line(screen, n,
+					 flow_list_ext(fl, top[i].slot), &line);
+
+		line++;
+		maxy -= (2 + 1 * show_src);
 	}
 
 	rcu_read_unlock();
@@ -1001,9 +1717,19 @@ static inline void presenter_screen_end(void)
 	endwin();
 }
 
+static inline double presenter_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
 static void presenter(void)
 {
-	int skip_lines = 0;
+	int skip_lines = 0, redraw;
+	double now, last = presenter_clock() - REFRESH_IVAL;
 	WINDOW *screen = NULL;
 
 	dissector_init_ethernet(0);
@@ -1011,6 +1737,8 @@ static void presenter(void)
 
 	rcu_register_thread();
 	while (!sigint) {
+		redraw = 1;
+
 		switch (getch()) {
 		case 'q':
 			sigint = 1;
@@ -1029,12 +1757,31 @@ static void presenter(void)
 			if (skip_lines > SCROLL_MAX)
 				skip_lines = SCROLL_MAX;
 			break;
+		case 'r':
+			sort_by = SORT_RATE;
+			break;
+		case 'b':
+			sort_by = SORT_BYTES;
+			break;
+		case 'a':
+			sort_by = SORT_AGE;
+			break;
 		default:
 			fflush(stdin);
+			redraw = 0;
 			break;
 		}
 
-		presenter_screen_update(screen, &flow_list, skip_lines);
+		/* Walking the table once a second is plenty for rates, keys
+		 * still get an immediate redraw.
+		 */
+		now = presenter_clock();
+		if (redraw || now - last >= REFRESH_IVAL) {
+			presenter_screen_update(screen, &flow_list, skip_lines,
+						now - last);
+			last = now;
+		}
+
 		usleep(100000);
 	}
 	rcu_unregister_thread();
@@ -1043,42 +1790,717 @@ static void presenter(void)
 	dissector_cleanup_ethernet();
 }
 
+/* Headless export: instead of being drawn, flow records go to a file, a
+ * pipe or a UDP socket. Periodic records for all flows are written every
+ * --interval seconds, end records whenever conntrack destroys a flow.
+ * Records are formatted into one preallocated buffer, which is written
+ * out when full, after every batch of events and after every pass.
+ */
+#define EXPORT_BUFSIZ		(64 * 1024)
+#define EXPORT_UDP_BUFSIZ	8192
+#define EXPORT_TMPL_EVERY	32
+
+#define IPFIX_VERSION		10
+#define IPFIX_HDR_LEN		16
+#define IPFIX_MAX_LEN		65535	/* message length is 16 bit */
+#define IPFIX_SET_TMPL		2
+#define IPFIX_TMPL_IP4		256
+#define IPFIX_TMPL_IP6		257
+#define IPFIX_REC_IP4		50
+#define IPFIX_REC_IP6		74
+
+enum export_format {
+	EXPORT_JSON,
+	EXPORT_CSV,
+	EXPORT_IPFIX,
+};
+
+/* Values match the IPFIX flowEndReason element */
+enum export_event {
+	EXPORT_ACTIVE = 2,
+	EXPORT_END = 3,
+};
+
+static struct exporter {
+	int fd, udp;
+	enum export_format format;
+	unsigned int interval;
+	char *buff;
+	size_t len, size;
+	/* IPFIX message state */
+	uint32_t seq, msgs, records;
+	size_t set_off;
+	uint16_t set_id;
+	struct mutexlock lock;
+} exporter = {
+	.fd = -1,
+};
+
+/* IPFIX information element ids and lengths, in record order */
+static const uint16_t ipfix_fields_ip4[][2] = {
+	{ 148, 4 },	/* flowId */
+	{   8, 4 },	/* sourceIPv4Address */
+	{  12, 4 },	/* destinationIPv4Address */
+	{   7, 2 },	/* sourceTransportPort */
+	{  11, 2 },	/* destinationTransportPort */
+	{   4, 1 },	/* protocolIdentifier */
+	{ 136, 1 },	/* flowEndReason */
+	{  86, 8 },	/* packetTotalCount */
+	{  85, 8 },	/* octetTotalCount */
+	{ 152, 8 },	/* flowStartMilliseconds */
+	{ 153, 8 },	/* flowEndMilliseconds */
+};
+
+static const uint16_t ipfix_fields_ip6[][2] = {
+	{ 148, 4 },	/* flowId */
+	{  27, 16 },	/* sourceIPv6Address */
+	{  28, 16 },	/* destinationIPv6Address */
+	{   7, 2 },	/* sourceTransportPort */
+	{  11, 2 },	/* destinationTransportPort */
+	{   4, 1 },	/* protocolIdentifier */
+	{ 136, 1 },	/* flowEndReason */
+	{  86, 8 },	/* packetTotalCount */
+	{  85, 8 },	/* octetTotalCount */
+	{ 152, 8 },	/* flowStartMilliseconds */
+	{ 153, 8 },	/* flowEndMilliseconds */
+};
+
+static const char *const export_csv_header =
+	"event,id,l3,l4,state,src,sport,dst,dport,pkts,bytes,pps,bps,"
+	"start,stop,pid,process,src_name,dst_name,src_country,dst_country,"
+	"src_city,dst_city\n";
+
+static inline void export_put(const void *data, size_t len)
+{
+	fmemcpy(exporter.buff + exporter.len, data, len);
+	exporter.len += len;
+}
+
+static inline void export_put8(uint8_t val)
+{
+	export_put(&val, sizeof(val));
+}
+
+static inline void export_put16(uint16_t val)
+{
+	val = cpu_to_be16(val);
+	export_put(&val, sizeof(val));
+}
+
+static inline void export_put32(uint32_t val)
+{
+	val = cpu_to_be32(val);
+	export_put(&val, sizeof(val));
+}
+
+static inline void export_put64(uint64_t val)
+{
+	val = cpu_to_be64(val);
+	export_put(&val, sizeof(val));
+}
+
+static inline void export_patch16(size_t off, uint16_t val)
+{
+	val = cpu_to_be16(val);
+	fmemcpy(exporter.buff + off, &val, sizeof(val));
+}
+
+static void ipfix_template(uint16_t id, const uint16_t (*fields)[2],
+			   size_t num)
+{
+	size_t i;
+
+	export_put16(id);
+	export_put16(num);
+
+	for (i = 0; i < num; i++) {
+		export_put16(fields[i][0]);
+		export_put16(fields[i][1]);
+	}
+}
+
+/* Leaves room for the message header, and repeats the templates every
+ * now and then for collectors that join late.
+ */
+static void ipfix_begin(void)
+{
+	size_t off;
+
+	exporter.len = IPFIX_HDR_LEN;
+	exporter.set_id = 0;
+	exporter.records = 0;
+
+	if (exporter.msgs % EXPORT_TMPL_EVERY)
+		return;
+
+	off = exporter.len;
+	export_put16(IPFIX_SET_TMPL);
+	export_put16(0);
+
+	ipfix_template(IPFIX_TMPL_IP4, ipfix_fields_ip4,
+		       array_size(ipfix_fields_ip4));
+	ipfix_template(IPFIX_TMPL_IP6, ipfix_fields_ip6,
+		       array_size(ipfix_fields_ip6));
+
+	export_patch16(off + 2, exporter.len - off);
+}
+
+static void ipfix_close_set(void)
+{
+	if (exporter.set_id == 0)
+		return;
+
+	export_patch16(exporter.set_off + 2, exporter.len - exporter.set_off);
+	exporter.set_id = 0;
+}
+
+/* Called with exporter.lock held. */
+static void export_flush_locked(void)
+{
+	uint32_t val;
+
+	if (exporter.format == EXPORT_IPFIX) {
+		if (exporter.records == 0)
+			return;
+
+		ipfix_close_set();
+
+		export_patch16(0, IPFIX_VERSION);
+		export_patch16(2, exporter.len);
+		val = cpu_to_be32(time(NULL));
+		fmemcpy(exporter.buff + 4, &val, sizeof(val));
+		val = cpu_to_be32(exporter.seq);
+		fmemcpy(exporter.buff + 8, &val, sizeof(val));
+		fmemset(exporter.buff + 12, 0, 4);
+
+		exporter.seq += exporter.records;
+	} else if (exporter.len == 0) {
+		return;
+	}
+
+	/* Nobody listening on the UDP side is not our problem */
+	if (exporter.udp)
+		send(exporter.fd, exporter.buff, exporter.len, MSG_DONTWAIT);
+	else
+		write_exact(exporter.fd, exporter.buff, exporter.len, 1);
+
+	exporter.len = 0;
+
+	if (exporter.format == EXPORT_IPFIX) {
+		exporter.msgs++;
+		ipfix_begin();
+	}
+}
+
+static void export_flush(void)
+{
+	mutexlock_lock(&exporter.lock);
+	export_flush_locked();
+	mutexlock_unlock(&exporter.lock);
+}
+
+static inline uint64_t export_start_ms(const struct flow_entry *n)
+{
+	if (n->timestamp_start)
+		return n->timestamp_start / 1000000ULL;
+
+	return n->first_seen * 1000ULL;
+}
+
+static inline uint64_t export_stop_ms(const struct flow_entry *n,
+				      enum export_event ev)
+{
+	if (ev == EXPORT_END && n->timestamp_stop)
+		return n->timestamp_stop / 1000000ULL;
+
+	return time(NULL) * 1000ULL;
+}
+
+static void export_ipfix(const struct flow_entry *n, enum export_event ev)
+{
+	int ip6 = n->l3_proto == AF_INET6;
+	uint16_t id = ip6 ? IPFIX_TMPL_IP6 : IPFIX_TMPL_IP4;
+	size_t need = ip6 ? IPFIX_REC_IP6 : IPFIX_REC_IP4;
+
+	if (exporter.set_id != id)
+		need += 4;
+	if (exporter.len + need > exporter.size)
+		export_flush_locked();
+
+	if (exporter.set_id != id) {
+		ipfix_close_set();
+
+		exporter.set_off = exporter.len;
+		exporter.set_id = id;
+		export_put16(id);
+		export_put16(0);
+	}
+
+	export_put32(n->flow_id);
+	if (ip6) {
+		export_put(n->ip6_src_addr, sizeof(n->ip6_src_addr));
+		export_put(n->ip6_dst_addr, sizeof(n->ip6_dst_addr));
+	} else {
+		export_put32(n->ip4_src_addr);
+		export_put32(n->ip4_dst_addr);
+	}
+	export_put16(n->port_src);
+	export_put16(n->port_dst);
+	export_put8(n->l4_proto);
+	export_put8(ev);
+	export_put64(n->counter_pkts);
+	export_put64(n->counter_bytes);
+	export_put64(export_start_ms(n));
+	export_put64(export_stop_ms(n, ev));
+
+	exporter.records++;
+}
+
+struct export_line {
+	char buff[4096];
+	size_t len;
+};
+
+static void export_printf(struct export_line *l, const char *fmt, ...)
+	__check_format_printf(2, 3);
+
+static void export_printf(struct export_line *l, const char *fmt, ...)
+{
+	int ret;
+	va_list ap;
+
+	va_start(ap, fmt);
+	ret = vsnprintf(l->buff + l->len, sizeof(l->buff) - l->len, fmt, ap);
+	va_end(ap);
+
+	if (ret > 0)
+		l->len = min(l->len + ret, sizeof(l->buff) - 1);
+}
+
+/* Quoted and escaped the way JSON respectively CSV want it */
+static void export_string(struct export_line *l, const char *sep,
+			  const char *key, const char *str)
+{
+	int json = exporter.format == EXPORT_JSON;
+
+	if (json)
+		export_printf(l, "%s\"%s\":\"", sep, key);
+	else
+		export_printf(l, ",\"");
+
+	for (; *str && l->len < sizeof(l->buff) - 16; str++) {
+		if ((unsigned char) *str < 0x20) {
+			export_printf(l, json ? "\\u%04x" : " ", *str);
+			continue;
+		}
+
+		if (*str == '"')
+			l->buff[l->len++] = json ? '\\' : '"';
+		else if (*str == '\\' && json)
+			l->buff[l->len++] = '\\';
+
+		l->buff[l->len++] = *str;
+	}
+
+	export_printf(l, "\"");
+}
+
+static const char *export_addr(const struct flow_entry *n, int src,
+			       char *buff, size_t len)
+{
+	uint32_t ip4;
+
+	if (n->l3_proto == AF_INET6)
+		return inet_ntop(AF_INET6, src ? n->ip6_src_addr :
+				 n->ip6_dst_addr, buff, len);
+
+	ip4 = htonl(src ? n->ip4_src_addr : n->ip4_dst_addr);
+
+	return inet_ntop(AF_INET, &ip4, buff, len);
+}
+
+static void export_text(const struct flow_entry *n,
+			const struct flow_entry_ext *e, enum export_event ev)
+{
+	struct export_line l = { .len = 0 };
+	char src[INET6_ADDRSTRLEN], dst[INET6_ADDRSTRLEN];
+	const char *l3 = l3proto2str[n->l3_proto];
+	const char *l4 = l4proto2str[n->l4_proto];
+	const char *fmt;
+
+	export_addr(n, 1, src, sizeof(src));
+	export_addr(n, 0, dst, sizeof(dst));
+
+	if (exporter.format == EXPORT_JSON)
+		fmt = "{\"event\":\"%s\",\"id\":%u,\"l3\":\"%s\","
+		      "\"l4\":\"%s\",\"state\":\"%s\",\"src\":\"%s\","
+		      "\"sport\":%u,\"dst\":\"%s\",\"dport\":%u,"
+		      "\"pkts\":%llu,\"bytes\":%llu,\"pps\":%.1f,"
+		      "\"bps\":%.0f,\"start\":%llu,\"stop\":%llu,"
+		      "\"pid\":%d";
+	else
+		fmt = "%s,%u,%s,%s,%s,%s,%u,%s,%u,%llu,%llu,%.1f,%.0f,"
+		      "%llu,%llu,%d";
+
+	export_printf(&l, fmt, ev == EXPORT_END ? "end" : "active",
+		      n->flow_id, l3 ? : "unknown", l4 ? : "unknown",
+		      flow_entry_state_str(n), src, n->port_src, dst,
+		      n->port_dst, (unsigned long long) n->counter_pkts,
+		      (unsigned long long) n->counter_bytes, n->rate_pps,
+		      n->rate_bps, (unsigned long long) export_start_ms(n),
+		      (unsigned long long) export_stop_ms(n, ev), e->procnum);
+
+	export_string(&l, ",", "process", e->cmdline);
+	export_string(&l, ",", "src_name", e->rev_dns_src);
+	export_string(&l, ",", "dst_name", e->rev_dns_dst);
+	export_string(&l, ",", "src_country", e->country_src);
+	export_string(&l, ",", "dst_country", e->country_dst);
+	export_string(&l, ",", "src_city", e->city_src);
+	export_string(&l, ",", "dst_city", e->city_dst);
+
+	export_printf(&l, exporter.format == EXPORT_JSON ? "}\n" : "\n");
+
+	if (exporter.len + l.len > exporter.size)
+		export_flush_locked();
+
+	export_put(l.buff, l.len);
+}
+
+static void export_flow(const struct flow_entry *n,
+			const struct flow_entry_ext *e, enum export_event ev)
+{
+	mutexlock_lock(&exporter.lock);
+
+	if (exporter.format == EXPORT_IPFIX)
+		export_ipfix(n, ev);
+	else
+		export_text(n, e, ev);
+
+	mutexlock_unlock(&exporter.lock);
+}
+
+/* End records of a batch, taken while flow_list.lock is held and only
+ * exported once it is dropped, since exporting may block on the fd.
+ * Only touched by the collector thread.
+ */
+static struct export_end {
+	struct flow_entry n;
+	struct flow_entry_ext e;
+} *export_ends;
+static size_t export_ends_len, export_ends_size;
+
+static void export_flow_end_slot(struct flow_list *fl, uint32_t slot)
+{
+	struct export_end *end;
+
+	if (export_ends_len == export_ends_size) {
+		export_ends_size = max((size_t) 64, export_ends_size * 2);
+		export_ends = xrealloc(export_ends, export_ends_size,
+				       sizeof(*export_ends));
+	}
+
+	end = &export_ends[export_ends_len++];
+	end->n = *flow_list_entry(fl, slot);
+	end->e = *flow_list_ext(fl, slot);
+}
+
+/* A flow is going away: queue it with the final counters. */
+static void export_flow_end(struct flow_list *fl, struct nf_conntrack *ct)
+{
+	struct flow_bucket *b;
+	uint32_t slot;
+
+	b = flow_table_find(fl, nfct_get_attr_u32(ct, ATTR_ID));
+	if (b == NULL)
+		return;
+
+	slot = b->slot - 1;
+	flow_entry_from_ct(flow_list_entry(fl, slot), ct);
+
+	export_flow_end_slot(fl, slot);
+}
+
+/* Called without flow_list.lock held. */
+static void export_flow_ends(void)
+{
+	size_t i;
+
+	for (i = 0; i < export_ends_len; i++)
+		export_flow(&export_ends[i].n, &export_ends[i].e, EXPORT_END);
+
+	export_ends_len = 0;
+	export_flush();
+}
+
+static void export_open(const char *dest)
+{
+	int ret;
+	char *host, *port;
+	struct addrinfo hints, *ai;
+
+	if (!strcmp(dest, "-")) {
+		exporter.fd = STDOUT_FILENO;
+	} else if (!strncmp(dest, "udp:", 4)) {
+		host = xstrdup(dest + 4);
+		port = strrchr(host, ':');
+		if (!port)
+			panic("Export destination must be udp:<host>:<port>!\n");
+		*port++ = 0;
+
+		if (host[0] == '[' && host[strlen(host) - 1] == ']') {
+			host[strlen(host) - 1] = 0;
+			memmove(host, host + 1, strlen(host));
+		}
+
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_DGRAM;
+
+		ret = getaddrinfo(host, port, &hints, &ai);
+		if (ret)
+			panic("Cannot resolve %s: %s\n", dest, gai_strerror(ret));
+
+		exporter.fd = socket(ai->ai_family, SOCK_DGRAM, 0);
+		if (exporter.fd < 0 ||
+		    connect(exporter.fd, ai->ai_addr, ai->ai_addrlen) < 0)
+			panic("Cannot connect export socket: %s\n",
+			      strerror(errno));
+
+		exporter.udp = 1;
+
+		freeaddrinfo(ai);
+		xfree(host);
+	} else {
+		exporter.fd = open_or_die_m(dest, O_WRONLY | O_CREAT |
+					    O_APPEND, S_IRUSR | S_IWUSR |
+					    S_IRGRP | S_IROTH);
+	}
+
+	exporter.size = exporter.udp ? EXPORT_UDP_BUFSIZ : EXPORT_BUFSIZ;
+	if (exporter.format == EXPORT_IPFIX)
+		exporter.size = min(exporter.size, (size_t) IPFIX_MAX_LEN);
+	exporter.buff = xmalloc(exporter.size);
+	exporter.len = 0;
+
+	mutexlock_init(&exporter.lock);
+
+	if (exporter.format == EXPORT_IPFIX)
+		ipfix_begin();
+	else if (exporter.format == EXPORT_CSV && !exporter.udp)
+		export_put(export_csv_header, strlen(export_csv_header));
+}
+
+/* Called once the collector is gone, for whatever it still queued. */
+static void export_close(void)
+{
+	export_flow_ends();
+	if (export_ends)
+		xfree(export_ends);
+
+	if (exporter.fd != STDOUT_FILENO)
+		close(exporter.fd);
+	exporter.fd = -1;
+
+	xfree(exporter.buff);
+	mutexlock_destroy(&exporter.lock);
+}
+
+/* Replaces the presenter when exporting. */
+static void export_loop(void)
+{
+	unsigned int i;
+	uint32_t slot, used;
+	double now, last = presenter_clock();
+	struct flow_entry *n;
+
+	rcu_register_thread();
+
+	while (!sigint) {
+		for (i = 0; i < max(exporter.interval, 1U) && !sigint; i++)
+			sleep(1);
+		if (sigint || exporter.interval == 0)
+			continue;
+
+		now = presenter_clock();
+
+		rcu_read_lock();
+
+		used = flow_list_used(&flow_list);
+		for (slot = 0; slot < used; slot++) {
+			n = flow_list_entry(&flow_list, slot);
+			if (!n->active)
+				continue;
+
+			presenter_flow_rate(n, now - last);
+			export_flow(n, flow_list_ext(&flow_list, slot),
+				    EXPORT_ACTIVE);
+		}
+
+		rcu_read_unlock();
+
+		last = now;
+		export_flush();
+	}
+
+	rcu_unregister_thread();
+}
+
+/* Called with flow_list.lock held, for a whole batch of events. */
 static int collector_cb(enum nf_conntrack_msg_type type,
 			struct nf_conntrack *ct, void *data)
 {
 	if (sigint)
 		return NFCT_CB_STOP;
 
-	synchronize_rcu();
-	spinlock_lock(&flow_list.lock);
-
 	switch (type) {
 	case NFCT_T_NEW:
-		flow_list_new_entry(&flow_list, ct);
-		break;
 	case NFCT_T_UPDATE:
 		flow_list_update_entry(&flow_list, ct);
 		break;
 	case NFCT_T_DESTROY:
+		if (exporter.fd >= 0)
+			export_flow_end(&flow_list, ct);
 		flow_list_destroy_entry(&flow_list, ct);
 		break;
 	default:
 		break;
 	}
 
-	spinlock_unlock(&flow_list.lock);
+	return NFCT_CB_CONTINUE;
+}
+
+/* The dump does not pass the socket filter of the event handle, so the
+ * same selection is done here.
+ */
+static int collector_wanted(const struct nf_conntrack *ct)
+{
+	const void *src;
+
+	switch (nfct_get_attr_u8(ct, ATTR_ORIG_L3PROTO)) {
+	case AF_INET:
+		if (nfct_get_attr_u32(ct, ATTR_ORIG_IPV4_SRC) ==
+		    filter_ipv4.addr)
+			return 0;
+		break;
+	case AF_INET6:
+		src = nfct_get_attr(ct, ATTR_ORIG_IPV6_SRC);
+		if (src && !memcmp(src, &in6addr_loopback,
+				   sizeof(in6addr_loopback)))
+			return 0;
+		break;
+	default:
+		return 0;
+	}
+
+	switch (nfct_get_attr_u8(ct, ATTR_ORIG_L4PROTO)) {
+	case IPPROTO_TCP:
+		return what & INCLUDE_TCP;
+	case IPPROTO_UDP:
+	case IPPROTO_UDPLITE:
+		return what & INCLUDE_UDP;
+	case IPPROTO_DCCP:
+		return what & INCLUDE_DCCP;
+	case IPPROTO_SCTP:
+		return what & INCLUDE_SCTP;
+	case IPPROTO_ICMP:
+		return what & INCLUDE_ICMP && what & INCLUDE_IPV4;
+	case IPPROTO_ICMPV6:
+		return what & INCLUDE_ICMP && what & INCLUDE_IPV6;
+	default:
+		return 0;
+	}
+}
+
+static int collector_dump_cb(enum nf_conntrack_msg_type type,
+			     struct nf_conntrack *ct, void *data)
+{
+	struct flow_bucket *b;
+
+	if (sigint)
+		return NFCT_CB_STOP;
+
+	if (!collector_wanted(ct))
+		return NFCT_CB_CONTINUE;
+
+	flow_list_update_entry(&flow_list, ct);
+
+	b = flow_table_find(&flow_list, nfct_get_attr_u32(ct, ATTR_ID));
+	if (b != NULL)
+		flow_list_ext(&flow_list, b->slot - 1)->dump_gen =
+			flow_list.dump_gen;
 
 	return NFCT_CB_CONTINUE;
 }
 
-static inline void collector_flush(struct nfct_handle *handle, uint8_t family)
+/* Called with flow_list.lock held after a complete dump: whatever it did
+ * not list is gone, we just missed its destroy event.
+ */
+static void collector_sweep(struct flow_list *fl)
+{
+	uint32_t slot, used = flow_list_used(fl);
+	struct flow_bucket *b;
+	struct flow_entry *n;
+
+	for (slot = 0; slot < used; slot++) {
+		n = flow_list_entry(fl, slot);
+		if (!n->active ||
+		    flow_list_ext(fl, slot)->dump_gen == fl->dump_gen)
+			continue;
+
+		b = flow_table_find(fl, n->flow_id);
+		if (b == NULL || b->slot - 1 != slot)
+			continue;
+
+		if (exporter.fd >= 0)
+			export_flow_end_slot(fl, slot);
+		flow_list_remove(fl, b);
+	}
+}
+
+/* Bulk load of what conntrack already tracks. Events are subscribed to
+ * before, so whatever changes meanwhile is applied on top afterwards.
+ * Also used to resync after the kernel dropped events on us.
+ */
+static void collector_dump(void)
 {
-	nfct_query(handle, NFCT_Q_FLUSH, &family);
+	int ret = 0;
+	uint32_t family;
+	struct nfct_handle *handle;
+
+	handle = nfct_open(CONNTRACK, 0);
+	if (!handle)
+		panic("Cannot create a nfct dump handle!\n");
+
+	nfct_callback_register(handle, NFCT_T_ALL, collector_dump_cb, NULL);
+
+	spinlock_lock(&flow_list.lock);
+
+	flow_list.dump_gen++;
+
+	if (what & INCLUDE_IPV4) {
+		family = AF_INET;
+		ret |= nfct_query(handle, NFCT_Q_DUMP, &family);
+	}
+	if (what & INCLUDE_IPV6) {
+		family = AF_INET6;
+		ret |= nfct_query(handle, NFCT_Q_DUMP, &family);
+	}
+
+	/* Only a complete dump tells which flows are gone */
+	if (ret == 0 && !sigint)
+		collector_sweep(&flow_list);
+
+	flow_list_reclaim(&flow_list);
+	spinlock_unlock(&flow_list.lock);
+
+	nfct_close(handle);
 }
 
 static void *collector(void *null)
 {
-	int ret;
+	int ret, err, val;
+	socklen_t len;
+	struct pollfd pfd;
 	struct nfct_handle *handle;
 	struct nfct_filter *filter;
 
@@ -1088,8 +2510,12 @@ static void *collector(void *null)
 	if (!handle)
 		panic("Cannot create a nfct handle!\n");
 
-	collector_flush(handle, AF_INET);
-	collector_flush(handle, AF_INET6);
+	if (nl_bufsize > 0)
+		nfnl_rcvbufsiz(nfct_nfnlh(handle), nl_bufsize);
+
+	len = sizeof(val);
+	if (getsockopt(nfct_fd(handle), SOL_SOCKET, SO_RCVBUF, &val, &len) == 0)
+		uatomic_set(&nl_rcvbuf, val);
 
 	filter = nfct_filter_create();
 	if (!filter)
@@ -1132,8 +2558,43 @@ static void *collector(void *null)
 
 	rcu_register_thread();
 
-	while (!sigint && ret >= 0)
+	collector_dump();
+
+	/* Drain everything that is queued per wakeup as one batch: one lock
+	 * round trip and a single grace period for all freed entries.
+	 */
+	set_nonblocking(nfct_fd(handle));
+	pfd.fd = nfct_fd(handle);
+	pfd.events = POLLIN;
+
+	while (!sigint) {
+		if (poll(&pfd, 1, 1000) <= 0)
+			continue;
+
+		spinlock_lock(&flow_list.lock);
 		ret = nfct_catch(handle);
+		err = errno;
+		flow_list_reclaim(&flow_list);
+		spinlock_unlock(&flow_list.lock);
+
+		if (exporter.fd >= 0)
+			export_flow_ends();
+
+		if (ret >= 0 || err == EAGAIN || err == EINTR)
+			continue;
+		/* The kernel dropped events for us, the socket is fine, but
+		 * destroy events may be among them: resync with a dump.
+		 */
+		if (err == ENOBUFS) {
+			uatomic_inc(&nl_overruns);
+			collector_dump();
+			if (exporter.fd >= 0)
+				export_flow_ends();
+			continue;
+		}
+
+		break;
+	}
 
 	rcu_unregister_thread();
 
@@ -1147,6 +2608,7 @@ int main(int argc, char **argv)
 {
 	pthread_t tid;
 	int ret, c, opt_index, what_cmd = 0;
+	char *export_dest = NULL;
 
 	setfsuid(getuid());
 	setfsgid(getgid());
@@ -1182,6 +2644,25 @@ int main(int argc, char **argv)
 			update_geoip();
 			die();
 			break;
+		case 'b':
+			nl_bufsize = strtoul(optarg, NULL, 0);
+			break;
+		case 'e':
+			export_dest = xstrdup(optarg);
+			break;
+		case 'F':
+			if (!strcmp(optarg, "json"))
+				exporter.format = EXPORT_JSON;
+			else if (!strcmp(optarg, "csv"))
+				exporter.format = EXPORT_CSV;
+			else if (!strcmp(optarg, "ipfix"))
+				exporter.format = EXPORT_IPFIX;
+			else
+				panic("Unknown export format %s!\n", optarg);
+			break;
+		case 'i':
+			exporter.interval = strtoul(optarg, NULL, 0);
+			break;
 		case 'h':
 			help();
 			break;
@@ -1201,15 +2682,32 @@ int main(int argc, char **argv)
 	register_signal(SIGINT, signal_handler);
 	register_signal(SIGHUP, signal_handler);
 
+	if (export_dest)
+		export_open(export_dest);
+
 	init_geoip(1);
+	revdns_init();
+	procidx_init();
 
 	ret = pthread_create(&tid, NULL, collector, NULL);
 	if (ret < 0)
 		panic("Cannot create phthread!\n");
 
-	presenter();
+	if (export_dest)
+		export_loop();
+	else
+		presenter();
+
+	/* The collector exports end records, it has to be gone first */
+	sigint = 1;
+	pthread_join(tid, NULL);
+
+	if (export_dest)
+		export_close();
 
+	revdns_stop();
 	destroy_geoip();
+	xfree(export_dest);
 
 	return 0;
 }
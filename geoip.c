@@ -21,6 +21,7 @@
 #include "xutils.h"
 #include "xio.h"
 #include "xmalloc.h"
+#include "locking.h"
 #include "zlib.h"
 #include "geoip.h"
 
@@ -73,8 +74,6 @@ static GeoIP *gi4_asname = NULL, *gi6_asname = NULL;
 static GeoIP *gi4_country = NULL, *gi6_country = NULL;
 static GeoIP *gi4_city = NULL, *gi6_city = NULL;
 
-static GeoIPRecord empty = { 0 };
-
 static char *servers[16] = { 0 };
 
 #define CITYV4		(1 << 0)
@@ -249,86 +248,197 @@ again:
 	return 0;
 }
 
-static GeoIPRecord *geoip4_get_record(struct sockaddr_in sa)
-{
-	bug_on(gi4_city == NULL);
+/* Lookups are cached per /24 (IPv4) or /48 (IPv6) prefix, which is well
+ * below the granularity of the GeoLite databases for AS and country and
+ * close enough for cities. One miss costs a single city record, country
+ * and AS lookup; everything else is a hash probe under the cache lock.
+ */
+#define GEOIP_CACHE_SIZE	4096
 
-	return GeoIP_record_by_ipnum(gi4_city, ntohl(sa.sin_addr.s_addr)) ? : &empty;
-}
+#define GEOIP_PREFIX4		3
+#define GEOIP_PREFIX6		6
 
-static GeoIPRecord *geoip6_get_record(struct sockaddr_in6 sa)
-{
-	bug_on(gi6_city == NULL);
+struct geoip_cache_entry {
+	struct geoip_cache_entry *hnext, *prev, *next;
+	int family;
+	uint8_t prefix[GEOIP_PREFIX6];
+	struct geoip_info info;
+};
 
-	return GeoIP_record_by_ipnum_v6(gi6_city, sa.sin6_addr) ? : &empty;
-}
+static struct geoip_cache {
+	struct geoip_cache_entry entries[GEOIP_CACHE_SIZE];
+	struct geoip_cache_entry *table[GEOIP_CACHE_SIZE];
+	struct geoip_cache_entry *mru, *lru;
+	uint32_t used;
+	struct mutexlock lock;
+} cache;
 
-const char *geoip4_as_name(struct sockaddr_in sa)
+static inline uint32_t geoip_cache_hash(int family, const uint8_t *prefix)
 {
-	bug_on(gi4_asname == NULL);
+	uint32_t i, h = 2166136261U ^ family;
 
-	return GeoIP_name_by_ipnum(gi4_asname, ntohl(sa.sin_addr.s_addr));
+	for (i = 0; i < GEOIP_PREFIX6; ++i)
+		h = (h ^ prefix[i]) * 16777619U;
+
+	return (h ^ (h >> 16)) & (GEOIP_CACHE_SIZE - 1);
 }
 
-const char *geoip6_as_name(struct sockaddr_in6 sa)
+static struct geoip_cache_entry *geoip_cache_find(int family,
+						  const uint8_t *prefix)
 {
-	bug_on(gi6_asname == NULL);
+	struct geoip_cache_entry *c = cache.table[geoip_cache_hash(family, prefix)];
+
+	while (c && (c->family != family ||
+		     memcmp(c->prefix, prefix, sizeof(c->prefix))))
+		c = c->hnext;
 
-	return GeoIP_name_by_ipnum_v6(gi6_asname, sa.sin6_addr);
+	return c;
 }
 
-float geoip4_longitude(struct sockaddr_in sa)
+static void geoip_cache_unlink(struct geoip_cache_entry *c)
 {
-	return geoip4_get_record(sa)->longitude;
+	if (c->prev)
+		c->prev->next = c->next;
+	else
+		cache.mru = c->next;
+	if (c->next)
+		c->next->prev = c->prev;
+	else
+		cache.lru = c->prev;
 }
 
-float geoip4_latitude(struct sockaddr_in sa)
+static void geoip_cache_push(struct geoip_cache_entry *c)
 {
-	return geoip4_get_record(sa)->latitude;
+	c->prev = NULL;
+	c->next = cache.mru;
+	if (cache.mru)
+		cache.mru->prev = c;
+	else
+		cache.lru = c;
+	cache.mru = c;
 }
 
-float geoip6_longitude(struct sockaddr_in6 sa)
+static struct geoip_cache_entry *geoip_cache_alloc(int family,
+						   const uint8_t *prefix)
 {
-	return geoip6_get_record(sa)->longitude;
+	struct geoip_cache_entry *c, **pp;
+
+	if (cache.used < GEOIP_CACHE_SIZE) {
+		c = &cache.entries[cache.used++];
+	} else {
+		c = cache.lru;
+		geoip_cache_unlink(c);
+
+		pp = &cache.table[geoip_cache_hash(c->family, c->prefix)];
+		while (*pp != c)
+			pp = &(*pp)->hnext;
+		*pp = c->hnext;
+	}
+
+	c->family = family;
+	memcpy(c->prefix, prefix, sizeof(c->prefix));
+
+	pp = &cache.table[geoip_cache_hash(family, prefix)];
+	c->hnext = *pp;
+	*pp = c;
+
+	return c;
 }
 
-float geoip6_latitude(struct sockaddr_in6 sa)
+static void geoip_fill(struct geoip_info *info, GeoIPRecord *rec,
+		       const char *country, char *as)
 {
-	return geoip6_get_record(sa)->latitude;
+	memset(info, 0, sizeof(*info));
+
+	if (country)
+		strlcpy(info->country, country, sizeof(info->country));
+	if (as) {
+		strlcpy(info->as, as, sizeof(info->as));
+		free(as);
+	}
+	if (rec) {
+		if (rec->city)
+			strlcpy(info->city, rec->city, sizeof(info->city));
+		if (rec->region)
+			strlcpy(info->region, rec->region, sizeof(info->region));
+
+		info->latitude = rec->latitude;
+		info->longitude = rec->longitude;
+
+		GeoIPRecord_delete(rec);
+	}
 }
 
-const char *geoip4_city_name(struct sockaddr_in sa)
+static void geoip4_fill(struct geoip_info *info, struct sockaddr_in sa)
 {
-	return geoip4_get_record(sa)->city;
+	unsigned long ipnum = ntohl(sa.sin_addr.s_addr);
+
+	geoip_fill(info,
+		   gi4_city ? GeoIP_record_by_ipnum(gi4_city, ipnum) : NULL,
+		   gi4_country ? GeoIP_country_name_by_ipnum(gi4_country, ipnum) : NULL,
+		   gi4_asname ? GeoIP_name_by_ipnum(gi4_asname, ipnum) : NULL);
 }
 
-const char *geoip6_city_name(struct sockaddr_in6 sa)
+static void geoip6_fill(struct geoip_info *info, struct sockaddr_in6 sa)
 {
-	return geoip6_get_record(sa)->city;
+	geoip_fill(info,
+		   gi6_city ? GeoIP_record_by_ipnum_v6(gi6_city, sa.sin6_addr) : NULL,
+		   gi6_country ? GeoIP_country_name_by_ipnum_v6(gi6_country, sa.sin6_addr) : NULL,
+		   gi6_asname ? GeoIP_name_by_ipnum_v6(gi6_asname, sa.sin6_addr) : NULL);
 }
 
-const char *geoip4_region_name(struct sockaddr_in sa)
+void geoip4_lookup(struct sockaddr_in sa, struct geoip_info *info)
 {
-	return geoip4_get_record(sa)->region;
+	uint8_t prefix[GEOIP_PREFIX6] = { 0 };
+	struct geoip_cache_entry *c;
+
+	memcpy(prefix, &sa.sin_addr, GEOIP_PREFIX4);
+
+	mutexlock_lock(&cache.lock);
+	c = geoip_cache_find(AF_INET, prefix);
+	if (c) {
+		geoip_cache_unlink(c);
+	} else {
+		c = geoip_cache_alloc(AF_INET, prefix);
+		geoip4_fill(&c->info, sa);
+	}
+	geoip_cache_push(c);
+	fmemcpy(info, &c->info, sizeof(*info));
+	mutexlock_unlock(&cache.lock);
 }
 
-const char *geoip6_region_name(struct sockaddr_in6 sa)
+void geoip6_lookup(struct sockaddr_in6 sa, struct geoip_info *info)
 {
-	return geoip6_get_record(sa)->region;
+	uint8_t prefix[GEOIP_PREFIX6];
+	struct geoip_cache_entry *c;
+
+	memcpy(prefix, &sa.sin6_addr, GEOIP_PREFIX6);
+
+	mutexlock_lock(&cache.lock);
+	c = geoip_cache_find(AF_INET6, prefix);
+	if (c) {
+		geoip_cache_unlink(c);
+	} else {
+		c = geoip_cache_alloc(AF_INET6, prefix);
+		geoip6_fill(&c->info, sa);
+	}
+	geoip_cache_push(c);
+	fmemcpy(info, &c->info, sizeof(*info));
+	mutexlock_unlock(&cache.lock);
 }
 
-const char *geoip4_country_name(struct sockaddr_in sa)
+static void init_geoip_cache(void)
 {
-	bug_on(gi4_country == NULL);
+	memset(cache.table, 0, sizeof(cache.table));
+	cache.mru = cache.lru = NULL;
+	cache.used = 0;
 
-	return GeoIP_country_name_by_ipnum(gi4_country, ntohl(sa.sin_addr.s_addr));
+	mutexlock_init(&cache.lock);
 }
 
-const char *geoip6_country_name(struct sockaddr_in6 sa)
+static void destroy_geoip_cache(void)
 {
-	bug_on(gi6_country == NULL);
-
-	return GeoIP_country_name_by_ipnum_v6(gi6_country, sa.sin6_addr);
+	mutexlock_destroy(&cache.lock);
 }
 
 static int fdout, fderr;
@@ -554,6 +664,7 @@ void init_geoip(int enforce)
 	init_geoip_city(enforce);
 	init_geoip_country(enforce);
 	init_geoip_asname(enforce);
+	init_geoip_cache();
 }
 
 void update_geoip(void)
@@ -590,6 +701,7 @@ void destroy_geoip(void)
 	destroy_geoip_city();
 	destroy_geoip_country();
 	destroy_geoip_asname();
+	destroy_geoip_cache();
 
 	geoip_db_present = 0;
 }
@@ -9,21 +9,20 @@
 
 #include <netinet/in.h>
 
+/* Empty strings mean the field is unknown for that address. */
+struct geoip_info {
+	char country[64];
+	char region[16];
+	char city[128];
+	char as[128];
+	float latitude, longitude;
+};
+
 extern void init_geoip(int enforce);
 extern void update_geoip(void);
 extern int geoip_working(void);
-extern const char *geoip4_city_name(struct sockaddr_in sa);
-extern const char *geoip6_city_name(struct sockaddr_in6 sa);
-extern const char *geoip4_region_name(struct sockaddr_in sa);
-extern const char *geoip6_region_name(struct sockaddr_in6 sa);
-extern const char *geoip4_country_name(struct sockaddr_in sa);
-extern const char *geoip6_country_name(struct sockaddr_in6 sa);
-extern float geoip4_longitude(struct sockaddr_in sa);
-extern float geoip4_latitude(struct sockaddr_in sa);
-extern float geoip6_longitude(struct sockaddr_in6 sa);
-extern float geoip6_latitude(struct sockaddr_in6 sa);
-extern const char *geoip4_as_name(struct sockaddr_in sa);
-extern const char *geoip6_as_name(struct sockaddr_in6 sa);
+extern void geoip4_lookup(struct sockaddr_in sa, struct geoip_info *info);
+extern void geoip6_lookup(struct sockaddr_in6 sa, struct geoip_info *info);
 extern void destroy_geoip(void);
 
 #endif /* GEOIPH_H */
@@ -10,6 +10,7 @@
  *        Chapter 'The Black Gate is Closed'.
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <curses.h>
@@ -21,6 +22,16 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <time.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <stdarg.h>
+#include <poll.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/if_link.h>
 
 #include "die.h"
 #include "xmalloc.h"
@@ -34,18 +45,73 @@ struct wifi_stat {
 	int signal_level /*, noise_level*/;
 };
 
-struct ifstat {
+struct devstat {
 	long long unsigned int rx_bytes, rx_packets, rx_drops, rx_errors;
 	long long unsigned int rx_fifo, rx_frame, rx_multi;
 	long long unsigned int tx_bytes, tx_packets, tx_drops, tx_errors;
 	long long unsigned int tx_fifo, tx_colls, tx_carrier;
-	long long unsigned int irqs[MAX_CPUS], irqs_srx[MAX_CPUS], irqs_stx[MAX_CPUS];
-	int64_t cpu_user[MAX_CPUS], cpu_nice[MAX_CPUS], cpu_sys[MAX_CPUS];
-	int64_t cpu_idle[MAX_CPUS], cpu_iow[MAX_CPUS], mem_free, mem_total;
-	uint32_t irq_nr, procs_run, procs_iow, cswitch, forks;
 	struct wifi_stat wifi;
 };
 
+struct queuestat {
+	long long unsigned int rx_packets, rx_bytes, rx_drops;
+	long long unsigned int tx_packets, tx_bytes, tx_drops;
+};
+
+/* Per-CPU counters are kept as one array per counter, all of them in a
+ * single block of CPU_STATS * ncpus entries, so that differences can be
+ * taken in one pass over the block.
+ */
+enum cpu_stat {
+	CPU_IRQS,
+	CPU_IRQS_SRX,
+	CPU_IRQS_STX,
+	CPU_USER,
+	CPU_NICE,
+	CPU_SYS,
+	CPU_IDLE,
+	CPU_IOW,
+	CPU_STATS,
+};
+
+struct ifstat {
+	struct devstat *dev;
+	struct queuestat *queue;
+	long long unsigned int *cpu[CPU_STATS];
+	long long unsigned int mem_free, mem_total;
+	uint32_t procs_run, procs_iow, cswitch, forks;
+};
+
+/* Per-queue counters are picked out of the driver's ethtool statistics
+ * by name, e.g. rx_queue_3_packets, rx-3.bytes or tx3_dropped.
+ */
+#define QUEUES_MAX	1024
+
+struct queue_map {
+	uint32_t stat, queue;
+	size_t off;
+};
+
+struct ifdev {
+	char name[IFNAMSIZ];
+	/* Name to look for in /proc/interrupts, the device or its driver. */
+	char irq_name[32];
+	int ifindex;
+	short ifflags;
+	uint32_t qoff, nqueues, nqmap;
+	int *queue_irq;
+	struct queue_map *qmap;
+	struct ethtool_stats *estats;
+};
+
+static struct ifdev *devs = NULL;
+static uint32_t ndevs = 0, nqueues = 0;
+static char *devlist = NULL;
+
+/* Sized once from the configured CPUs, so IDs stay put across hotplug. */
+static int ncpus = 0, nnodes = 1;
+static int *cpu_node = NULL;
+
 volatile sig_atomic_t sigint = 0;
 
 static struct ifstat stats_old, stats_new, stats_delta;
@@ -54,10 +120,13 @@ static int stats_loop = 0;
 
 static WINDOW *stats_screen = NULL;
 
-static const char *short_options = "d:t:vhclp";
+static const char *short_options = "d:t:r:w:b:vhclp";
 static const struct option long_options[] = {
 	{"dev",			required_argument,	NULL, 'd'},
 	{"interval",		required_argument,	NULL, 't'},
+	{"rate",		required_argument,	NULL, 'r'},
+	{"window",		required_argument,	NULL, 'w'},
+	{"burst",		required_argument,	NULL, 'b'},
 	{"promisc",		no_argument,		NULL, 'p'},
 	{"csv",			no_argument,		NULL, 'c'},
 	{"loop",		no_argument,		NULL, 'l'},
@@ -94,7 +163,7 @@ static inline char *snr_to_str(int level)
 	return "unknown";
 }
 
-static inline int iswireless(const struct ifstat *stats)
+static inline int iswireless(const struct devstat *stats)
 {
 	return stats->wifi.bitrate > 0;
 }
@@ -104,10 +173,15 @@ static void help(void)
 	printf("\nifpps %s, top-like kernel networking and system statistics\n",
 	       VERSION_STRING);
 	puts("http://www.netsniff-ng.org\n\n"
-	     "Usage: ifpps [options] || ifpps <netdev>\n"
+	     "Usage: ifpps [options] || ifpps <netdev>[,<netdev>...]\n"
 	     "Options:\n"
-	     "  -d|--dev <netdev>      Device to fetch statistics for e.g., eth0\n"
+	     "  -d|--dev <netdevs>     Devices to fetch statistics for e.g., eth0,eth1\n"
+	     "                         or all for every device but lo\n"
 	     "  -t|--interval <time>   Refresh time in ms (default 1000 ms)\n"
+	     "  -r|--rate <hz>         Packet rate sampling frequency (default 100 Hz)\n"
+	     "  -w|--window <sec>      Window for min/avg/max/p99 rates (default 5 s)\n"
+	     "  -b|--burst <pps>       Count sample periods above pps as microbursts\n"
+	     "                         (default: 4 times the window average)\n"
 	     "  -p|--promisc           Promiscuous mode\n"
 	     "  -c|--csv               Output to terminal as Gnuplot-ready data\n"
 	     "  -l|--loop              Continuous CSV output\n"
@@ -116,10 +190,20 @@ static void help(void)
 	     "Examples:\n"
 	     "  ifpps eth0\n"
 	     "  ifpps -pd eth0\n"
-	     "  ifpps -lpcd wlan0 > plot.dat\n\n"
+	     "  ifpps -lpcd wlan0 > plot.dat\n"
+	     "  ifpps -r 1000 -w 10 eth0\n"
+	     "  ifpps -d eth0,eth1\n"
+	     "  ifpps -d all\n\n"
+	     "Keys:\n"
+	     "  Up/Down/PgUp/PgDn/Home/End  Scroll per-CPU and queue statistics\n"
+	     "  n                           Toggle per-CPU and per-NUMA-node view\n"
+	     "  q                           Quit\n\n"
 	     "Note:\n"
 	     "  On 10G cards, RX/TX statistics are usually accumulated each > 1sec.\n"
-	     "  Thus, in those situations, it's good to use a -t of 10sec.\n\n"
+	     "  Thus, in those situations, it's good to use a -t of 10sec.\n"
+	     "  Packet rates and microbursts are summed over all given devices.\n"
+	     "  Per-queue counters need driver support for queue statistics\n"
+	     "  in ethtool -S.\n\n"
 	     "Please report bugs to <bugs@netsniff-ng.org>\n"
 	     "Copyright (C) 2009-2013 Daniel Borkmann <dborkma@tik.ee.ethz.ch>\n"
 	     "Swiss federal institute of technology (ETH Zurich)\n"
@@ -143,233 +227,779 @@ static void version(void)
 	die();
 }
 
-static int stats_proc_net_dev(const char *ifname, struct ifstat *stats)
-{
-	int ret = -EINVAL;
-	char buff[256];
-	FILE *fp;
+/* Sampling has to be cheap enough to run at 10ms intervals without
+ * showing up in the numbers it measures: device counters come from a
+ * persistent rtnetlink socket, the remaining /proc files are kept open
+ * and re-read with a single pread() into a buffer that only ever grows.
+ */
+struct proc_file {
+	const char *path;
+	int fd, ncols, *cols;
+	char *buff;
+	size_t size;
+};
+
+static struct proc_file proc_interrupts = { .path = "/proc/interrupts" };
+static struct proc_file proc_softirqs = { .path = "/proc/softirqs" };
+static struct proc_file proc_meminfo = { .path = "/proc/meminfo" };
+static struct proc_file proc_stat = { .path = "/proc/stat" };
 
-	fp = fopen("/proc/net/dev", "r");
-	if (!fp)
-		panic("Cannot open /proc/net/dev!\n");
+struct link_sock {
+	int fd;
+	uint32_t seq;
+	char *buff;
+	size_t size;
+};
 
-	if (fgets(buff, sizeof(buff), fp)) { ; }
-	if (fgets(buff, sizeof(buff), fp)) { ; }
+static struct link_sock link_main;
 
-	memset(buff, 0, sizeof(buff));
+static void proc_file_open(struct proc_file *pf)
+{
+	pf->fd = open(pf->path, O_RDONLY);
+	if (pf->fd < 0)
+		panic("Cannot open %s!\n", pf->path);
 
-	while (fgets(buff, sizeof(buff), fp) != NULL) {
-		buff[sizeof(buff) -1] = 0;
+	pf->size = 4096;
+	pf->buff = xmalloc(pf->size);
 
-		if (strstr(buff, ifname) == NULL)
-			continue;
+	pf->ncols = 0;
+	pf->cols = xmalloc(ncpus * sizeof(*pf->cols));
+}
 
-		if (sscanf(buff, "%*[a-z0-9 .-]:%llu%llu%llu%llu%llu%llu"
-			   "%llu%*u%llu%llu%llu%llu%llu%llu%llu",
-			   &stats->rx_bytes, &stats->rx_packets,
-			   &stats->rx_errors, &stats->rx_drops,
-			   &stats->rx_fifo, &stats->rx_frame,
-			   &stats->rx_multi, &stats->tx_bytes,
-			   &stats->tx_packets, &stats->tx_errors,
-			   &stats->tx_drops, &stats->tx_fifo,
-			   &stats->tx_colls, &stats->tx_carrier) == 14) {
-			ret = 0;
+static void proc_file_close(struct proc_file *pf)
+{
+	close(pf->fd);
+	xfree(pf->buff);
+	xfree(pf->cols);
+}
+
+static char *proc_file_read(struct proc_file *pf)
+{
+	ssize_t ret, len;
+
+	while (1) {
+		len = 0;
+		while ((ret = pread(pf->fd, pf->buff + len,
+				    pf->size - 1 - len, len)) > 0)
+			len += ret;
+		if (ret < 0)
+			panic("Cannot read %s!\n", pf->path);
+		if (len < pf->size - 1)
 			break;
-		}
 
-		memset(buff, 0, sizeof(buff));
+		pf->size <<= 1;
+		pf->buff = xrealloc(pf->buff, 1, pf->size);
 	}
 
-	fclose(fp);
-	return ret;
+	pf->buff[len] = 0;
+	return pf->buff;
 }
 
-static int stats_proc_interrupts(char *ifname, struct ifstat *stats)
+static inline char *proc_next_line(char *ptr)
 {
-	int ret = -EINVAL, i, cpus, try = 0;
-	char *ptr, buff[256];
-	struct ethtool_drvinfo drvinf;
-	FILE *fp;
+	ptr = strchr(ptr, '\n');
 
-	fp = fopen("/proc/interrupts", "r");
-	if (!fp)
-		panic("Cannot open /proc/interrupts!\n");
+	return ptr ? ptr + 1 : NULL;
+}
 
-	cpus = get_number_cpus();
-	bug_on(cpus > MAX_CPUS);
-retry:
-	fseek(fp, 0, SEEK_SET);
-	memset(buff, 0, sizeof(buff));
+static inline uint64_t proc_parse_u64(char **pptr)
+{
+	char *ptr = *pptr;
+	uint64_t val = 0;
 
-	while (fgets(buff, sizeof(buff), fp) != NULL) {
-		buff[sizeof(buff) - 1] = 0;
-		ptr = buff;
+	while (*ptr == ' ' || *ptr == '\t')
+		ptr++;
+	while (*ptr >= '0' && *ptr <= '9')
+		val = val * 10 + (*ptr++ - '0');
 
-		if (strstr(buff, ifname) == NULL)
-			continue;
+	*pptr = ptr;
+	return val;
+}
 
-		stats->irq_nr = strtol(ptr, &ptr, 10);
-		bug_on(stats->irq_nr == 0);
+/* /proc/interrupts and /proc/softirqs only have columns for online CPUs,
+ * the header line tells which ones.
+ */
+static void proc_cpu_columns(struct proc_file *pf, const char *line)
+{
+	char *ptr = (char *) line;
+	int cpu;
 
-		if (ptr)
+	for (pf->ncols = 0; pf->ncols < ncpus; ) {
+		while (*ptr == ' ')
 			ptr++;
-		for (i = 0; i < cpus && ptr; ++i) {
-			stats->irqs[i] = strtol(ptr, &ptr, 10);
-			if (i == cpus - 1) {
-				ret = 0;
-				goto done;
-			}
-		}
+		if (strncmp(ptr, "CPU", 3))
+			break;
 
-		memset(buff, 0, sizeof(buff));
+		ptr += 3;
+		cpu = proc_parse_u64(&ptr);
+		pf->cols[pf->ncols++] = cpu < ncpus ? cpu : -1;
 	}
+}
 
-	if (ret == -EINVAL && try == 0) {
-		memset(&drvinf, 0, sizeof(drvinf));
-		if (ethtool_drvinf(ifname, &drvinf) < 0)
-			goto done;
-
-		ifname = drvinf.driver;
-		try++;
+static inline int proc_line_starts(const char *line, const char *key,
+				   size_t len)
+{
+	return !strncmp(line, key, len);
+}
 
-		goto retry;
+/* Matches name as a whole word within the line, so that eth1 does not
+ * match eth10 or eth1.100, while eth1-rx-0 or eth1@pci still do.
+ */
+static int proc_line_has_name(const char *line, const char *name)
+{
+	const char *ptr = line, *end = strchrnul(line, '\n');
+	size_t len = strlen(name);
+
+	while ((ptr = memmem(ptr, end - ptr, name, len))) {
+		if ((ptr == line || isspace(ptr[-1]) || ptr[-1] == ',') &&
+		    !isalnum(ptr[len]) && ptr[len] != '.' && ptr[len] != ':')
+			return 1;
+		ptr += len;
 	}
-done:
-	fclose(fp);
-	return ret;
+
+	return 0;
 }
 
-static int stats_proc_softirqs(struct ifstat *stats)
+static void stats_link_open(struct link_sock *ls)
 {
-	int i, cpus;
-	char *ptr, buff[256];
-	FILE *fp;
-	enum {
-		softirqs_net_rx,
-		softirqs_net_tx,
-		softirqs_net_none,
-	} net_type = softirqs_net_none;
+	struct sockaddr_nl sa;
 
-	fp = fopen("/proc/softirqs", "r");
-	if (!fp)
-		panic("Cannot open /proc/softirqs!\n");
+	ls->seq = 0;
 
-	cpus = get_number_cpus();
-	bug_on(cpus > MAX_CPUS);
+	/* Enough for a full RTM_NEWLINK, grown if a device has more */
+	ls->size = 32 * 1024;
+	ls->buff = xmalloc(ls->size);
 
-	memset(buff, 0, sizeof(buff));
+	ls->fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (ls->fd < 0)
+		panic("Cannot open rtnetlink socket!\n");
 
-	while (fgets(buff, sizeof(buff), fp) != NULL) {
-		buff[sizeof(buff) - 1] = 0;
+	memset(&sa, 0, sizeof(sa));
+	sa.nl_family = AF_NETLINK;
+	if (bind(ls->fd, (struct sockaddr *) &sa, sizeof(sa)) < 0)
+		panic("Cannot bind rtnetlink socket!\n");
+}
 
-		if ((ptr = strstr(buff, "NET_TX:")))
-			net_type = softirqs_net_tx;
-		else if ((ptr = strstr(buff, "NET_RX:")))
-			net_type = softirqs_net_rx;
-		else
+static void stats_link_close(struct link_sock *ls)
+{
+	close(ls->fd);
+	xfree(ls->buff);
+}
+
+static void stats_link64(const struct rtnl_link_stats64 *ls,
+			 struct devstat *stats)
+{
+	/* Same folding as the kernel does for /proc/net/dev */
+	stats->rx_bytes = ls->rx_bytes;
+	stats->rx_packets = ls->rx_packets;
+	stats->rx_errors = ls->rx_errors;
+	stats->rx_drops = ls->rx_dropped + ls->rx_missed_errors;
+	stats->rx_fifo = ls->rx_fifo_errors;
+	stats->rx_frame = ls->rx_length_errors + ls->rx_over_errors +
+			  ls->rx_crc_errors + ls->rx_frame_errors;
+	stats->rx_multi = ls->multicast;
+
+	stats->tx_bytes = ls->tx_bytes;
+	stats->tx_packets = ls->tx_packets;
+	stats->tx_errors = ls->tx_errors;
+	stats->tx_drops = ls->tx_dropped;
+	stats->tx_fifo = ls->tx_fifo_errors;
+	stats->tx_colls = ls->collisions;
+	stats->tx_carrier = ls->tx_carrier_errors + ls->tx_aborted_errors +
+			    ls->tx_window_errors + ls->tx_heartbeat_errors;
+}
+
+static int stats_link(struct link_sock *ls, int ifindex, struct devstat *stats)
+{
+	ssize_t len;
+	int attr_len;
+	struct rtattr *rta;
+	struct nlmsghdr *nlh;
+	struct ifinfomsg *ifm;
+	struct {
+		struct nlmsghdr nlh;
+		struct ifinfomsg ifm;
+		struct rtattr ext;
+		uint32_t ext_mask;
+	} req;
+
+	memset(&req, 0, sizeof(req));
+	req.nlh.nlmsg_len = sizeof(req);
+	req.nlh.nlmsg_type = RTM_GETLINK;
+	req.nlh.nlmsg_flags = NLM_F_REQUEST;
+	req.nlh.nlmsg_seq = ++ls->seq;
+	req.ifm.ifi_family = AF_UNSPEC;
+	req.ifm.ifi_index = ifindex;
+	/* No VF info and friends, we only want the counters */
+	req.ext.rta_type = IFLA_EXT_MASK;
+	req.ext.rta_len = RTA_LENGTH(sizeof(req.ext_mask));
+	req.ext_mask = 0;
+
+	if (send(ls->fd, &req, sizeof(req), 0) < 0)
+		return -errno;
+
+	/* Size the read so that the reply is never truncated */
+	do {
+		len = recv(ls->fd, NULL, 0, MSG_PEEK | MSG_TRUNC);
+	} while (len < 0 && errno == EINTR);
+	if (len < 0)
+		return -errno;
+
+	if (len > ls->size) {
+		ls->size = len;
+		ls->buff = xrealloc(ls->buff, 1, ls->size);
+	}
+
+	do {
+		len = recv(ls->fd, ls->buff, ls->size, 0);
+	} while (len < 0 && errno == EINTR);
+	if (len < 0)
+		return -errno;
+
+	for (nlh = (struct nlmsghdr *) ls->buff; NLMSG_OK(nlh, len);
+	     nlh = NLMSG_NEXT(nlh, len)) {
+		if (nlh->nlmsg_seq != ls->seq)
+			continue;
+		if (nlh->nlmsg_type == NLMSG_ERROR)
+			return ((struct nlmsgerr *) NLMSG_DATA(nlh))->error;
+		if (nlh->nlmsg_type != RTM_NEWLINK)
 			continue;
 
-		for (ptr += strlen("NET_xX:"), i = 0; i < cpus; ++i) {
-			switch (net_type) {
-			case softirqs_net_tx:
-				stats->irqs_stx[i] = strtol(ptr, &ptr, 10);
-				break;
-			case softirqs_net_rx:
-				stats->irqs_srx[i] = strtol(ptr, &ptr, 10);
+		ifm = NLMSG_DATA(nlh);
+		attr_len = IFLA_PAYLOAD(nlh);
+
+		for (rta = IFLA_RTA(ifm); RTA_OK(rta, attr_len);
+		     rta = RTA_NEXT(rta, attr_len)) {
+			if (rta->rta_type != IFLA_STATS64 ||
+			    RTA_PAYLOAD(rta) < sizeof(struct rtnl_link_stats64))
+				continue;
+
+			stats_link64(RTA_DATA(rta), stats);
+			return 0;
+		}
+	}
+
+	return -ENOENT;
+}
+
+static int stats_proc_interrupts(struct ifstat *stats)
+{
+	int i;
+	uint32_t j;
+	long long unsigned int val, *irqs = stats->cpu[CPU_IRQS];
+	char *ptr, *line = proc_file_read(&proc_interrupts);
+
+	memset(irqs, 0, ncpus * sizeof(*irqs));
+
+	proc_cpu_columns(&proc_interrupts, line);
+
+	for (line = proc_next_line(line); line; line = proc_next_line(line)) {
+		for (j = 0; j < ndevs; ++j)
+			if (proc_line_has_name(line, devs[j].irq_name))
 				break;
-			default:
-				bug();
-			}
+		if (j == ndevs)
+			continue;
+
+		ptr = line;
+		proc_parse_u64(&ptr);
+		if (*ptr != ':')
+			continue;
+
+		for (ptr++, i = 0; i < proc_interrupts.ncols; ++i) {
+			val = proc_parse_u64(&ptr);
+			if (proc_interrupts.cols[i] >= 0)
+				irqs[proc_interrupts.cols[i]] += val;
 		}
+	}
 
-		memset(buff, 0, sizeof(buff));
+	return 0;
+}
+
+static int stats_proc_softirqs(struct ifstat *stats)
+{
+	int i;
+	long long unsigned int val, *irqs;
+	char *ptr, *line = proc_file_read(&proc_softirqs);
+
+	proc_cpu_columns(&proc_softirqs, line);
+
+	for (line = proc_next_line(line); line; line = proc_next_line(line)) {
+		ptr = line;
+		while (*ptr == ' ')
+			ptr++;
+
+		if (proc_line_starts(ptr, "NET_TX:", 7))
+			irqs = stats->cpu[CPU_IRQS_STX];
+		else if (proc_line_starts(ptr, "NET_RX:", 7))
+			irqs = stats->cpu[CPU_IRQS_SRX];
+		else
+			continue;
+
+		for (ptr += 7, i = 0; i < proc_softirqs.ncols; ++i) {
+			val = proc_parse_u64(&ptr);
+			if (proc_softirqs.cols[i] >= 0)
+				irqs[proc_softirqs.cols[i]] = val;
+		}
 	}
 
-	fclose(fp);
 	return 0;
 }
 
 static int stats_proc_memory(struct ifstat *stats)
 {
-	char *ptr, buff[256];
-	FILE *fp;
+	char *ptr, *line;
+
+	for (line = proc_file_read(&proc_meminfo); line;
+	     line = proc_next_line(line)) {
+		if (proc_line_starts(line, "MemTotal:", 9)) {
+			ptr = line + 9;
+			stats->mem_total = proc_parse_u64(&ptr);
+		} else if (proc_line_starts(line, "MemFree:", 8)) {
+			ptr = line + 8;
+			stats->mem_free = proc_parse_u64(&ptr);
+			break;
+		}
+	}
+
+	return 0;
+}
+
+static int stats_proc_system(struct ifstat *stats)
+{
+	int cpu;
+	char *ptr, *line;
 
-	fp = fopen("/proc/meminfo", "r");
-	if (!fp)
-		panic("Cannot open /proc/meminfo!\n");
+	for (line = proc_file_read(&proc_stat); line;
+	     line = proc_next_line(line)) {
+		ptr = line;
 
-	memset(buff, 0, sizeof(buff));
+		if (proc_line_starts(line, "cpu", 3)) {
+			ptr += 3;
+			if (isblank(*ptr))
+				continue;
+
+			cpu = proc_parse_u64(&ptr);
+			if (cpu >= ncpus)
+				continue;
+
+			stats->cpu[CPU_USER][cpu] = proc_parse_u64(&ptr);
+			stats->cpu[CPU_NICE][cpu] = proc_parse_u64(&ptr);
+			stats->cpu[CPU_SYS][cpu] = proc_parse_u64(&ptr);
+			stats->cpu[CPU_IDLE][cpu] = proc_parse_u64(&ptr);
+			stats->cpu[CPU_IOW][cpu] = proc_parse_u64(&ptr);
+		} else if (proc_line_starts(line, "ctxt", 4)) {
+			ptr += 4;
+			stats->cswitch = proc_parse_u64(&ptr);
+		} else if (proc_line_starts(line, "processes", 9)) {
+			ptr += 9;
+			stats->forks = proc_parse_u64(&ptr);
+		} else if (proc_line_starts(line, "procs_running", 13)) {
+			ptr += 13;
+			stats->procs_run = proc_parse_u64(&ptr);
+		} else if (proc_line_starts(line, "procs_blocked", 13)) {
+			ptr += 13;
+			stats->procs_iow = proc_parse_u64(&ptr);
+		}
+	}
+
+	return 0;
+}
+
+static int proc_interrupts_has_name(const char *name)
+{
+	char *line;
+
+	for (line = proc_file_read(&proc_interrupts); line;
+	     line = proc_next_line(line))
+		if (proc_line_has_name(line, name))
+			return 1;
+
+	return 0;
+}
+
+/* Queue IRQs are named after the device with the queue index last, as
+ * in eth0-TxRx-3 or eth0-rx-3.
+ */
+static int proc_line_queue(const char *line, const char *name)
+{
+	const char *ptr = line, *end = strchrnul(line, '\n'), *tok;
+	size_t len = strlen(name);
+
+	while ((ptr = memmem(ptr, end - ptr, name, len))) {
+		if ((ptr == line || isspace(ptr[-1]) || ptr[-1] == ',') &&
+		    ptr[len] == '-')
+			break;
+		ptr += len;
+	}
+	if (ptr == NULL)
+		return -1;
+
+	for (tok = ptr + len; tok < end && !isspace(*tok) && *tok != ','; tok++)
+		;
+	for (ptr = tok; ptr > line && isdigit(ptr[-1]); ptr--)
+		;
+	if (ptr == tok || ptr[-1] != '-')
+		return -1;
+
+	return atoi(ptr);
+}
+
+static void dev_queues_grow(struct ifdev *dev, uint32_t nq)
+{
+	uint32_t i;
 
-	while (fgets(buff, sizeof(buff), fp) != NULL) {
-		buff[sizeof(buff) - 1] = 0;
+	dev->queue_irq = xrealloc(dev->queue_irq, nq, sizeof(*dev->queue_irq));
+	for (i = dev->nqueues; i < nq; ++i)
+		dev->queue_irq[i] = -1;
 
-		if ((ptr = strstr(buff, "MemTotal:"))) {
-			ptr += strlen("MemTotal:");
-			stats->mem_total = strtol(ptr, &ptr, 10);
-		} else if ((ptr = strstr(buff, "MemFree:"))) {
-			ptr += strlen("MemFree:");
-			stats->mem_free = strtol(ptr, &ptr, 10);
+	dev->nqueues = nq;
+}
+
+static int queue_stat_parse(const char *name, uint32_t *queue, size_t *off)
+{
+	static const size_t offs[2][3] = {
+		{ offsetof(struct queuestat, rx_packets),
+		  offsetof(struct queuestat, rx_bytes),
+		  offsetof(struct queuestat, rx_drops) },
+		{ offsetof(struct queuestat, tx_packets),
+		  offsetof(struct queuestat, tx_bytes),
+		  offsetof(struct queuestat, tx_drops) },
+	};
+	int dir = -1, what = -1, found = 0;
+	const char *ptr = name;
+	size_t len;
+
+#define TOKEN(str)	(len == sizeof(str) - 1 && !strncmp(ptr, str, len))
+
+	*queue = 0;
+
+	while (*ptr) {
+		if (isdigit(*ptr)) {
+			if (found++)
+				return -EINVAL;
+			for (; isdigit(*ptr); ptr++)
+				*queue = *queue * 10 + (*ptr - '0');
+			continue;
+		}
+		if (!isalpha(*ptr)) {
+			ptr++;
+			continue;
 		}
 
-		memset(buff, 0, sizeof(buff));
+		for (len = 0; isalpha(ptr[len]); len++)
+			;
+
+		if (TOKEN("rx") && dir < 0)
+			dir = 0;
+		else if (TOKEN("tx") && dir < 0)
+			dir = 1;
+		else if (TOKEN("packets") && what < 0)
+			what = 0;
+		else if (TOKEN("bytes") && what < 0)
+			what = 1;
+		else if ((TOKEN("drops") || TOKEN("dropped") || TOKEN("drop")) &&
+			 what < 0)
+			what = 2;
+		else if (!TOKEN("queue") && !TOKEN("q"))
+			return -EINVAL;
+
+		ptr += len;
 	}
 
-	fclose(fp);
+#undef TOKEN
+
+	if (dir < 0 || what < 0 || !found || *queue >= QUEUES_MAX)
+		return -EINVAL;
+
+	*off = offs[dir][what];
 	return 0;
 }
 
-static int stats_proc_system(struct ifstat *stats)
+static void dev_queues_init(struct ifdev *dev)
 {
-	int cpu, cpus;
-	char *ptr, buff[256];
-	FILE *fp;
+	int queue_irq;
+	uint32_t i, n, queue;
+	size_t off;
+	char *line, name[ETH_GSTRING_LEN + 1];
+	struct ethtool_drvinfo drvinf;
+	struct ethtool_gstrings *strings;
 
-	fp = fopen("/proc/stat", "r");
-	if (!fp)
-		panic("Cannot open /proc/stat!\n");
+	if (ethtool_drvinf(dev->name, &drvinf) < 0 || drvinf.n_stats == 0)
+		goto irqs;
 
-	cpus = get_number_cpus();
-	bug_on(cpus > MAX_CPUS);
+	n = drvinf.n_stats;
+	strings = xzmalloc(sizeof(*strings) + n * ETH_GSTRING_LEN);
+	strings->len = n;
 
-	memset(buff, 0, sizeof(buff));
+	if (ethtool_stats_strings(dev->name, strings) < 0) {
+		xfree(strings);
+		goto irqs;
+	}
 
-	while (fgets(buff, sizeof(buff), fp) != NULL) {
-		buff[sizeof(buff) - 1] = 0;
+	dev->qmap = xmalloc(n * sizeof(*dev->qmap));
 
-		if ((ptr = strstr(buff, "cpu"))) {
-			ptr += strlen("cpu");
-			if (isblank(*ptr))
-				goto next;
-
-			cpu = strtol(ptr, &ptr, 10);
-			bug_on(cpu > cpus);
-
-			if (sscanf(ptr, "%lu%lu%lu%lu%lu",
-				   &stats->cpu_user[cpu],
-				   &stats->cpu_nice[cpu],
-				   &stats->cpu_sys[cpu],
-				   &stats->cpu_idle[cpu],
-				   &stats->cpu_iow[cpu]) != 5)
-				goto next;
-		} else if ((ptr = strstr(buff, "ctxt"))) {
-			ptr += strlen("ctxt");
-			stats->cswitch = strtoul(ptr, &ptr, 10);
-		} else if ((ptr = strstr(buff, "processes"))) {
-			ptr += strlen("processes");
-			stats->forks = strtoul(ptr, &ptr, 10);
-		} else if ((ptr = strstr(buff, "procs_running"))) {
-			ptr += strlen("procs_running");
-			stats->procs_run = strtoul(ptr, &ptr, 10);
-		} else if ((ptr = strstr(buff, "procs_blocked"))) {
-			ptr += strlen("procs_blocked");
-			stats->procs_iow = strtoul(ptr, &ptr, 10);
+	for (i = 0; i < n; ++i) {
+		memcpy(name, strings->data + i * ETH_GSTRING_LEN, ETH_GSTRING_LEN);
+		name[ETH_GSTRING_LEN] = 0;
+
+		if (queue_stat_parse(name, &queue, &off) < 0)
+			continue;
+
+		dev->qmap[dev->nqmap].stat = i;
+		dev->qmap[dev->nqmap].queue = queue;
+		dev->qmap[dev->nqmap].off = off;
+		dev->nqmap++;
+
+		if (queue >= dev->nqueues)
+			dev_queues_grow(dev, queue + 1);
+	}
+
+	xfree(strings);
+
+	if (dev->nqmap) {
+		dev->estats = xzmalloc(sizeof(*dev->estats) +
+				       n * sizeof(dev->estats->data[0]));
+		dev->estats->n_stats = n;
+	} else {
+		xfree(dev->qmap);
+		dev->qmap = NULL;
+	}
+irqs:
+	for (line = proc_file_read(&proc_interrupts); line;
+	     line = proc_next_line(line)) {
+		queue_irq = proc_line_queue(line, dev->name);
+		if (queue_irq < 0 || queue_irq >= QUEUES_MAX)
+			continue;
+
+		if (queue_irq >= dev->nqueues)
+			dev_queues_grow(dev, queue_irq + 1);
+		if (dev->queue_irq[queue_irq] < 0)
+			dev->queue_irq[queue_irq] = atoi(line);
+	}
+}
+
+static void dev_queues_destroy(struct ifdev *dev)
+{
+	if (dev->queue_irq)
+		xfree(dev->queue_irq);
+	if (dev->qmap)
+		xfree(dev->qmap);
+	if (dev->estats)
+		xfree(dev->estats);
+}
+
+static void stats_queues(struct ifdev *dev, struct queuestat *queue)
+{
+	uint32_t i;
+	const struct queue_map *qm;
+
+	if (dev->estats == NULL || ethtool_stats(dev->name, dev->estats) < 0)
+		return;
+
+	memset(queue, 0, dev->nqueues * sizeof(*queue));
+
+	for (i = 0; i < dev->nqmap; ++i) {
+		qm = &dev->qmap[i];
+		*(long long unsigned int *) ((char *) &queue[qm->queue] +
+					     qm->off) += dev->estats->data[qm->stat];
+	}
+}
+
+static void devs_add(const char *name)
+{
+	struct ifdev *dev;
+
+	if (!strncmp("lo", name, IFNAMSIZ))
+		panic("lo is not supported!\n");
+	if (device_mtu(name) == 0)
+		panic("%s is no networking device!\n", name);
+
+	devs = xrealloc(devs, ndevs + 1, sizeof(*devs));
+	dev = &devs[ndevs++];
+
+	memset(dev, 0, sizeof(*dev));
+	strlcpy(dev->name, name, sizeof(dev->name));
+	dev->ifindex = device_ifindex(name);
+}
+
+static int devs_filter(const struct dirent *ent)
+{
+	return ent->d_name[0] != '.' && strcmp(ent->d_name, "lo");
+}
+
+static void devs_parse(const char *list)
+{
+	int i, n;
+	char *names, *name, *save = NULL;
+	struct dirent **ents;
+
+	if (!strcmp(list, "all")) {
+		n = scandir("/sys/class/net", &ents, devs_filter, alphasort);
+		if (n < 0)
+			panic("Cannot list networking devices!\n");
+
+		for (i = 0; i < n; ++i) {
+			devs_add(ents[i]->d_name);
+			free(ents[i]);
 		}
-next:
+
+		free(ents);
+	} else {
+		names = xstrdup(list);
+
+		for (name = strtok_r(names, ",", &save); name;
+		     name = strtok_r(NULL, ",", &save))
+			devs_add(name);
+
+		xfree(names);
+	}
+
+	if (ndevs == 0)
+		panic("No networking device given!\n");
+}
+
+static void stats_cpu_setup(struct ifstat *stats,
+			    long long unsigned int *block, int n)
+{
+	int i;
+
+	for (i = 0; i < CPU_STATS; ++i)
+		stats->cpu[i] = block + i * n;
+}
+
+static void stats_alloc(struct ifstat *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+
+	stats->dev = xzmalloc(ndevs * sizeof(*stats->dev));
+	if (nqueues)
+		stats->queue = xzmalloc(nqueues * sizeof(*stats->queue));
+
+	stats_cpu_setup(stats, xzmalloc(CPU_STATS * ncpus *
+					sizeof(*stats->cpu[0])), ncpus);
+}
+
+static void stats_free(struct ifstat *stats)
+{
+	xfree(stats->dev);
+	if (stats->queue)
+		xfree(stats->queue);
+	xfree(stats->cpu[0]);
+}
+
+static void stats_zero(struct ifstat *stats)
+{
+	memset(stats->dev, 0, ndevs * sizeof(*stats->dev));
+	if (stats->queue)
+		memset(stats->queue, 0, nqueues * sizeof(*stats->queue));
+	memset(stats->cpu[0], 0, CPU_STATS * ncpus * sizeof(*stats->cpu[0]));
+
+	stats->mem_free = stats->mem_total = 0;
+	stats->procs_run = stats->procs_iow = 0;
+	stats->cswitch = stats->forks = 0;
+}
+
+/* NUMA node of each CPU, all CPUs are on node 0 without NUMA sysfs. */
+static void cpu_nodes_init(void)
+{
+	int node, cpu, last, n;
+	char path[128], buff[4096], *ptr;
+	FILE *fp;
+
+	cpu_node = xzmalloc(ncpus * sizeof(*cpu_node));
+
+	for (node = 0; ; ++node) {
+		slprintf(path, sizeof(path),
+			 "/sys/devices/system/node/node%d/cpulist", node);
+
+		fp = fopen(path, "r");
+		if (fp == NULL)
+			break;
+
 		memset(buff, 0, sizeof(buff));
+		if (fgets(buff, sizeof(buff), fp) == NULL)
+			buff[0] = 0;
+		fclose(fp);
+
+		/* e.g. 0-7,16-23 */
+		for (ptr = buff; isdigit(*ptr); ) {
+			cpu = last = proc_parse_u64(&ptr);
+			if (*ptr == '-') {
+				ptr++;
+				last = proc_parse_u64(&ptr);
+			}
+			for (n = cpu; n <= last && n < ncpus; ++n)
+				cpu_node[n] = node;
+			if (*ptr == ',')
+				ptr++;
+		}
 	}
 
-	fclose(fp);
-	return 0;
+	nnodes = max(node, 1);
+}
+
+static void stats_init(void)
+{
+	uint32_t i;
+	struct ifdev *dev;
+	struct ethtool_drvinfo drvinf;
+
+	ncpus = get_number_cpus();
+	if (ncpus <= 0)
+		panic("Cannot get number of CPUs!\n");
+
+	cpu_nodes_init();
+
+	stats_link_open(&link_main);
+
+	proc_file_open(&proc_interrupts);
+	proc_file_open(&proc_softirqs);
+	proc_file_open(&proc_meminfo);
+	proc_file_open(&proc_stat);
+
+	for (i = 0; i < ndevs; ++i) {
+		dev = &devs[i];
+
+		/* Some drivers register their IRQ under the driver name only. */
+		strlcpy(dev->irq_name, dev->name, sizeof(dev->irq_name));
+		if (!proc_interrupts_has_name(dev->name)) {
+			memset(&drvinf, 0, sizeof(drvinf));
+			if (ethtool_drvinf(dev->name, &drvinf) == 0 &&
+			    drvinf.driver[0])
+				strlcpy(dev->irq_name, drvinf.driver,
+					sizeof(dev->irq_name));
+		}
+
+		dev_queues_init(dev);
+
+		dev->qoff = nqueues;
+		nqueues += dev->nqueues;
+	}
+
+	stats_alloc(&stats_old);
+	stats_alloc(&stats_new);
+	stats_alloc(&stats_delta);
+}
+
+static void stats_destroy(void)
+{
+	uint32_t i;
+
+	stats_free(&stats_old);
+	stats_free(&stats_new);
+	stats_free(&stats_delta);
+
+	for (i = 0; i < ndevs; ++i)
+		dev_queues_destroy(&devs[i]);
+
+	proc_file_close(&proc_interrupts);
+	proc_file_close(&proc_softirqs);
+	proc_file_close(&proc_meminfo);
+	proc_file_close(&proc_stat);
+
+	stats_link_close(&link_main);
+
+	xfree(cpu_node);
 }
 
 static int adjust_dbm_level(int in_dbm, int dbm_val)
@@ -380,7 +1010,7 @@ static int adjust_dbm_level(int in_dbm, int dbm_val)
 	return dbm_val - 0x100;
 }
 
-static int stats_wireless(const char *ifname, struct ifstat *stats)
+static int stats_wireless(const char *ifname, struct devstat *stats)
 {
 	int ret;
 	struct iw_statistics ws;
@@ -411,57 +1041,288 @@ static int stats_wireless(const char *ifname, struct ifstat *stats)
 		DIFF1(member); \
 	} while (0)
 
+static void stats_diff_block(const long long unsigned int *restrict old,
+			     const long long unsigned int *restrict new,
+			     long long unsigned int *restrict diff, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; ++i)
+		diff[i] = new[i] - old[i];
+}
+
 static void stats_diff(struct ifstat *old, struct ifstat *new,
 		       struct ifstat *diff)
 {
-	int cpus, i;
-
-	DIFF(rx_bytes);
-	DIFF(rx_packets);
-	DIFF(rx_drops);
-	DIFF(rx_errors);
-	DIFF(rx_fifo);
-	DIFF(rx_frame);
-	DIFF(rx_multi);
-
-	DIFF(tx_bytes);
-	DIFF(tx_bytes);
-	DIFF(tx_packets);
-	DIFF(tx_drops);
-	DIFF(tx_errors);
-	DIFF(tx_fifo);
-	DIFF(tx_colls);
-	DIFF(tx_carrier);
+	int i;
+
+	for (i = 0; i < ndevs; ++i) {
+		DIFF(dev[i].rx_bytes);
+		DIFF(dev[i].rx_packets);
+		DIFF(dev[i].rx_drops);
+		DIFF(dev[i].rx_errors);
+		DIFF(dev[i].rx_fifo);
+		DIFF(dev[i].rx_frame);
+		DIFF(dev[i].rx_multi);
+
+		DIFF(dev[i].tx_bytes);
+		DIFF(dev[i].tx_packets);
+		DIFF(dev[i].tx_drops);
+		DIFF(dev[i].tx_errors);
+		DIFF(dev[i].tx_fifo);
+		DIFF(dev[i].tx_colls);
+		DIFF(dev[i].tx_carrier);
+
+		DIFF1(dev[i].wifi.signal_level);
+		DIFF1(dev[i].wifi.link_qual);
+	}
+
+	/* Drivers may reset queue counters, so don't insist on monotony. */
+	for (i = 0; i < nqueues; ++i) {
+		DIFF1(queue[i].rx_packets);
+		DIFF1(queue[i].rx_bytes);
+		DIFF1(queue[i].rx_drops);
+
+		DIFF1(queue[i].tx_packets);
+		DIFF1(queue[i].tx_bytes);
+		DIFF1(queue[i].tx_drops);
+	}
 
 	DIFF1(procs_run);
 	DIFF1(procs_iow);
 
-	DIFF1(wifi.signal_level);
-	DIFF1(wifi.link_qual);
-
 	DIFF1(cswitch);
 	DIFF1(forks);
 
-	cpus = get_number_cpus();
-	bug_on(cpus > MAX_CPUS);
+	stats_diff_block(old->cpu[0], new->cpu[0], diff->cpu[0],
+			 CPU_STATS * ncpus);
+}
+
+/* The sampler thread polls the device counters at a high rate into a
+ * single producer ring, which screen and CSV output read without ever
+ * blocking it. Over the last window seconds we derive min/avg/max/p99
+ * packet rates and count microbursts, i.e. sample periods running far
+ * above the window average that a per-interval delta averages away.
+ */
+#define SAMPLER_RATE_DEF	100
+#define SAMPLER_RATE_MAX	10000
+#define SAMPLER_WINDOW_DEF	5
+#define SAMPLER_SAMPLES_MAX	(1U << 20)	/* per window, < 128 MiB */
+#define SAMPLER_BURST_FACTOR	4
+
+struct sample {
+	uint64_t ts;
+	uint64_t rx_packets, tx_packets;
+};
+
+struct rate_stat {
+	long long unsigned int min, avg, max, p99;
+	uint32_t bursts;
+};
+
+static struct sampler {
+	struct sample *ring, *snap;
+	uint64_t *rates;
+	uint64_t head, burst_pps;
+	uint32_t mask, rate, window;
+	struct link_sock link;
+	pthread_t thread;
+	volatile sig_atomic_t stop;
+} sampler;
+
+static struct rate_stat rate_rx, rate_tx;
+
+static inline uint64_t sampler_clock_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *sampler_main(void *arg)
+{
+	uint32_t i;
+	struct devstat stats;
+	struct timespec ts;
+	struct sample *s;
+	uint64_t head = 0, now, next, period, rx, tx;
+
+	period = 1000000000ULL / sampler.rate;
+	next = sampler_clock_ns();
+
+	while (!sigint && !sampler.stop) {
+		for (i = 0, rx = tx = 0; i < ndevs; ++i) {
+			if (stats_link(&sampler.link, devs[i].ifindex, &stats) < 0)
+				break;
 
-	for (i = 0; i < cpus; ++i) {
-		DIFF(irqs[i]);
-		DIFF(irqs_srx[i]);
-		DIFF(irqs_stx[i]);
+			rx += stats.rx_packets;
+			tx += stats.tx_packets;
+		}
 
-		DIFF1(cpu_user[i]);
-		DIFF1(cpu_nice[i]);
-		DIFF1(cpu_sys[i]);
-		DIFF1(cpu_idle[i]);
-		DIFF1(cpu_iow[i]);
+		if (i == ndevs) {
+			s = &sampler.ring[head & sampler.mask];
+
+			s->ts = sampler_clock_ns();
+			s->rx_packets = rx;
+			s->tx_packets = tx;
+
+			__atomic_store_n(&sampler.head, ++head, __ATOMIC_RELEASE);
+		}
+
+		/* Don't try to catch up on periods we already missed. */
+		now = sampler_clock_ns();
+		next += period;
+		if (next < now)
+			next = now;
+
+		ts.tv_sec = next / 1000000000ULL;
+		ts.tv_nsec = next % 1000000000ULL;
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+	}
+
+	pthread_exit(NULL);
+}
+
+/* Copies out the newest samples of the window, oldest first. Whatever
+ * the sampler overwrote while we were copying is dropped from the front.
+ */
+static uint32_t sampler_snapshot(void)
+{
+	uint64_t head, again, first, lost;
+	uint32_t i, n, max = sampler.rate * sampler.window + 1;
+
+	head = __atomic_load_n(&sampler.head, __ATOMIC_ACQUIRE);
+	n = min(head, (uint64_t) max);
+	first = head - n;
+
+	for (i = 0; i < n; ++i)
+		sampler.snap[i] = sampler.ring[(first + i) & sampler.mask];
+
+	/* Slot copies must not be satisfied after head is read again */
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	again = __atomic_load_n(&sampler.head, __ATOMIC_RELAXED);
+
+	/* The writer may be busy on slot again & mask, which also holds
+	 * sample again - (mask + 1), so that one counts as lost, too.
+	 */
+	if (again - first >= sampler.mask + 1) {
+		lost = min(again - first - sampler.mask, (uint64_t) n);
+		memmove(sampler.snap, sampler.snap + lost,
+			(n - lost) * sizeof(*sampler.snap));
+		n -= lost;
+	}
+
+	return n;
+}
+
+static int cmp_rates(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void sampler_rate_stat(uint32_t n, size_t off, struct rate_stat *rs)
+{
+	uint32_t i, cnt = 0;
+	uint64_t dt, thres;
+	const struct sample *s = sampler.snap;
+
+#define SAMPLE_CNT(i)	(*(const uint64_t *) ((const char *) &s[i] + off))
+
+	memset(rs, 0, sizeof(*rs));
+	if (n < 2)
+		return;
+
+	for (i = 1; i < n; ++i) {
+		dt = s[i].ts - s[i - 1].ts;
+		if (dt == 0)
+			continue;
+
+		sampler.rates[cnt++] = (SAMPLE_CNT(i) - SAMPLE_CNT(i - 1)) *
+				       1000000000ULL / dt;
 	}
+
+	dt = s[n - 1].ts - s[0].ts;
+	if (cnt == 0 || dt == 0)
+		return;
+
+	rs->avg = (SAMPLE_CNT(n - 1) - SAMPLE_CNT(0)) * 1000000000ULL / dt;
+
+#undef SAMPLE_CNT
+
+	thres = sampler.burst_pps ? : SAMPLER_BURST_FACTOR * rs->avg;
+	if (thres > 0)
+		for (i = 0; i < cnt; ++i)
+			rs->bursts += sampler.rates[i] > thres;
+
+	qsort(sampler.rates, cnt, sizeof(*sampler.rates), cmp_rates);
+
+	rs->min = sampler.rates[0];
+	rs->max = sampler.rates[cnt - 1];
+	rs->p99 = sampler.rates[min(cnt - 1, (cnt * 99) / 100)];
 }
 
-static void stats_fetch(const char *ifname, struct ifstat *stats)
+static void sampler_summarize(void)
 {
-	if (stats_proc_net_dev(ifname, stats) < 0)
-		panic("Cannot fetch device stats!\n");
+	uint32_t n = sampler_snapshot();
+
+	sampler_rate_stat(n, offsetof(struct sample, rx_packets), &rate_rx);
+	sampler_rate_stat(n, offsetof(struct sample, tx_packets), &rate_tx);
+}
+
+static void sampler_start(uint32_t rate, uint32_t window, uint64_t burst_pps)
+{
+	uint32_t size = 1, max = rate * window + 1;
+
+	/* Twice the window, so that readers rarely race with the writer. */
+	while (size < 2 * max)
+		size <<= 1;
+
+	sampler.rate = rate;
+	sampler.window = window;
+	sampler.burst_pps = burst_pps;
+	sampler.mask = size - 1;
+	sampler.head = 0;
+	sampler.stop = 0;
+
+	sampler.ring = xzmalloc(size * sizeof(*sampler.ring));
+	sampler.snap = xmalloc(max * sizeof(*sampler.snap));
+	sampler.rates = xmalloc(max * sizeof(*sampler.rates));
+
+	stats_link_open(&sampler.link);
+
+	if (pthread_create(&sampler.thread, NULL, sampler_main, NULL))
+		panic("Cannot create sampler thread!\n");
+}
+
+static void sampler_stop(void)
+{
+	sampler.stop = 1;
+	pthread_join(sampler.thread, NULL);
+
+	stats_link_close(&sampler.link);
+
+	xfree(sampler.ring);
+	xfree(sampler.snap);
+	xfree(sampler.rates);
+}
+
+static void stats_fetch(struct ifstat *stats)
+{
+	uint32_t i;
+
+	for (i = 0; i < ndevs; ++i) {
+		if (stats_link(&link_main, devs[i].ifindex, &stats->dev[i]) < 0)
+			panic("Cannot fetch device stats for %s!\n",
+			      devs[i].name);
+
+		stats_queues(&devs[i], stats->queue + devs[i].qoff);
+		stats_wireless(devs[i].name, &stats->dev[i]);
+	}
+
 	if (stats_proc_softirqs(stats) < 0)
 		panic("Cannot fetch software interrupts!\n");
 	if (stats_proc_memory(stats) < 0)
@@ -469,22 +1330,22 @@ static void stats_fetch(const char *ifname, struct ifstat *stats)
 	if (stats_proc_system(stats) < 0)
 		panic("Cannot fetch system stats!\n");
 
-	stats_proc_interrupts((char *) ifname, stats);
-
-	stats_wireless(ifname, stats);
+	stats_proc_interrupts(stats);
 }
 
-static void stats_sample_generic(const char *ifname, uint64_t ms_interval)
+static void stats_sample_generic(uint64_t ms_interval)
 {
-	memset(&stats_old, 0, sizeof(stats_old));
-	memset(&stats_new, 0, sizeof(stats_new));
-	memset(&stats_delta, 0, sizeof(stats_delta));
+	stats_zero(&stats_old);
+	stats_zero(&stats_new);
+	stats_zero(&stats_delta);
 
-	stats_fetch(ifname, &stats_old);
+	stats_fetch(&stats_old);
 	usleep(ms_interval * 1000);
-	stats_fetch(ifname, &stats_new);
+	stats_fetch(&stats_new);
 
 	stats_diff(&stats_old, &stats_new, &stats_delta);
+
+	sampler_summarize();
 }
 
 static void screen_init(WINDOW **screen)
@@ -502,17 +1363,25 @@ static void screen_init(WINDOW **screen)
 	wrefresh((*screen));
 }
 
-static void screen_header(WINDOW *screen, const char *ifname, int *voff,
-			  uint64_t ms_interval)
+static void screen_header(WINDOW *screen, int *voff, uint64_t ms_interval)
+{
+	mvwprintw(screen, (*voff)++, 2,
+		  "Kernel net/sys statistics for %s, t=%lums, "
+		  "rates over %us at %uHz               ",
+		  devlist, ms_interval, sampler.window, sampler.rate);
+}
+
+static void screen_dev_header(WINDOW *screen, const struct ifdev *dev,
+			      int *voff)
 {
 	size_t len = 0;
 	char buff[64];
 	struct ethtool_drvinfo drvinf;
-	u32 rate = device_bitrate(ifname);
-	int link = ethtool_link(ifname);
+	u32 rate = device_bitrate(dev->name);
+	int link = ethtool_link(dev->name);
 
 	memset(&drvinf, 0, sizeof(drvinf));
-	ethtool_drvinf(ifname, &drvinf);
+	ethtool_drvinf(dev->name, &drvinf);
 
 	memset(buff, 0, sizeof(buff));
 	if (rate)
@@ -521,13 +1390,11 @@ static void screen_header(WINDOW *screen, const char *ifname, int *voff,
 		len += snprintf(buff + len, sizeof(buff) - len, " link:%s",
 				link == 0 ? "no" : "yes");
 
-	mvwprintw(screen, (*voff)++, 2,
-		  "Kernel net/sys statistics for %s (%s%s), t=%lums"
-		  "               ",
-		  ifname, drvinf.driver, buff, ms_interval);
+	mvwprintw(screen, (*voff)++, 2, "%s (%s%s)               ",
+		  dev->name, drvinf.driver, buff);
 }
 
-static void screen_net_dev_rel(WINDOW *screen, const struct ifstat *rel,
+static void screen_net_dev_rel(WINDOW *screen, const struct devstat *rel,
 			       int *voff)
 {
 	attron(A_REVERSE);
@@ -551,7 +1418,7 @@ static void screen_net_dev_rel(WINDOW *screen, const struct ifstat *rel,
 	attroff(A_REVERSE);
 }
 
-static void screen_net_dev_abs(WINDOW *screen, const struct ifstat *abs,
+static void screen_net_dev_abs(WINDOW *screen, const struct devstat *abs,
 			       int *voff)
 {
 	mvwprintw(screen, (*voff)++, 2,
@@ -571,6 +1438,24 @@ static void screen_net_dev_abs(WINDOW *screen, const struct ifstat *abs,
 		  abs->tx_packets, abs->tx_drops, abs->tx_errors);
 }
 
+static void screen_net_dev_rates(WINDOW *screen, int *voff)
+{
+	if (ndevs > 1)
+		mvwprintw(screen, (*voff)++, 2, "All devices:");
+
+	mvwprintw(screen, (*voff)++, 2,
+		  "RX: %10llu min   %10llu avg   %10llu max   %10llu p99   "
+		  "%6u bursts (pps)   ",
+		  rate_rx.min, rate_rx.avg, rate_rx.max, rate_rx.p99,
+		  rate_rx.bursts);
+
+	mvwprintw(screen, (*voff)++, 2,
+		  "TX: %10llu min   %10llu avg   %10llu max   %10llu p99   "
+		  "%6u bursts (pps)   ",
+		  rate_tx.min, rate_tx.avg, rate_tx.max, rate_tx.p99,
+		  rate_tx.bursts);
+}
+
 static void screen_sys_mem(WINDOW *screen, const struct ifstat *rel,
 			   const struct ifstat *abs, int *voff)
 {
@@ -584,58 +1469,164 @@ static void screen_sys_mem(WINDOW *screen, const struct ifstat *rel,
 		  abs->procs_run, abs->procs_iow);
 }
 
-static void screen_percpu_states(WINDOW *screen, const struct ifstat *rel,
-				 int cpus, int *voff)
+/* Everything below the system line scrolls, since with many CPUs and
+ * queues it easily gets longer than the terminal.
+ */
+static int scroll_off = 0, scroll_line, scroll_rows;
+static int view_numa = 0;
+
+static void screen_scroll_printw(WINDOW *screen, int *voff, const char *fmt, ...)
+{
+	va_list vl;
+
+	if (scroll_line++ < scroll_off || *voff >= getmaxy(screen))
+		return;
+
+	va_start(vl, fmt);
+	wmove(screen, (*voff)++, 2);
+	vw_printw(screen, fmt, vl);
+	va_end(vl);
+}
+
+struct cpu_view {
+	const char *label;
+	int n;
+	long long unsigned int *cpu[CPU_STATS];
+};
+
+static struct cpu_view view_rel, view_abs;
+
+static void cpu_view_init(struct cpu_view *view)
+{
+	int i;
+
+	for (i = 0; i < CPU_STATS; ++i)
+		view->cpu[i] = xzmalloc(max(ncpus, nnodes) *
+					sizeof(*view->cpu[i]));
+}
+
+static void cpu_view_destroy(struct cpu_view *view)
+{
+	int i;
+
+	for (i = 0; i < CPU_STATS; ++i)
+		xfree(view->cpu[i]);
+}
+
+static void cpu_view_fill(struct cpu_view *view, const struct ifstat *stats)
+{
+	int i, cpu;
+
+	if (!view_numa) {
+		view->label = "CPU";
+		view->n = ncpus;
+
+		for (i = 0; i < CPU_STATS; ++i)
+			memcpy(view->cpu[i], stats->cpu[i],
+			       ncpus * sizeof(*view->cpu[i]));
+		return;
+	}
+
+	view->label = "Node";
+	view->n = nnodes;
+
+	for (i = 0; i < CPU_STATS; ++i) {
+		memset(view->cpu[i], 0, nnodes * sizeof(*view->cpu[i]));
+		for (cpu = 0; cpu < ncpus; ++cpu)
+			view->cpu[i][cpu_node[cpu]] += stats->cpu[i][cpu];
+	}
+}
+
+static void screen_percpu_states(WINDOW *screen, const struct cpu_view *rel,
+				 int *voff)
 {
 	int i;
 	uint64_t all;
 
-	for (i = 0; i < cpus; ++i) {
-		all = rel->cpu_user[i] + rel->cpu_nice[i] + rel->cpu_sys[i] +
-		      rel->cpu_idle[i] + rel->cpu_iow[i];
+	for (i = 0; i < rel->n; ++i) {
+		all = rel->cpu[CPU_USER][i] + rel->cpu[CPU_NICE][i] +
+		      rel->cpu[CPU_SYS][i] + rel->cpu[CPU_IDLE][i] +
+		      rel->cpu[CPU_IOW][i];
+		if (all == 0)
+			all = 1;
 
-		mvwprintw(screen, (*voff)++, 2,
-			  "CPU%d: %13.1lf%% usr/t "
+		screen_scroll_printw(screen, voff,
+			  "%s%d: %13.1lf%% usr/t "
 				 "%9.1lf%% sys/t "
 				 "%10.1lf%% idl/t "
-				 "%11.1lf%% iow/t  ", i,
-			  100.0 * (rel->cpu_user[i] + rel->cpu_nice[i]) / all,
-			  100.0 * rel->cpu_sys[i] / all,
-			  100.0 * rel->cpu_idle[i] / all,
-			  100.0 * rel->cpu_iow[i] / all);
+				 "%11.1lf%% iow/t  ", rel->label, i,
+			  100.0 * (rel->cpu[CPU_USER][i] + rel->cpu[CPU_NICE][i]) / all,
+			  100.0 * rel->cpu[CPU_SYS][i] / all,
+			  100.0 * rel->cpu[CPU_IDLE][i] / all,
+			  100.0 * rel->cpu[CPU_IOW][i] / all);
 	}
 }
 
-static void screen_percpu_irqs_rel(WINDOW *screen, const struct ifstat *rel,
-				   int cpus, int *voff)
+static void screen_percpu_irqs_rel(WINDOW *screen, const struct cpu_view *rel,
+				   int *voff)
 {
 	int i;
 
-	for (i = 0; i < cpus; ++i) {
-		mvwprintw(screen, (*voff)++, 2,
-			  "CPU%d: %14llu irqs/t   "
+	for (i = 0; i < rel->n; ++i) {
+		screen_scroll_printw(screen, voff,
+			  "%s%d: %14llu irqs/t   "
 				 "%15llu soirq RX/t   "
-				 "%15llu soirq TX/t      ", i,
-			  rel->irqs[i],
-			  rel->irqs_srx[i],
-			  rel->irqs_stx[i]);
+				 "%15llu soirq TX/t      ", rel->label, i,
+			  rel->cpu[CPU_IRQS][i],
+			  rel->cpu[CPU_IRQS_SRX][i],
+			  rel->cpu[CPU_IRQS_STX][i]);
 	}
 }
 
-static void screen_percpu_irqs_abs(WINDOW *screen, const struct ifstat *abs,
-				   int cpus, int *voff)
+static void screen_percpu_irqs_abs(WINDOW *screen, const struct cpu_view *abs,
+				   int *voff)
 {
 	int i;
 
-	for (i = 0; i < cpus; ++i) {
-		mvwprintw(screen, (*voff)++, 2,
-			  "CPU%d: %14llu irqs", i,
-			  abs->irqs[i]);
+	for (i = 0; i < abs->n; ++i) {
+		screen_scroll_printw(screen, voff,
+			  "%s%d: %14llu irqs", abs->label, i,
+			  abs->cpu[CPU_IRQS][i]);
+	}
+}
+
+static void screen_queues(WINDOW *screen, const struct ifstat *rel, int *voff)
+{
+	uint32_t i, q;
+	char irq[16], cpus[64];
+	const struct ifdev *dev;
+	const struct queuestat *qs;
+
+	for (i = 0; i < ndevs; ++i) {
+		dev = &devs[i];
+
+		for (q = 0; q < dev->nqueues; ++q) {
+			qs = &rel->queue[dev->qoff + q];
+
+			strlcpy(irq, "-", sizeof(irq));
+			strlcpy(cpus, "-", sizeof(cpus));
+			if (dev->queue_irq[q] >= 0) {
+				slprintf(irq, sizeof(irq), "%d", dev->queue_irq[q]);
+				device_get_irq_affinity_list(dev->queue_irq[q],
+							     cpus, sizeof(cpus));
+			}
+
+			screen_scroll_printw(screen, voff,
+				  "%s/%u: RX %10llu pkts/t %10.3lf MiB/t "
+				  "%8llu drops/t   TX %10llu pkts/t "
+				  "%10.3lf MiB/t %8llu drops/t   "
+				  "IRQ %s on CPU %s        ",
+				  dev->name, q,
+				  qs->rx_packets, (double) qs->rx_bytes / (1 << 20),
+				  qs->rx_drops,
+				  qs->tx_packets, (double) qs->tx_bytes / (1 << 20),
+				  qs->tx_drops, irq, cpus);
+		}
 	}
 }
 
-static void screen_wireless(WINDOW *screen, const struct ifstat *rel,
-			    const struct ifstat *abs, int *voff)
+static void screen_wireless(WINDOW *screen, const struct devstat *rel,
+			    const struct devstat *abs, int *voff)
 {
 	if (iswireless(abs)) {
 		mvwprintw(screen, (*voff)++, 2,
@@ -651,38 +1642,52 @@ static void screen_wireless(WINDOW *screen, const struct ifstat *rel,
 	}
 }
 
-static void screen_update(WINDOW *screen, const char *ifname, const struct ifstat *rel,
+static void screen_update(WINDOW *screen, const struct ifstat *rel,
 			  const struct ifstat *abs, int *first, uint64_t ms_interval)
 {
-	int cpus, voff = 1, cvoff = 2;
+	int voff = 1, cvoff = 2;
+	uint32_t i;
 
 	curs_set(0);
+	werase(screen);
 
-	cpus = get_number_cpus();
-	bug_on(cpus > MAX_CPUS);
+	screen_header(screen, &voff, ms_interval);
 
-	screen_header(screen, ifname, &voff, ms_interval);
+	for (i = 0; i < ndevs; ++i) {
+		voff++;
+		screen_dev_header(screen, &devs[i], &voff);
+		screen_net_dev_rel(screen, &rel->dev[i], &voff);
 
-	voff++;
-	screen_net_dev_rel(screen, rel, &voff);
+		voff++;
+		screen_net_dev_abs(screen, &abs->dev[i], &voff);
+		screen_wireless(screen, &rel->dev[i], &abs->dev[i], &voff);
+	}
 
 	voff++;
-	screen_net_dev_abs(screen, abs, &voff);
+	screen_net_dev_rates(screen, &voff);
 
 	voff++;
 	screen_sys_mem(screen, rel, abs, &voff);
 
 	voff++;
-	screen_percpu_states(screen, rel, cpus, &voff);
+	scroll_line = 0;
+	scroll_rows = max(getmaxy(screen) - voff, 1);
 
-	voff++;
-	screen_percpu_irqs_rel(screen, rel, cpus, &voff);
+	cpu_view_fill(&view_rel, rel);
+	cpu_view_fill(&view_abs, abs);
 
-	voff++;
-	screen_percpu_irqs_abs(screen, abs, cpus, &voff);
+	screen_percpu_states(screen, &view_rel, &voff);
 
-	voff++;
-	screen_wireless(screen, rel, abs, &voff);
+	screen_scroll_printw(screen, &voff, "");
+	screen_percpu_irqs_rel(screen, &view_rel, &voff);
+
+	screen_scroll_printw(screen, &voff, "");
+	screen_percpu_irqs_abs(screen, &view_abs, &voff);
+
+	if (nqueues) {
+		screen_scroll_printw(screen, &voff, "");
+		screen_queues(screen, rel, &voff);
+	}
 
 	if (*first) {
 		mvwprintw(screen, cvoff, 2, "Collecting data ...");
@@ -700,124 +1705,227 @@ static void screen_end(void)
 	endwin();
 }
 
-static int screen_main(const char *ifname, uint64_t ms_interval)
+static int screen_key(int key)
+{
+	int last = max(scroll_line - scroll_rows, 0);
+
+	switch (key) {
+	case 'q':
+	case 0x1b:
+	case KEY_F(10):
+		return -1;
+	case KEY_UP:
+	case 'k':
+		scroll_off--;
+		break;
+	case KEY_DOWN:
+	case 'j':
+		scroll_off++;
+		break;
+	case KEY_PPAGE:
+		scroll_off -= scroll_rows;
+		break;
+	case KEY_NPAGE:
+	case ' ':
+		scroll_off += scroll_rows;
+		break;
+	case KEY_HOME:
+	case 'g':
+		scroll_off = 0;
+		break;
+	case KEY_END:
+	case 'G':
+		scroll_off = last;
+		break;
+	case 'n':
+		view_numa = !view_numa;
+		scroll_off = 0;
+		break;
+	default:
+		return 0;
+	}
+
+	scroll_off = max(min(scroll_off, last), 0);
+	return 1;
+}
+
+/* Sleeps out the sampling interval, but redraws right away on keys. */
+static int screen_wait(uint64_t ms_interval, int *first)
+{
+	int key, ret, redraw;
+	struct pollfd pfd = { .fd = 0, .events = POLLIN };
+	uint64_t now, end = sampler_clock_ns() + ms_interval * 1000000ULL;
+
+	while (!sigint && (now = sampler_clock_ns()) < end) {
+		poll(&pfd, 1, (end - now + 999999) / 1000000);
+
+		for (redraw = 0; (key = getch()) != ERR; redraw |= ret) {
+			ret = screen_key(key);
+			if (ret < 0)
+				return -1;
+		}
+
+		if (redraw)
+			screen_update(stats_screen, &stats_delta, &stats_new,
+				      first, ms_interval);
+	}
+
+	return 0;
+}
+
+static int screen_main(uint64_t ms_interval)
 {
-	int first = 1, key;
+	int first = 1;
+
+	cpu_view_init(&view_rel);
+	cpu_view_init(&view_abs);
 
 	screen_init(&stats_screen);
 
 	while (!sigint) {
-		key = getch();
-		if (key == 'q' || key == 0x1b || key == KEY_F(10))
+		screen_update(stats_screen, &stats_delta, &stats_new,
+			      &first, ms_interval);
+
+		stats_zero(&stats_old);
+		stats_fetch(&stats_old);
+
+		if (screen_wait(ms_interval, &first) < 0)
 			break;
 
-		screen_update(stats_screen, ifname, &stats_delta, &stats_new,
-			      &first, ms_interval);
+		stats_zero(&stats_new);
+		stats_fetch(&stats_new);
 
-		stats_sample_generic(ifname, ms_interval);
+		stats_diff(&stats_old, &stats_new, &stats_delta);
+		sampler_summarize();
 	}
 
 	screen_end();
 
+	cpu_view_destroy(&view_rel);
+	cpu_view_destroy(&view_abs);
+
 	return 0;
 }
 
-static void term_csv(const char *ifname, const struct ifstat *rel,
-		     const struct ifstat *abs, uint64_t ms_interval)
+static void term_csv(const struct ifstat *rel, const struct ifstat *abs,
+		     uint64_t ms_interval)
 {
-	int cpus, i;
+	int i;
+	uint32_t d;
 
 	printf("%ld ", time(0));
 
-	printf("%llu ", rel->rx_bytes);
-	printf("%llu ", rel->rx_packets);
-	printf("%llu ", rel->rx_drops);
-	printf("%llu ", rel->rx_errors);
-
-	printf("%llu ", abs->rx_bytes);
-	printf("%llu ", abs->rx_packets);
-	printf("%llu ", abs->rx_drops);
-	printf("%llu ", abs->rx_errors);
-
-	printf("%llu ", rel->tx_bytes);
-	printf("%llu ", rel->tx_packets);
-	printf("%llu ", rel->tx_drops);
-	printf("%llu ", rel->tx_errors);
-
-	printf("%llu ", abs->tx_bytes);
-	printf("%llu ", abs->tx_packets);
-	printf("%llu ", abs->tx_drops);
-	printf("%llu ", abs->tx_errors);
+	for (d = 0; d < ndevs; ++d) {
+		printf("%llu ", rel->dev[d].rx_bytes);
+		printf("%llu ", rel->dev[d].rx_packets);
+		printf("%llu ", rel->dev[d].rx_drops);
+		printf("%llu ", rel->dev[d].rx_errors);
+
+		printf("%llu ", abs->dev[d].rx_bytes);
+		printf("%llu ", abs->dev[d].rx_packets);
+		printf("%llu ", abs->dev[d].rx_drops);
+		printf("%llu ", abs->dev[d].rx_errors);
+
+		printf("%llu ", rel->dev[d].tx_bytes);
+		printf("%llu ", rel->dev[d].tx_packets);
+		printf("%llu ", rel->dev[d].tx_drops);
+		printf("%llu ", rel->dev[d].tx_errors);
+
+		printf("%llu ", abs->dev[d].tx_bytes);
+		printf("%llu ", abs->dev[d].tx_packets);
+		printf("%llu ", abs->dev[d].tx_drops);
+		printf("%llu ", abs->dev[d].tx_errors);
+	}
 
 	printf("%u ",  rel->cswitch);
-	printf("%lu ", abs->mem_free);
-	printf("%lu ", abs->mem_total - abs->mem_free);
-	printf("%lu ", abs->mem_total);
+	printf("%llu ", abs->mem_free);
+	printf("%llu ", abs->mem_total - abs->mem_free);
+	printf("%llu ", abs->mem_total);
 	printf("%u ",  abs->procs_run);
 	printf("%u ",  abs->procs_iow);
 
-	cpus = get_number_cpus();
-	bug_on(cpus > MAX_CPUS);
-
-	for (i = 0; i < cpus; ++i) {
-		printf("%lu ", rel->cpu_user[i]);
-		printf("%lu ", rel->cpu_nice[i]);
-		printf("%lu ", rel->cpu_sys[i]);
-		printf("%lu ", rel->cpu_idle[i]);
-		printf("%lu ", rel->cpu_iow[i]);
+	for (i = 0; i < ncpus; ++i) {
+		printf("%llu ", rel->cpu[CPU_USER][i]);
+		printf("%llu ", rel->cpu[CPU_NICE][i]);
+		printf("%llu ", rel->cpu[CPU_SYS][i]);
+		printf("%llu ", rel->cpu[CPU_IDLE][i]);
+		printf("%llu ", rel->cpu[CPU_IOW][i]);
 
-		printf("%llu ", rel->irqs[i]);
-		printf("%llu ", abs->irqs[i]);
+		printf("%llu ", rel->cpu[CPU_IRQS][i]);
+		printf("%llu ", abs->cpu[CPU_IRQS][i]);
 
-		printf("%llu ", rel->irqs_srx[i]);
-		printf("%llu ", abs->irqs_srx[i]);
+		printf("%llu ", rel->cpu[CPU_IRQS_SRX][i]);
+		printf("%llu ", abs->cpu[CPU_IRQS_SRX][i]);
 
-		printf("%llu ", rel->irqs_stx[i]);
-		printf("%llu ", abs->irqs_stx[i]);
+		printf("%llu ", rel->cpu[CPU_IRQS_STX][i]);
+		printf("%llu ", abs->cpu[CPU_IRQS_STX][i]);
 	}
 
-	if (iswireless(abs)) {
-		printf("%u ", rel->wifi.link_qual);
-		printf("%u ", abs->wifi.link_qual);
-		printf("%u ", abs->wifi.link_qual_max);
+	for (d = 0; d < ndevs; ++d) {
+		if (!iswireless(&abs->dev[d]))
+			continue;
+
+		printf("%u ", rel->dev[d].wifi.link_qual);
+		printf("%u ", abs->dev[d].wifi.link_qual);
+		printf("%u ", abs->dev[d].wifi.link_qual_max);
 
-		printf("%d ", rel->wifi.signal_level);
-		printf("%d ", abs->wifi.signal_level);
+		printf("%d ", rel->dev[d].wifi.signal_level);
+		printf("%d ", abs->dev[d].wifi.signal_level);
 	}
 
+	printf("%llu ", rate_rx.min);
+	printf("%llu ", rate_rx.avg);
+	printf("%llu ", rate_rx.max);
+	printf("%llu ", rate_rx.p99);
+	printf("%u ",  rate_rx.bursts);
+
+	printf("%llu ", rate_tx.min);
+	printf("%llu ", rate_tx.avg);
+	printf("%llu ", rate_tx.max);
+	printf("%llu ", rate_tx.p99);
+	printf("%u ",  rate_tx.bursts);
+
 	puts("");
 	fflush(stdout);
 }
 
-static void term_csv_header(const char *ifname, const struct ifstat *abs,
-			    uint64_t ms_interval)
+static void term_csv_header(const struct ifstat *abs, uint64_t ms_interval)
 {
-	int cpus, i, j = 1;
+	int i, j = 1;
+	uint32_t d;
+	char pfx[IFNAMSIZ + 1];
 
 	printf("# gnuplot dump (#col:description)\n");
-	printf("# networking interface: %s\n", ifname);
+	printf("# networking interface: %s\n", devlist);
 	printf("# sampling interval (t): %lu ms\n", ms_interval);
+	printf("# rate window: %u s at %u Hz\n", sampler.window, sampler.rate);
 	printf("# %d:unixtime ", j++);
 
-	printf("%d:rx-bytes-per-t ", j++);
-	printf("%d:rx-pkts-per-t ", j++);
-	printf("%d:rx-drops-per-t ", j++);
-	printf("%d:rx-errors-per-t ", j++);
-
-	printf("%d:rx-bytes ", j++);
-	printf("%d:rx-pkts ", j++);
-	printf("%d:rx-drops ", j++);
-	printf("%d:rx-errors ", j++);
-
-	printf("%d:tx-bytes-per-t ", j++);
-	printf("%d:tx-pkts-per-t ", j++);
-	printf("%d:tx-drops-per-t ", j++);
-	printf("%d:tx-errors-per-t ", j++);
-
-	printf("%d:tx-bytes ", j++);
-	printf("%d:tx-pkts ", j++);
-	printf("%d:tx-drops ", j++);
-	printf("%d:tx-errors ", j++);
+	/* Only prefix device columns if there is more than one device. */
+	for (d = 0, pfx[0] = 0; d < ndevs; ++d) {
+		if (ndevs > 1)
+			slprintf(pfx, sizeof(pfx), "%s-", devs[d].name);
+
+		printf("%d:%srx-bytes-per-t ", j++, pfx);
+		printf("%d:%srx-pkts-per-t ", j++, pfx);
+		printf("%d:%srx-drops-per-t ", j++, pfx);
+		printf("%d:%srx-errors-per-t ", j++, pfx);
+
+		printf("%d:%srx-bytes ", j++, pfx);
+		printf("%d:%srx-pkts ", j++, pfx);
+		printf("%d:%srx-drops ", j++, pfx);
+		printf("%d:%srx-errors ", j++, pfx);
+
+		printf("%d:%stx-bytes-per-t ", j++, pfx);
+		printf("%d:%stx-pkts-per-t ", j++, pfx);
+		printf("%d:%stx-drops-per-t ", j++, pfx);
+		printf("%d:%stx-errors-per-t ", j++, pfx);
+
+		printf("%d:%stx-bytes ", j++, pfx);
+		printf("%d:%stx-pkts ", j++, pfx);
+		printf("%d:%stx-drops ", j++, pfx);
+		printf("%d:%stx-errors ", j++, pfx);
+	}
 
 	printf("%d:context-switches-per-t ", j++);
 	printf("%d:mem-free ", j++);
@@ -826,10 +1934,7 @@ static void term_csv_header(const char *ifname, const struct ifstat *abs,
 	printf("%d:procs-in-run ", j++);
 	printf("%d:procs-in-iow ", j++);
 
-	cpus = get_number_cpus();
-	bug_on(cpus > MAX_CPUS);
-
-	for (i = 0, j = 22; i < cpus; ++i) {
+	for (i = 0; i < ncpus; ++i) {
 		printf("%d:cpu%i-usr-per-t ", j++, i);
 		printf("%d:cpu%i-nice-per-t ", j++, i);
 		printf("%d:cpu%i-sys-per-t ", j++, i);
@@ -845,33 +1950,50 @@ static void term_csv_header(const char *ifname, const struct ifstat *abs,
 		printf("%d:cpu%i-net-tx-soft-irqs ", j++, i);
 	}
 
-	if (iswireless(abs)) {
-		printf("%d:wifi-link-qual-per-t ", j++);
-		printf("%d:wifi-link-qual ", j++);
-		printf("%d:wifi-link-qual-max ", j++);
+	for (d = 0; d < ndevs; ++d) {
+		if (!iswireless(&abs->dev[d]))
+			continue;
+		if (ndevs > 1)
+			slprintf(pfx, sizeof(pfx), "%s-", devs[d].name);
 
-		printf("%d:wifi-signal-dbm-per-t ", j++);
-		printf("%d:wifi-signal-dbm ", j++);
+		printf("%d:%swifi-link-qual-per-t ", j++, pfx);
+		printf("%d:%swifi-link-qual ", j++, pfx);
+		printf("%d:%swifi-link-qual-max ", j++, pfx);
+
+		printf("%d:%swifi-signal-dbm-per-t ", j++, pfx);
+		printf("%d:%swifi-signal-dbm ", j++, pfx);
 	}
 
+	printf("%d:rx-pps-min ", j++);
+	printf("%d:rx-pps-avg ", j++);
+	printf("%d:rx-pps-max ", j++);
+	printf("%d:rx-pps-p99 ", j++);
+	printf("%d:rx-bursts ", j++);
+
+	printf("%d:tx-pps-min ", j++);
+	printf("%d:tx-pps-avg ", j++);
+	printf("%d:tx-pps-max ", j++);
+	printf("%d:tx-pps-p99 ", j++);
+	printf("%d:tx-bursts ", j++);
+
 	puts("");
 	printf("# data:\n");
 	fflush(stdout);
 }
 
-static int term_main(const char *ifname, uint64_t ms_interval)
+static int term_main(uint64_t ms_interval)
 {
 	int first = 1;
 
 	do {
-		stats_sample_generic(ifname, ms_interval);
+		stats_sample_generic(ms_interval);
 
 		if (first) {
 			first = 0;
-			term_csv_header(ifname, &stats_new, ms_interval);
+			term_csv_header(&stats_new, ms_interval);
 		}
 
-		term_csv(ifname, &stats_delta, &stats_new, ms_interval);
+		term_csv(&stats_delta, &stats_new, ms_interval);
 	} while (stats_loop && !sigint);
 
 	return 0;
@@ -879,11 +2001,11 @@ static int term_main(const char *ifname, uint64_t ms_interval)
 
 int main(int argc, char **argv)
 {
-	short ifflags = 0;
 	int c, opt_index, ret, promisc = 0;
-	uint64_t interval = 1000;
-	char *ifname = NULL;
-	int (*func_main)(const char *ifname, uint64_t ms_interval) = screen_main;
+	uint32_t i;
+	uint64_t interval = 1000, burst = 0;
+	unsigned long rate = SAMPLER_RATE_DEF, window = SAMPLER_WINDOW_DEF;
+	int (*func_main)(uint64_t ms_interval) = screen_main;
 
 	setfsuid(getuid());
 	setfsgid(getgid());
@@ -898,11 +2020,27 @@ int main(int argc, char **argv)
 			version();
 			break;
 		case 'd':
-			ifname = xstrndup(optarg, IFNAMSIZ);
+			if (devlist)
+				xfree(devlist);
+			devlist = xstrdup(optarg);
 			break;
 		case 't':
 			interval = strtol(optarg, NULL, 10);
 			break;
+		case 'r':
+			rate = strtoul(optarg, NULL, 10);
+			if (rate == 0 || rate > SAMPLER_RATE_MAX)
+				panic("Sampling rate must be within 1..%u Hz!\n",
+				      SAMPLER_RATE_MAX);
+			break;
+		case 'w':
+			window = strtoul(optarg, NULL, 10);
+			if (window == 0)
+				panic("Window must be at least 1 s!\n");
+			break;
+		case 'b':
+			burst = strtoull(optarg, NULL, 10);
+			break;
 		case 'l':
 			stats_loop = 1;
 			break;
@@ -916,6 +2054,9 @@ int main(int argc, char **argv)
 			switch (optopt) {
 			case 'd':
 			case 't':
+			case 'r':
+			case 'w':
+			case 'b':
 				panic("Option -%c requires an argument!\n",
 				      optopt);
 			default:
@@ -932,24 +2073,35 @@ int main(int argc, char **argv)
 		help();
 
 	if (argc == 2)
-		ifname = xstrndup(argv[1], IFNAMSIZ);
-	if (ifname == NULL)
+		devlist = xstrdup(argv[1]);
+	if (devlist == NULL)
 		panic("No networking device given!\n");
 
-	if (!strncmp("lo", ifname, IFNAMSIZ))
-		panic("lo is not supported!\n");
-	if (device_mtu(ifname) == 0)
-		panic("This is no networking device!\n");
+	if (window > SAMPLER_SAMPLES_MAX / rate)
+		panic("A %lu s window at %lu Hz is too large, at most %u "
+		      "samples per window are supported!\n", window, rate,
+		      SAMPLER_SAMPLES_MAX);
+
+	devs_parse(devlist);
 
 	register_signal(SIGINT, signal_handler);
 	register_signal(SIGHUP, signal_handler);
 
+	stats_init();
+	sampler_start(rate, window, burst);
+
 	if (promisc)
-		ifflags = enter_promiscuous_mode(ifname);
-	ret = func_main(ifname, interval);
+		for (i = 0; i < ndevs; ++i)
+			devs[i].ifflags = enter_promiscuous_mode(devs[i].name);
+	ret = func_main(interval);
 	if (promisc)
-		leave_promiscuous_mode(ifname, ifflags);
+		for (i = 0; i < ndevs; ++i)
+			leave_promiscuous_mode(devs[i].name, devs[i].ifflags);
+
+	sampler_stop();
+	stats_destroy();
 
-	xfree(ifname);
+	xfree(devs);
+	xfree(devlist);
 	return ret;
 }
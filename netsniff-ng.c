@@ -46,6 +46,7 @@
 #include "tprintf.h"
 #include "dissector.h"
 #include "xmalloc.h"
+#include "trafgen_probe.h"
 
 enum dump_mode {
 	DUMP_INTERVAL_TIME,
@@ -57,6 +58,7 @@ struct ctx {
 	int cpu, rfraw, dump, print_mode, dump_dir, packet_type, verbose;
 	unsigned long kpull, dump_interval, reserve_size, tx_bytes, tx_packets;
 	bool randomize, promiscuous, enforce, jumbo, dump_bpf;
+	long probe;
 	enum pcap_ops_groups pcap; enum dump_mode dump_mode;
 	uid_t uid; gid_t gid; uint32_t link_type, magic;
 };
@@ -65,7 +67,7 @@ volatile sig_atomic_t sigint = 0;
 
 static volatile bool next_dump = false;
 
-static const char *short_options = "d:i:o:rf:MJt:S:k:n:b:HQmcsqXlvhF:RGAP:Vu:g:T:DB";
+static const char *short_options = "d:i:o:rf:MJt:S:k:n:b:HQmcsqXlvhF:RGAP:Vu:g:T:DBO:";
 static const struct option long_options[] = {
 	{"dev",			required_argument,	NULL, 'd'},
 	{"in",			required_argument,	NULL, 'i'},
@@ -81,6 +83,7 @@ static const struct option long_options[] = {
 	{"user",		required_argument,	NULL, 'u'},
 	{"group",		required_argument,	NULL, 'g'},
 	{"magic",		required_argument,	NULL, 'T'},
+	{"probe",		required_argument,	NULL, 'O'},
 	{"rand",		no_argument,		NULL, 'r'},
 	{"rfraw",		no_argument,		NULL, 'R'},
 	{"mmap",		no_argument,		NULL, 'm'},
@@ -785,6 +788,108 @@ static void print_pcap_file_stats(int sock, struct ctx *ctx, unsigned long skipp
 	}
 }
 
+#define PROBE_STREAMS	1024
+#define PROBE_BUCKETS	48
+
+/*
+ * Receive side of trafgen --probe: one-way latency in log2 ns buckets and
+ * sizes of sequence gaps per trafgen CPU, in log2 packet buckets.
+ */
+struct probe_rx {
+	uint64_t next_seq[PROBE_STREAMS];
+	bool seen[PROBE_STREAMS];
+	unsigned long long rcvd, lost, late, neg, invalid;
+	unsigned long long lat[PROBE_BUCKETS], gaps[PROBE_BUCKETS];
+	uint64_t lat_min, lat_max;
+	long double lat_sum;
+};
+
+static inline unsigned int probe_bucket(uint64_t val)
+{
+	unsigned int b = val ? 64 - __builtin_clzll(val) : 0;
+
+	return min(b, PROBE_BUCKETS - 1);
+}
+
+static void probe_account(struct probe_rx *rx, long off, uint8_t *packet,
+			  size_t len, uint64_t rx_ns)
+{
+	struct probe_hdr probe;
+	uint64_t lat;
+
+	if (!probe_parse(packet, len, off, &probe))
+		return;
+	if (probe.stream >= PROBE_STREAMS) {
+		rx->invalid++;
+		return;
+	}
+
+	rx->rcvd++;
+
+	if (!rx->seen[probe.stream]) {
+		rx->seen[probe.stream] = true;
+	} else if (probe.seq > rx->next_seq[probe.stream]) {
+		uint64_t gap = probe.seq - rx->next_seq[probe.stream];
+
+		rx->lost += gap;
+		rx->gaps[probe_bucket(gap)]++;
+	} else if (probe.seq < rx->next_seq[probe.stream]) {
+		/* Reordered, accounted as lost before */
+		rx->late++;
+		if (rx->lost > 0)
+			rx->lost--;
+	}
+
+	if (probe.seq >= rx->next_seq[probe.stream])
+		rx->next_seq[probe.stream] = probe.seq + 1;
+
+	if (unlikely(rx_ns < probe.tx_ns)) {
+		rx->neg++;
+		return;
+	}
+
+	lat = rx_ns - probe.tx_ns;
+
+	rx->lat[probe_bucket(lat)]++;
+	rx->lat_sum += lat;
+	if (rx->rcvd - rx->neg == 1 || lat < rx->lat_min)
+		rx->lat_min = lat;
+	if (lat > rx->lat_max)
+		rx->lat_max = lat;
+}
+
+static void probe_print(struct probe_rx *rx)
+{
+	int i;
+	unsigned long long valid = rx->rcvd - rx->neg;
+
+	printf("\r%12llu probes received, %llu lost, %llu late, %llu invalid\n",
+	       rx->rcvd, rx->lost, rx->late, rx->invalid);
+
+	if (rx->neg)
+		printf("\r%12llu probes from the future, clocks not in sync?\n",
+		       rx->neg);
+	if (valid == 0)
+		return;
+
+	printf("\r%12.3f us latency min, %.3f us avg, %.3f us max\n",
+	       rx->lat_min / 1e3, (double) (rx->lat_sum / valid) / 1e3,
+	       rx->lat_max / 1e3);
+
+	printf("Latency:\n");
+	for (i = 0; i < PROBE_BUCKETS; ++i) {
+		if (rx->lat[i])
+			printf("  < %14.3f us: %llu\n",
+			       (1ULL << i) / 1e3, rx->lat[i]);
+	}
+
+	printf("Lost in a row:\n");
+	for (i = 0; i < PROBE_BUCKETS; ++i) {
+		if (rx->gaps[i])
+			printf("  < %14llu: %llu\n", 1ULL << i, rx->gaps[i]);
+	}
+}
+
 static void recv_only_or_dump(struct ctx *ctx)
 {
 	uint8_t *packet;
@@ -798,6 +903,7 @@ static void recv_only_or_dump(struct ctx *ctx)
 	struct sock_fprog bpf_ops;
 	struct timeval start, end, diff;
 	pcap_pkthdr_t phdr;
+	struct probe_rx *probe_rx = NULL;
 
 	if (!device_up_and_running(ctx->device_in) && !ctx->rfraw)
 		panic("Device not up and running!\n");
@@ -872,6 +978,9 @@ static void recv_only_or_dump(struct ctx *ctx)
 		}
 	}
 
+	if (ctx->probe >= 0)
+		probe_rx = xzmalloc(sizeof(*probe_rx));
+
 	printf("Running! Hang up with ^C!\n\n");
 	fflush(stdout);
 
@@ -903,6 +1012,12 @@ static void recv_only_or_dump(struct ctx *ctx)
 					panic("Write error to pcap!\n");
 			}
 
+			if (probe_rx)
+				probe_account(probe_rx, ctx->probe, packet,
+					      hdr->tp_h.tp_snaplen,
+					      hdr->tp_h.tp_sec * 1000000000ULL +
+					      hdr->tp_h.tp_nsec);
+
 			show_frame_hdr(hdr, ctx->print_mode);
 
 			dissector_entry_point(packet, hdr->tp_h.tp_snaplen,
@@ -962,6 +1077,11 @@ static void recv_only_or_dump(struct ctx *ctx)
 		fflush(stdout);
 	}
 
+	if (probe_rx) {
+		probe_print(probe_rx);
+		xfree(probe_rx);
+	}
+
 	bpf_release(&bpf_ops);
 	dissector_cleanup_all();
 	destroy_rx_ring(sock, &rx_ring);
@@ -1000,6 +1120,7 @@ static void help(void)
 	     "  -T|--magic <pcap-magic>        Pcap magic number/pcap format to store, see -D\n"
 	     "  -D|--dump-pcap-types           Dump pcap types and magic numbers and quit\n"
 	     "  -B|--dump-bpf                  Dump generated BPF assembly\n"
+	     "  -O|--probe <offset>            Latency/loss statistics of trafgen --probe packets\n"
 	     "  -r|--rand                      Randomize packet forwarding order (dev->dev)\n"
 	     "  -M|--no-promisc                No promiscuous mode for netdev\n"
 	     "  -A|--no-sock-mem               Don't tune core socket memory\n"
@@ -1029,7 +1150,8 @@ static void help(void)
 	     "  netsniff-ng --in eth0 --out eth1 --silent --bind-cpu 0 --type host\n"
 	     "  netsniff-ng --in eth1 --out /opt/probe/ -s -m -J --interval 100MiB -b 0\n"
 	     "  netsniff-ng --in vlan0 --out dump.pcap -c -u `id -u bob` -g `id -g bob`\n"
-	     "  netsniff-ng --in any --filter http.bpf --jumbo-support --ascii -V\n\n"
+	     "  netsniff-ng --in any --filter http.bpf --jumbo-support --ascii -V\n"
+	     "  netsniff-ng --in eth0 --silent --probe 42 udp dst port 9\n\n"
 	     "Note:\n"
 	     "  For introducing bit errors, delays with random variation and more\n"
 	     "  while replaying pcaps, make use of tc(8) with its disciplines (e.g. netem).\n\n"
@@ -1078,6 +1200,7 @@ int main(int argc, char **argv)
 		.uid = getuid(),
 		.gid = getgid(),
 		.magic = ORIGINAL_TCPDUMP_MAGIC,
+		.probe = -1,
 	};
 
 	srand(time(NULL));
@@ -1112,6 +1235,11 @@ int main(int argc, char **argv)
 		case 'f':
 			ctx.filter = xstrdup(optarg);
 			break;
+		case 'O':
+			ctx.probe = strtol(optarg, NULL, 0);
+			if (ctx.probe < 0)
+				panic("Probe offset must not be negative!\n");
+			break;
 		case 'M':
 			ctx.promiscuous = false;
 			break;
@@ -1284,6 +1412,7 @@ int main(int argc, char **argv)
 			case 'u':
 			case 'g':
 			case 'e':
+			case 'O':
 				panic("Option -%c requires an argument!\n",
 				      optopt);
 			default:
@@ -42,7 +42,7 @@ static void ipv4(struct pkt_buff *pkt)
 	unsigned int trailer_len = 0;
 	ssize_t opts_len, opt_len;
 	struct sockaddr_in sas, sad;
-	const char *city, *region, *country;
+	struct geoip_info info;
 
 	if (!ip)
 		return;
@@ -99,22 +99,24 @@ static void ipv4(struct pkt_buff *pkt)
 
 	if (geoip_working()) {
 		tprintf("\t[ Geo (");
-		if ((country = geoip4_country_name(sas))) {
-			tprintf("%s", country);
-			if ((region = geoip4_region_name(sas)))
-				tprintf(" / %s", region);
-			if ((city = geoip4_city_name(sas)))
-				tprintf(" / %s", city);
+		geoip4_lookup(sas, &info);
+		if (info.country[0]) {
+			tprintf("%s", info.country);
+			if (info.region[0])
+				tprintf(" / %s", info.region);
+			if (info.city[0])
+				tprintf(" / %s", info.city);
 		} else {
 			tprintf("local");
 		}
 		tprintf(" => ");
-		if ((country = geoip4_country_name(sad))) {
-			tprintf("%s", country);
-			if ((region = geoip4_region_name(sad)))
-				tprintf(" / %s", region);
-			if ((city = geoip4_city_name(sad)))
-				tprintf(" / %s", city);
+		geoip4_lookup(sad, &info);
+		if (info.country[0]) {
+			tprintf("%s", info.country);
+			if (info.region[0])
+				tprintf(" / %s", info.region);
+			if (info.city[0])
+				tprintf(" / %s", info.city);
 		} else {
 			tprintf("local");
 		}
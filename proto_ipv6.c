@@ -29,7 +29,7 @@ void ipv6(struct pkt_buff *pkt)
 	char dst_ip[INET6_ADDRSTRLEN];
 	struct ipv6hdr *ip = (struct ipv6hdr *) pkt_pull(pkt, sizeof(*ip));
 	struct sockaddr_in6 sas, sad;
-	const char *city, *region, *country;
+	struct geoip_info info;
 
 	if (ip == NULL)
 		return;
@@ -62,22 +62,24 @@ void ipv6(struct pkt_buff *pkt)
 
 	if (geoip_working()) {
 		tprintf("\t[ Geo (");
-		if ((country = geoip6_country_name(sas))) {
-			tprintf("%s", country);
-			if ((region = geoip6_region_name(sas)))
-				tprintf(" / %s", region);
-			if ((city = geoip6_city_name(sas)))
-				tprintf(" / %s", city);
+		geoip6_lookup(sas, &info);
+		if (info.country[0]) {
+			tprintf("%s", info.country);
+			if (info.region[0])
+				tprintf(" / %s", info.region);
+			if (info.city[0])
+				tprintf(" / %s", info.city);
 		} else {
 			tprintf("local");
 		}
 		tprintf(" => ");
-		if ((country = geoip6_country_name(sad))) {
-			tprintf("%s", country);
-			if ((region = geoip6_region_name(sad)))
-				tprintf(" / %s", region);
-			if ((city = geoip6_city_name(sad)))
-				tprintf(" / %s", city);
+		geoip6_lookup(sad, &info);
+		if (info.country[0]) {
+			tprintf("%s", info.country);
+			if (info.region[0])
+				tprintf(" / %s", info.region);
+			if (info.city[0])
+				tprintf(" / %s", info.city);
 		} else {
 			tprintf("local");
 		}
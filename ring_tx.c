@@ -29,6 +29,14 @@ void set_packet_loss_discard(int sock)
 		panic("setsockopt: cannot set packet loss");
 }
 
+int set_packet_qdisc_bypass(int sock)
+{
+	int bypass = 1;
+
+	return setsockopt(sock, SOL_PACKET, PACKET_QDISC_BYPASS,
+			  (void *) &bypass, sizeof(bypass));
+}
+
 void destroy_tx_ring(int sock, struct ring *ring)
 {
 	fmemset(&ring->layout, 0, sizeof(ring->layout));
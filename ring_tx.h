@@ -13,6 +13,10 @@
 /* Give userland 10 us time to push packets to the ring */
 #define TX_KERNEL_PULL_INT	10
 
+#ifndef PACKET_QDISC_BYPASS
+# define PACKET_QDISC_BYPASS	20
+#endif
+
 extern void destroy_tx_ring(int sock, struct ring *ring);
 extern void create_tx_ring(int sock, struct ring *ring, int verbose);
 extern void mmap_tx_ring(int sock, struct ring *ring);
@@ -21,6 +25,7 @@ extern void bind_tx_ring(int sock, struct ring *ring, int ifindex);
 extern void setup_tx_ring_layout(int sock, struct ring *ring,
 				 unsigned int size, int jumbo_support);
 extern void set_packet_loss_discard(int sock);
+extern int set_packet_qdisc_bypass(int sock);
 
 static inline int user_may_pull_from_tx(struct tpacket2_hdr *hdr)
 {
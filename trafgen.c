@@ -20,6 +20,7 @@
  *        Chapter 'The Stairs of Cirith Ungol'.
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <getopt.h>
@@ -46,6 +47,7 @@
 #include <netdb.h>
 #include <math.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include "xmalloc.h"
 #include "die.h"
@@ -57,19 +59,29 @@
 #include "tprintf.h"
 #include "ring_tx.h"
 #include "csum.h"
+#include "trafgen_probe.h"
 
 struct ctx {
-	bool rand, rfraw, jumbo_support, verbose, smoke_test, enforce;
-	unsigned long kpull, num, gap, reserve_size, cpus;
+	bool rand, rfraw, jumbo_support, verbose, smoke_test, enforce, rate_bytes;
+	bool load, stats_json, qdisc_path;
+	unsigned long kpull, num, gap, reserve_size, cpus, variants, stats_ival;
+	unsigned long kick;
+	long probe;
+	unsigned long long rate;
 	uid_t uid; gid_t gid; char *device, *device_trans, *rhost;
 	struct sockaddr_in dest;
 };
 
+/*
+ * tx_* are published live on request of the --stats reporter, taken at
+ * ts_ns, otherwise only once the CPU is done.
+ */
 struct cpu_stats {
 	unsigned long tv_sec, tv_usec;
-	unsigned long long tx_packets, tx_bytes;
+	unsigned long long tx_packets, tx_bytes, tx_retries;
 	unsigned long long cf_packets, cf_bytes;
 	unsigned long long cd_packets;
+	unsigned long long ring_used, ring_frames, ts_ns;
 	sig_atomic_t state;
 };
 
@@ -81,23 +93,62 @@ size_t plen = 0;
 struct packet_dyn *packet_dyn = NULL;
 size_t dlen = 0;
 
-static const char *short_options = "d:c:n:t:vJhS:rk:i:o:VRs:P:e:E:pu:g:";
+/* Precomputed variants of a packet with deterministic dynamic elements */
+struct packet_var {
+	uint8_t *base;
+	size_t num, cur, stride;
+};
+
+static struct packet_var *packet_var = NULL;
+static uint8_t *var_arena = NULL;
+static size_t var_arena_len = 0;
+
+#define HUGE_PAGE_SIZE		(2UL << 20)
+/* Per CPU budget for precomputed variants, multiple of HUGE_PAGE_SIZE */
+#define VAR_ARENA_MAX		(256UL << 20)
+
+/* Default number of frames we queue to the TX_RING before a send kick */
+#define TX_KICK_FRAMES		64
+
+/*
+ * Alias table for weighted packet selection (Vose): draw a slot
+ * uniformly, then keep it if the draw's lower half is below its
+ * threshold or take its alias otherwise.
+ */
+struct packet_alias {
+	uint32_t thresh;
+	uint32_t alias;
+};
+
+static struct packet_alias *packet_alias = NULL;
+static uint64_t pick_state;
+
+static const char *short_options = "d:c:n:t:vJhS:rk:i:o:VRs:P:e:E:pu:g:M:b:C:L:A:jO:K:q";
 static const struct option long_options[] = {
 	{"dev",			required_argument,	NULL, 'd'},
 	{"out",			required_argument,	NULL, 'o'},
 	{"in",			required_argument,	NULL, 'i'},
 	{"conf",		required_argument,	NULL, 'c'},
+	{"compile-to",		required_argument,	NULL, 'C'},
+	{"load",		required_argument,	NULL, 'L'},
 	{"num",			required_argument,	NULL, 'n'},
 	{"gap",			required_argument,	NULL, 't'},
+	{"rate",		required_argument,	NULL, 'b'},
 	{"cpus",		required_argument,	NULL, 'P'},
 	{"ring-size",		required_argument,	NULL, 'S'},
 	{"kernel-pull",		required_argument,	NULL, 'k'},
+	{"kick",		required_argument,	NULL, 'K'},
 	{"smoke-test",		required_argument,	NULL, 's'},
 	{"seed",		required_argument,	NULL, 'E'},
 	{"user",		required_argument,	NULL, 'u'},
 	{"group",		required_argument,	NULL, 'g'},
+	{"variants",		required_argument,	NULL, 'M'},
+	{"stats",		required_argument,	NULL, 'A'},
+	{"probe",		required_argument,	NULL, 'O'},
+	{"json",		no_argument,		NULL, 'j'},
 	{"jumbo-support",	no_argument,		NULL, 'J'},
 	{"cpp",			no_argument,		NULL, 'p'},
+	{"qdisc-path",		no_argument,		NULL, 'q'},
 	{"rfraw",		no_argument,		NULL, 'R'},
 	{"rand",		no_argument,		NULL, 'r'},
 	{"verbose",		no_argument,		NULL, 'V'},
@@ -115,8 +166,70 @@ static unsigned long interval = TX_KERNEL_PULL_INT;
 
 static struct cpu_stats *stats;
 
+/* Bumped by the --stats reporter to ask all CPUs for fresh numbers */
+static volatile unsigned long *stats_epoch = NULL;
+
+/* ENOBUFS and alike on kicking the kernel, our CPU only */
+static volatile unsigned long long tx_retries = 0;
+
 unsigned int seed;
 
+#define NSEC_PER_SEC		1000000000ULL
+
+/* Max. burst of packets the rate control lets through back to back */
+#define RATE_BURST		32
+/* Below that, we busy wait for the next send slot instead of sleeping */
+#define RATE_SLEEP_NS		50000ULL
+/* Max. lag, i.e. when we got preempted, that we still make up for */
+#define RATE_CATCHUP_NS		1000000ULL
+
+/*
+ * Token bucket in its virtual scheduling form (GCRA): tat is the time
+ * at which the bucket has drained completely, each unit (packet or byte)
+ * pushes it 1/rate seconds further, and units may go out as long as tat
+ * is at most tau, the depth of the bucket, ahead of now. The cost of a
+ * unit is kept as step_ns + step_rem/rate ns to not accumulate errors,
+ * and time lost while being preempted is made up for up to a limit.
+ */
+struct rate_ctl {
+	uint64_t rate, tau, step_ns, step_rem;
+	uint64_t tat, rem;
+	bool bytes;
+};
+
+/* Max. number of packets the slowpath hands to a single sendmmsg(2) */
+#define SLOW_BATCH		64
+/* Number of last batches kept around in smoke test mode */
+#define SMOKE_HIST		16
+/* Interval of the smoke test probes in us */
+#define SMOKE_PROBE_INT		100000
+/* Poll interval of sender and prober waiting on each other in us */
+#define SMOKE_PAUSE_INT		200
+
+struct xmit_batch {
+	struct mmsghdr msgs[SLOW_BATCH];
+	struct iovec iovs[SLOW_BATCH];
+	unsigned long ids[SLOW_BATCH];
+	uint8_t *bufs;
+	unsigned int len;
+};
+
+/*
+ * State shared with the asynchronous smoke test prober. batch_seq is the
+ * number of batches sent so far, ok_seq was batch_seq when the last probe
+ * that got answered went out, fail_seq the same for the failed one.
+ * While a probe is outstanding (probe_req) the sender parks between two
+ * batches (paused), so nothing goes out that the probe would not cover.
+ */
+struct smoke_ctx {
+	struct ctx *ctx;
+	int icmp_sock;
+	pthread_t thread;
+	volatile unsigned long batch_seq, ok_seq, fail_seq;
+	volatile sig_atomic_t failed, stop;
+	int probe_req, paused;
+};
+
 #define CPU_STATS_STATE_CFG	1
 #define CPU_STATS_STATE_CHK	2
 #define CPU_STATS_STATE_RES	4
@@ -143,7 +256,8 @@ static void signal_handler(int number)
 static void timer_elapsed(int number)
 {
 	set_itimer_interval_value(&itimer, 0, interval);
-	pull_and_flush_tx_ring(sock);
+	if (pull_and_flush_tx_ring(sock) < 0)
+		tx_retries++;
 	setitimer(ITIMER_REAL, &itimer, NULL); 
 }
 
@@ -153,19 +267,33 @@ static void help(void)
 	puts("http://www.netsniff-ng.org\n\n"
 	     "Usage: trafgen [options]\n"
 	     "Options:\n"
-	     "  -i|-c|--in|--conf <cfg/->      Packet configuration file/stdin\n"
+	     "  -i|-c|--in|--conf <cfg/pcap/-> Packet configuration file/pcap file/stdin\n"
 	     "  -o|-d|--out|--dev <netdev>     Networking device i.e., eth0\n"
 	     "  -p|--cpp                       Run packet config through C preprocessor\n"
+	     "  -C|--compile-to <file.tgc>     Compile packet config into binary file and exit\n"
+	     "  -L|--load <file.tgc>           Use compiled packet config instead of --in\n"
 	     "  -J|--jumbo-support             Support 64KB super jumbo frames (def: 2048B)\n"
 	     "  -R|--rfraw                     Inject raw 802.11 frames\n"
 	     "  -s|--smoke-test <ipv4>         Probe if machine survived fuzz-tested packet\n"
 	     "  -n|--num <uint>                Number of packets until exit (def: 0)\n"
-	     "  -r|--rand                      Randomize packet selection (def: round robin)\n"
+	     "  -r|--rand                      Randomize packet selection (def: round robin,\n"
+	     "                                 weighted random if packets have a weight())\n"
 	     "  -P|--cpus <uint>               Specify number of forks(<= CPUs) (def: #CPUs)\n"
 	     "  -t|--gap <uint>                Interpacket gap in us (approx)\n"
+	     "  -b|--rate <rate>               Send rate in pps/kpps/Mpps or kbit/s/Mbit/s/Gbit/s\n"
+	     "                                 of frame data, split among all CPUs\n"
 	     "  -S|--ring-size <size>          Manually set mmap size (KiB/MiB/GiB)\n"
-	     "  -k|--kernel-pull <uint>        Kernel batch interval in us (def: 10us)\n"
+	     "  -K|--kick <uint>               Kick kernel to send every <uint> frames (def: 64)\n"
+	     "  -k|--kernel-pull <uint>        Additionally kick kernel every <uint> us\n"
+	     "  -q|--qdisc-path                Send through the qdisc layer, i.e. for tc(8)\n"
 	     "  -E|--seed <uint>               Manually set srand(3) seed\n"
+	     "  -M|--variants <uint>           Precompute up to <uint> variants of packets\n"
+	     "                                 with periodic dynamic elements, up to 256 MiB\n"
+	     "                                 per CPU (def: 0)\n"
+	     "  -A|--stats <ms>                Print per CPU rates, ring usage, retries every <ms>\n"
+	     "  -j|--json                      Print --stats as JSON lines\n"
+	     "  -O|--probe <offset>            Stamp latency probe (seq, TX time) at payload\n"
+	     "                                 offset, see netsniff-ng --probe\n"
 	     "  -u|--user <userid>             Drop privileges and change to userid\n"
 	     "  -g|--group <groupid>           Drop privileges and change to groupid\n"
 	     "  -V|--verbose                   Be more verbose\n"
@@ -179,22 +307,39 @@ static void help(void)
 	     "  trafgen --dev eth0 --conf fuzzing.cfg --smoke-test 10.0.0.1\n"
 	     "  trafgen --dev wlan0 --rfraw --conf beacon-test.txf -V --cpus 2\n"
 	     "  trafgen --dev eth0 --conf frag_dos.cfg --rand --gap 1000\n"
+	     "  trafgen --dev eth0 --conf udp.cfg --rate 2.5Mpps\n"
 	     "  trafgen --dev eth0 --conf icmp.cfg --rand --num 1400000 -k1000\n"
-	     "  trafgen --dev eth0 --conf tcp_syn.cfg -u `id -u bob` -g `id -g bob`\n\n"
+	     "  trafgen --dev eth0 --conf tcp_syn.cfg -u `id -u bob` -g `id -g bob`\n"
+	     "  trafgen --dev eth0 --conf flows.cfg --variants 65536\n"
+	     "  trafgen --dev eth0 --in dump.pcap --rate 100Mbit/s\n"
+	     "  trafgen --in big.cfg --cpp --compile-to big.tgc\n"
+	     "  trafgen --dev eth0 --load big.tgc\n"
+	     "  trafgen --dev eth0 --conf udp.cfg --stats 1000 --probe 42\n\n"
 	     "Arbitrary packet config examples (e.g. trafgen -e udp > trafgen.cfg):\n"
 	     "  Run packet on  all CPUs:              { fill(0xff, 64) csum16(0, 64) }\n"
 	     "  Run packet only on CPU1:    cpu(1):   { rnd(64), 0b11001100, 0xaa }\n"
-	     "  Run packet only on CPU1-2:  cpu(1:2): { drnd(64),'a',csum16(1, 8),'b',42 }\n\n"
+	     "  Run packet only on CPU1-2:  cpu(1:2): { drnd(64),'a',csum16(1, 8),'b',42 }\n"
+	     "  Send packet 7 times as often:  weight(7): { fill(0x00, 64) }\n"
+	     "  Typed header fields:  { mac(00:11:22:33:44:55), ip4(10.0.0.1), port(80) }\n"
+	     "  Sweep through addresses/ports: { ip4(10.0.0.1, 10.0.0.254), port(1024, 65535) }\n"
+	     "  Lengths from offset to packet end:    { ..., len16(14), ..., ip4len(), ..., udplen() }\n"
+	     "  First 100 packets of a pcap file:     pcap(\"dump.pcap\", 100)\n"
+	     "  ... with fields overlaid at offsets:  pcap(\"dump.pcap\", 0): { [26] dinc32(0, 255), [24] csumip(14, 33) }\n\n"
 	     "Note:\n"
 	     "  Smoke/fuzz test example: machine A, 10.0.0.2 (trafgen) is directly\n"
-	     "  connected to machine B (test kernel), 10.0.0.1. If ICMP reply fails\n"
-	     "  we assume the kernel crashed, thus we print the packet and quit.\n"
+	     "  connected to machine B (test kernel), 10.0.0.1. B is probed with ICMP\n"
+	     "  in the background. If a reply fails we assume the kernel crashed, thus\n"
+	     "  we print the packets sent since the last reply and quit.\n"
 	     "  In case you find a ping-of-death, please mention trafgen in your\n"
 	     "  commit message of the fix!\n\n"
+	     "  Latency probes take 24 bytes. Dynamic checksums covering them are summed\n"
+	     "  up again after stamping, which costs a full pass over the covered area\n"
+	     "  per packet. One-way latency needs sender and receiver clocks in sync.\n\n"
 	     "  For introducing bit errors, delays with random variation and more,\n"
-	     "  make use of tc(8) with its different disciplines, i.e. netem.\n\n"
-	     "  For generating different package distributions, you can use scripting\n"
-	     "  to generate a trafgen config file with packet ratios as:\n\n"
+	     "  make use of tc(8) with its different disciplines, i.e. netem, and\n"
+	     "  --qdisc-path as trafgen bypasses qdiscs where the kernel allows.\n\n"
+	     "  For generating different package distributions, give the packets\n"
+	     "  of a trafgen config file a weight() according to ratios as:\n\n"
 	     "     IMIX             64:7,  570:4,  1518:1\n"
 	     "     Tolly            64:55,  78:5,   576:17, 1518:23\n"
 	     "     Cisco            64:7,  594:4,  1518:1\n"
@@ -277,8 +422,8 @@ static void example_udp(void)
         "  c16(0x0800),\n"
         "  /* IPv4 Version, IHL, TOS */\n"
         "  0x45, 0\n"
-        "  /* IPv4 Total Len */\n"
-        "  c16(95),\n"
+        "  /* IPv4 Total Len, filled in automatically */\n"
+        "  ip4len(),\n"
         "  /* IPv4 Ident */\n"
         "  drnd(2),\n"
         "  /* IPv4 Flags, Frag Off */\n"
@@ -292,13 +437,13 @@ static void example_udp(void)
         "  /* Source IP */\n"
         "  192, 168, 1, drnd(1),\n"
         "  /* Destination IP */\n"
-        "  192, 168, 1, 255,\n"
+        "  ip4(192.168.1.255),\n"
         "  /* UDP Source Port */\n"
-        "  c16(514),\n"
+        "  port(514),\n"
         "  /* UDP Destination Port */\n"
-        "  c16(514),\n"
-        "  /* UDP Length */\n"
-        "  const16(76),\n"
+        "  port(514),\n"
+        "  /* UDP Length, filled in automatically */\n"
+        "  udplen(),\n"
         "  /* UDP checksum (Can be zero) */\n"
         "  const16(0),\n"
         "  /* Data blob */\n"
@@ -364,30 +509,70 @@ static void version(void)
 	die();
 }
 
+static inline void csum_track(struct packet_dyn *pktd, uint32_t mask,
+			      uint32_t odd, uint8_t old, uint8_t val)
+{
+	while (mask) {
+		int j = __builtin_ctz(mask);
+
+		pktd->csum[j].diff += csum_diff8(old, val, (odd >> j) & 1);
+		mask &= mask - 1;
+	}
+}
+
+/* Advances a counter by one step, returns true on wrap around */
+static inline bool counter_step(struct counter *c)
+{
+	uint64_t off = c->val - c->min, span = c->max - c->min;
+	bool wrap;
+
+	if (c->type == TYPE_INC) {
+		wrap = c->inc > span - off;
+		off = wrap ? c->inc - (span - off) - 1 : off + c->inc;
+	} else {
+		wrap = c->inc > off;
+		off = wrap ? span - (c->inc - off - 1) : off - c->inc;
+	}
+
+	c->val = c->min + off;
+
+	return wrap;
+}
+
+static inline void counter_write(struct packet_dyn *pktd, uint8_t *payload,
+				 struct counter *c)
+{
+	int k;
+	uint64_t val = cpu_to_be64(c->val);
+	uint8_t *src = (uint8_t *) &val + sizeof(val) - c->len;
+
+	if (c->csum_mask) {
+		for (k = 0; k < c->len; ++k)
+			csum_track(pktd, c->csum_mask,
+				   (k & 1) ? ~c->csum_odd : c->csum_odd,
+				   payload[c->off + k], src[k]);
+	}
+
+	fmemcpy(&payload[c->off], src, c->len);
+}
+
 static void apply_counter(int counter_id)
 {
 	int j, i = counter_id;
-	size_t counter_max = packet_dyn[i].clen;
+	struct packet_dyn *pktd = &packet_dyn[i];
+	size_t counter_max = pktd->clen;
 
 	for (j = 0; j < counter_max; ++j) {
-		uint8_t val;
-		struct counter *counter = &packet_dyn[i].cnt[j];
+		struct counter *counter = &pktd->cnt[j];
 
-		val = counter->val - counter->min;
+		counter_write(pktd, packets[i].payload, counter);
 
-		switch (counter->type) {
-		case TYPE_INC:
-			val = (val + counter->inc) % (counter->max - counter->min + 1);
-			break;
-		case TYPE_DEC:
-			val = (val - counter->inc) % (counter->min - counter->max + 1);
-			break;
-		default:
-			bug();
-		}
+		if (counter->carried)
+			continue;
 
-		counter->val = val + counter->min;
-		packets[i].payload[counter->off] = val;
+		/* Carried counters are before us, so already written */
+		while (counter_step(counter) && counter->carry >= 0)
+			counter = &pktd->cnt[counter->carry];
 	}
 }
 
@@ -400,179 +585,409 @@ static void apply_randomizer(int rand_id)
 		uint8_t val = (uint8_t) rand();
 		struct randomizer *randomizer = &packet_dyn[i].rnd[j];
 
+		if (randomizer->csum_mask)
+			csum_track(&packet_dyn[i], randomizer->csum_mask,
+				   randomizer->csum_odd,
+				   packets[i].payload[randomizer->off], val);
+
 		packets[i].payload[randomizer->off] = val;
 	}
 }
 
-/* Taken and modified from tcpdump, Copyright belongs to them! */
+static void apply_csum16_full(struct packet *pkt, struct csum16 *csum)
+{
+	uint16_t sum = 0;
 
-struct cksum_vec {
-	const u8 *ptr;
-	int len;
-};
+	fmemset(&pkt->payload[csum->off], 0, sizeof(sum));
 
-#define ADDCARRY(x)		\
-	do { if ((x) > 65535)	\
-		(x) -= 65535;	\
-	} while (0)
+	switch (csum->which) {
+	case CSUM_IP:
+		if (csum->to >= pkt->len)
+			csum->to = pkt->len - 1;
+		/* An odd tail is padded with zero, as for the L4 sums */
+		sum = csum_fold(csum_partial(pkt->payload + csum->from,
+					     csum->to - csum->from + 1, 0));
+		break;
+	case CSUM_UDP:
+		if (unlikely(csum->to >= pkt->len))
+			return;
+		sum = p4_csum_partial((void *) pkt->payload + csum->from,
+				      pkt->payload + csum->to,
+				      (pkt->len - csum->to), IPPROTO_UDP);
+		break;
+	case CSUM_TCP:
+		if (unlikely(csum->to >= pkt->len))
+			return;
+		sum = p4_csum_partial((void *) pkt->payload + csum->from,
+				      pkt->payload + csum->to,
+				      (pkt->len - csum->to), IPPROTO_TCP);
+		break;
+	}
 
-#define REDUCE						\
-	do {						\
-		l_util.l = sum;				\
-		sum = l_util.s[0] + l_util.s[1];	\
-		ADDCARRY(sum);				\
-	} while (0)
+	fmemcpy(&pkt->payload[csum->off], &sum, sizeof(sum));
+}
 
-static u16 __in_cksum(const struct cksum_vec *vec, int veclen)
+static void apply_csum16(int csum_id)
 {
-	const u16 *w;
-	int sum = 0, mlen = 0;
-	int byte_swapped = 0;
-	union {
-		u8 c[2];
-		u16 s;
-	} s_util;
-	union {
-		u16 s[2];
-		u32 l;
-	} l_util;
-
-	for (; veclen != 0; vec++, veclen--) {
-		if (vec->len == 0)
-			continue;
+	int j, i = csum_id;
+	size_t csum_max = packet_dyn[i].slen;
+	bool ready = packet_dyn[i].csum_ready;
 
-		w = (const u16 *) (void *) vec->ptr;
-
-		if (mlen == -1) {
-			s_util.c[1] = *(const u8 *) w;
-			sum += s_util.s;
-			w = (const u16 *) (void *) ((const u8 *) w + 1);
-			mlen = vec->len - 1;
-		} else
-			mlen = vec->len;
-
-		if ((1 & (unsigned long) w) && (mlen > 0)) {
-			REDUCE;
-			sum <<= 8;
-			s_util.c[0] = *(const u8 *) w;
-			w = (const u16 *) (void *) ((const u8 *) w + 1);
-			mlen--;
-			byte_swapped = 1;
+	for (j = 0; j < csum_max; ++j) {
+		struct csum16 *csum = &packet_dyn[i].csum[j];
+		uint8_t *psum = &packets[i].payload[csum->off];
+		uint16_t sum;
+
+		if (unlikely(!ready || csum->full)) {
+			apply_csum16_full(&packets[i], csum);
+		} else if (csum->diff) {
+			sum = csum_update((psum[0] << 8) | psum[1], csum->diff);
+
+			psum[0] = sum >> 8;
+			psum[1] = sum & 0xff;
 		}
 
-		while ((mlen -= 32) >= 0) {
-			sum +=  w[0]; sum +=  w[1]; sum +=  w[2]; sum +=  w[3];
-			sum +=  w[4]; sum +=  w[5]; sum +=  w[6]; sum +=  w[7];
-			sum +=  w[8]; sum +=  w[9]; sum += w[10]; sum += w[11];
-			sum += w[12]; sum += w[13]; sum += w[14]; sum += w[15];
-			w += 16;
+		csum->diff = 0;
+	}
+
+	packet_dyn[i].csum_ready = true;
+}
+
+/*
+ * Number of packets until the counters of a packet are back in their
+ * current state, or 0 if that takes longer than limit packets.
+ */
+static size_t counter_period(struct packet_dyn *pktd, size_t limit)
+{
+	size_t j, n, len = pktd->clen * sizeof(*pktd->cnt);
+	struct counter *cnt = xmemdupz(pktd->cnt, len);
+
+	for (n = 1; n <= limit; ++n) {
+		for (j = 0; j < pktd->clen; ++j) {
+			struct counter *counter = &cnt[j];
+
+			if (counter->carried)
+				continue;
+
+			while (counter_step(counter) && counter->carry >= 0)
+				counter = &cnt[counter->carry];
+		}
+
+		for (j = 0; j < pktd->clen; ++j) {
+			if (cnt[j].val != pktd->cnt[j].val)
+				break;
 		}
 
-		mlen += 32;
+		if (j == pktd->clen)
+			break;
+	}
+
+	xfree(cnt);
+
+	return n <= limit ? n : 0;
+}
+
+static void *variant_arena_alloc(size_t len)
+{
+	void *arena;
+
+	arena = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE |
+		     MAP_ANONYMOUS | MAP_NORESERVE | MAP_HUGETLB, -1, 0);
+	if (arena != MAP_FAILED)
+		return arena;
+
+	/* No hugetlbfs pool, let THP back it as far as possible */
+	arena = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE |
+		     MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (arena == MAP_FAILED)
+		panic("Cannot allocate %zu bytes for packet variants: %s!\n",
+		      len, strerror(errno));
+
+	madvise(arena, len, MADV_HUGEPAGE);
+
+	return arena;
+}
+
+/*
+ * Packets whose only dynamic elements are counters and checksums repeat
+ * after a fixed number of packets. If that period is at most ctx->variants,
+ * we materialize all of them once, so that the xmit paths only have to
+ * stream them out just like static packets. Packets that do not fit into
+ * VAR_ARENA_MAX anymore stay on the dynamic path.
+ */
+static void precompute_variants(struct ctx *ctx, int cpu)
+{
+	size_t i, n, off, nvars = 0, npkts = 0, nover = 0;
+
+	packet_var = xzmalloc(plen * sizeof(*packet_var));
 
-		while ((mlen -= 8) >= 0) {
-			sum += w[0]; sum += w[1]; sum += w[2]; sum += w[3];
-			w += 4;
+	for (i = 0; i < plen; ++i) {
+		struct packet_dyn *pktd = &packet_dyn[i];
+
+		if (pktd->rlen > 0 || pktd->clen + pktd->slen == 0)
+			continue;
+
+		packet_var[i].num = counter_period(pktd, ctx->variants);
+		packet_var[i].stride = round_up_cacheline(packets[i].len);
+
+		if (packet_var[i].stride > 0 &&
+		    packet_var[i].num > (VAR_ARENA_MAX - var_arena_len) /
+					packet_var[i].stride) {
+			packet_var[i].num = 0;
+			nover++;
+			continue;
 		}
 
-		mlen += 8;
+		var_arena_len += packet_var[i].num * packet_var[i].stride;
+	}
+
+	if (nover > 0 && ctx->verbose && cpu == 0)
+		printf("CPU%d: %zu packets exceed the %lu MiB variant budget, "
+		       "kept dynamic\n", cpu, nover, VAR_ARENA_MAX >> 20);
+
+	if (var_arena_len == 0)
+		return;
+
+	var_arena_len = round_up(var_arena_len, HUGE_PAGE_SIZE);
+	var_arena = variant_arena_alloc(var_arena_len);
+
+	for (i = 0, off = 0; i < plen; ++i) {
+		struct packet_var *var = &packet_var[i];
 
-		if (mlen == 0 && byte_swapped == 0)
+		if (var->num == 0)
 			continue;
 
-		REDUCE;
+		var->base = var_arena + off;
+		off += var->num * var->stride;
+
+		for (n = 0; n < var->num; ++n) {
+			apply_counter(i);
+			apply_csum16(i);
 
-		while ((mlen -= 2) >= 0) {
-			sum += *w++;
+			fmemcpy(var->base + n * var->stride,
+				packets[i].payload, packets[i].len);
 		}
 
-		if (byte_swapped) {
-			REDUCE;
-			sum <<= 8;
-			byte_swapped = 0;
-
-			if (mlen == -1) {
-				s_util.c[1] = *(const u8 *) w;
-				sum += s_util.s;
-				mlen = 0;
-			} else
-				mlen = -1;
-		} else if (mlen == -1)
-			s_util.c[0] = *(const u8 *) w;
+		nvars += var->num;
+		npkts++;
+	}
+
+	if (ctx->verbose && cpu == 0)
+		printf("CPU%d: %zu packets precomputed in %zu variants (%.2Lf MiB)\n",
+		       cpu, npkts, nvars, (long double) var_arena_len / (1 << 20));
+}
+
+static void destroy_variants(void)
+{
+	if (var_arena)
+		munmap(var_arena, var_arena_len);
+
+	free(packet_var);
+
+	packet_var = NULL;
+	var_arena = NULL;
+	var_arena_len = 0;
+}
+
+static void build_packet_alias(int cpu)
+{
+	size_t i, ns = 0, nl = 0;
+	uint64_t total = 0, *prob;
+	uint32_t *small, *large;
+	bool weighted = false;
+
+	for (i = 0; i < plen; ++i) {
+		total += packets[i].weight;
+		weighted |= packets[i].weight != packets[0].weight;
+	}
+
+	if (!weighted)
+		return;
+
+	prob = xmalloc(plen * sizeof(*prob));
+	small = xmalloc(plen * sizeof(*small));
+	large = xmalloc(plen * sizeof(*large));
+	packet_alias = xmalloc(plen * sizeof(*packet_alias));
+
+	/* Scaled by plen, an average slot has a probability of total */
+	for (i = 0; i < plen; ++i) {
+		prob[i] = packets[i].weight * plen;
+		packet_alias[i].alias = i;
+
+		if (prob[i] < total)
+			small[ns++] = i;
+		else
+			large[nl++] = i;
 	}
 
-	if (mlen == -1) {
-		s_util.c[1] = 0;
-		sum += s_util.s;
+	while (ns > 0 && nl > 0) {
+		uint32_t s = small[--ns], l = large[nl - 1];
+
+		packet_alias[s].thresh = (uint32_t) ((double) prob[s] / total *
+						     UINT32_MAX);
+		packet_alias[s].alias = l;
+
+		prob[l] -= total - prob[s];
+		if (prob[l] < total) {
+			nl--;
+			small[ns++] = l;
+		}
 	}
 
-	REDUCE;
+	/* Leftovers are full slots, up to rounding */
+	while (nl > 0)
+		packet_alias[large[--nl]].thresh = UINT32_MAX;
+	while (ns > 0)
+		packet_alias[small[--ns]].thresh = UINT32_MAX;
 
-	return (~sum & 0xffff);
+	pick_state = ((uint64_t) seed << 32 | (cpu + 1)) * 0x9e3779b97f4a7c15ULL;
+	if (pick_state == 0)
+		pick_state = 1;
+
+	xfree(prob);
+	xfree(small);
+	xfree(large);
 }
 
-static u16 p4_csum(const struct ip *ip, const u8 *data, u16 len,
-		   u8 next_proto)
+static void destroy_packet_alias(void)
 {
-	struct cksum_vec vec[2];
-	struct pseudo_hdr {
-		u32 src;
-		u32 dst;
-		u8 mbz;
-		u8 proto;
-		u16 len;
-	} ph;
-
-	memset(&ph, 0, sizeof(ph));
-	ph.len = htons(len);
-	ph.mbz = 0;
-	ph.proto = next_proto;
-	ph.src = ip->ip_src.s_addr;
-	ph.dst = ip->ip_dst.s_addr;
-
-	vec[0].ptr = (const u8 *) (void *) &ph;
-	vec[0].len = sizeof(ph);
-
-	vec[1].ptr = data;
-	vec[1].len = len;
-
-	return __in_cksum(vec, 2);
+	free(packet_alias);
+	packet_alias = NULL;
 }
 
-static void apply_csum16(int csum_id)
+static inline uint64_t pick_rand(void)
 {
-	int j, i = csum_id;
-	size_t csum_max = packet_dyn[i].slen;
+	/* xorshift64*, rand(3) takes a lock on every call */
+	pick_state ^= pick_state >> 12;
+	pick_state ^= pick_state << 25;
+	pick_state ^= pick_state >> 27;
 
-	for (j = 0; j < csum_max; ++j) {
-		uint16_t sum = 0;
-		struct csum16 *csum = &packet_dyn[i].csum[j];
+	return pick_state * 0x2545f4914f6cdd1dULL;
+}
 
-		fmemset(&packets[i].payload[csum->off], 0, sizeof(sum));
+static inline unsigned long packet_next(struct ctx *ctx, unsigned long i)
+{
+	if (packet_alias) {
+		uint64_t r = pick_rand();
+		uint32_t slot = ((r >> 32) * plen) >> 32;
 
-		switch (csum->which) {
-		case CSUM_IP:
-			if (csum->to >= packets[i].len)
-				csum->to = packets[i].len - 1;
-			sum = calc_csum(packets[i].payload + csum->from,
-					csum->to - csum->from + 1, 0);
-			break;
-		case CSUM_UDP:
-			sum = p4_csum((void *) packets[i].payload + csum->from,
-				      packets[i].payload + csum->to,
-				      (packets[i].len - csum->to),
-				      IPPROTO_UDP);
-			break;
-		case CSUM_TCP:
-			sum = p4_csum((void *) packets[i].payload + csum->from,
-				      packets[i].payload + csum->to,
-				      (packets[i].len - csum->to),
-				      IPPROTO_TCP);
-			break;
+		return (uint32_t) r < packet_alias[slot].thresh ?
+		       slot : packet_alias[slot].alias;
+	}
+
+	if (!ctx->rand)
+		return i + 1 < plen ? i + 1 : 0;
+
+	return rand() % plen;
+}
+
+/* Returns the next instance of packet i as it should go out on the wire */
+static inline uint8_t *packet_materialize(unsigned long i)
+{
+	struct packet_dyn *pktd = &packet_dyn[i];
+
+	if (packet_var && packet_var[i].num) {
+		struct packet_var *var = &packet_var[i];
+		uint8_t *out = var->base + var->cur * var->stride;
+
+		if (++var->cur == var->num)
+			var->cur = 0;
+
+		return out;
+	}
+
+	if (pktd->clen + pktd->rlen + pktd->slen) {
+		apply_counter(i);
+		apply_randomizer(i);
+		apply_csum16(i);
+	}
+
+	return packets[i].payload;
+}
+
+/*
+ * Stamps a latency probe into pkt, our outgoing copy of packet i. Its
+ * checksums are already in place, so the ones covering the probe are
+ * summed up again over the copy, in the same order as for the packet.
+ */
+static void packet_probe_stamp(uint8_t *pkt, unsigned long i, long off,
+			       uint32_t stream, uint64_t seq)
+{
+	struct packet_dyn *pktd = &packet_dyn[i];
+	struct packet out = {
+		.payload	= pkt,
+		.len		= packets[i].len,
+	};
+	size_t j;
+
+	probe_stamp(pkt + off, stream, seq);
+
+	for (j = 0; j < pktd->slen; ++j) {
+		if (csum_covers_range(&packets[i], &pktd->csum[j], off,
+				      sizeof(struct probe_hdr)))
+			apply_csum16_full(&out, &pktd->csum[j]);
+	}
+}
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static void rate_init(struct rate_ctl *rc, uint64_t rate, bool bytes,
+		      uint64_t burst)
+{
+	rc->rate = rate;
+	rc->bytes = bytes;
+	rc->step_ns = NSEC_PER_SEC / rate;
+	rc->step_rem = NSEC_PER_SEC % rate;
+	rc->tau = burst * rc->step_ns + burst * rc->step_rem / rate;
+	rc->tat = now_ns();
+	rc->rem = 0;
+}
+
+/*
+ * Blocks until pkts more packets of len bytes in total may go out. In case
+ * we need to wait and have a TX_RING, the frames queued so far are released
+ * to the kernel first.
+ */
+static inline void rate_wait(struct rate_ctl *rc, size_t pkts, size_t len,
+			     int ring_sock)
+{
+	uint64_t deadline, units = rc->bytes ? len : pkts, now = now_ns();
+
+	if (unlikely(now + rc->tau < rc->tat)) {
+		deadline = rc->tat - rc->tau;
+
+		if (ring_sock >= 0 && pull_and_flush_tx_ring(ring_sock) < 0)
+			tx_retries++;
+
+		if (deadline - now > RATE_SLEEP_NS) {
+			struct timespec ts;
+
+			ts.tv_sec = (deadline - RATE_SLEEP_NS) / NSEC_PER_SEC;
+			ts.tv_nsec = (deadline - RATE_SLEEP_NS) % NSEC_PER_SEC;
+
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
 		}
 
-		fmemcpy(&packets[i].payload[csum->off], &sum, sizeof(sum));
+		while ((now = now_ns()) < deadline && likely(sigint == 0))
+			sched_yield();
+	}
+
+	/* Lagging behind for too long does not earn us more credit */
+	if (unlikely(rc->tat + RATE_CATCHUP_NS < now)) {
+		rc->tat = now - RATE_CATCHUP_NS;
+		rc->rem = 0;
 	}
+
+	rc->rem += units * rc->step_rem;
+	rc->tat += units * rc->step_ns + rc->rem / rc->rate;
+	rc->rem %= rc->rate;
 }
 
 static struct cpu_stats *setup_shared_var(unsigned long cpus)
@@ -624,18 +1039,6 @@ static void dump_trafgen_snippet(uint8_t *payload, size_t len)
 	fflush(stdout);
 }
 
-static inline unsigned short csum(unsigned short *buf, int nwords)
-{
-	unsigned long sum;
-
-	for (sum = 0; nwords > 0; nwords--)
-		sum += *buf++;
-	sum = (sum >> 16) + (sum & 0xffff);
-	sum += (sum >> 16);
-
-	return ~sum;
-}
-
 static int xmit_smoke_setup(struct ctx *ctx)
 {
 	int icmp_sock, ret, ttl = 64;
@@ -737,13 +1140,149 @@ static int xmit_smoke_probe(int icmp_sock, struct ctx *ctx)
 	return -1;
 }
 
+static void *xmit_smoke_prober(void *arg)
+{
+	struct smoke_ctx *smoke = arg;
+
+	while (likely(sigint == 0) && likely(smoke->stop == 0)) {
+		unsigned long seq;
+
+		__atomic_store_n(&smoke->paused, 0, __ATOMIC_SEQ_CST);
+		__atomic_store_n(&smoke->probe_req, 1, __ATOMIC_SEQ_CST);
+
+		while (!__atomic_load_n(&smoke->paused, __ATOMIC_SEQ_CST) &&
+		       likely(sigint == 0) && likely(smoke->stop == 0))
+			usleep(SMOKE_PAUSE_INT);
+
+		seq = smoke->batch_seq;
+
+		if (xmit_smoke_probe(smoke->icmp_sock, smoke->ctx) < 0) {
+			smoke->fail_seq = seq;
+			smoke->failed = 1;
+			__atomic_store_n(&smoke->probe_req, 0, __ATOMIC_SEQ_CST);
+			break;
+		}
+
+		smoke->ok_seq = seq;
+		__atomic_store_n(&smoke->probe_req, 0, __ATOMIC_SEQ_CST);
+
+		usleep(SMOKE_PROBE_INT);
+	}
+
+	pthread_exit(NULL);
+}
+
+/* Sender side, parks until the outstanding probe has been answered */
+static void xmit_smoke_pause(struct smoke_ctx *smoke)
+{
+	do {
+		__atomic_store_n(&smoke->paused, 1, __ATOMIC_SEQ_CST);
+		usleep(SMOKE_PAUSE_INT);
+	} while (__atomic_load_n(&smoke->probe_req, __ATOMIC_SEQ_CST) &&
+		 likely(sigint == 0));
+}
+
+static void xmit_smoke_report(struct smoke_ctx *smoke,
+			      struct xmit_batch *batches, size_t nbatches)
+{
+	unsigned long seq, from = smoke->ok_seq + 1, to = smoke->batch_seq;
+	unsigned int j;
+
+	printf("%sSmoke test alert:%s\n", colorize_start(bold), colorize_end());
+	printf("  Remote host seems to be unresponsive to ICMP probes!\n");
+
+	if (to < from) {
+		printf("  No packets were sent since the last answered probe, seed:%u\n",
+		       seed);
+		return;
+	}
+
+	if (to - from + 1 > nbatches) {
+		printf("  History truncated: batch%lu to batch%lu were sent since "
+		       "the last answered probe, only the last %zu are kept!\n",
+		       from, to, nbatches);
+		from = to - nbatches + 1;
+	}
+
+	printf("  Culprit is within batch%lu to batch%lu, seed:%u, trafgen snippets:\n\n",
+	       from, to, seed);
+
+	for (seq = from; seq <= to; ++seq) {
+		struct xmit_batch *b = &batches[(seq - 1) % nbatches];
+
+		for (j = 0; j < b->len; ++j) {
+			printf("/* batch%lu, packet%lu */\n", seq, b->ids[j]);
+			dump_trafgen_snippet(b->iovs[j].iov_base,
+					     b->iovs[j].iov_len);
+		}
+	}
+}
+
+/* Packets that change in place need a copy to be queued up in a batch */
+static inline bool packet_stable(unsigned long i)
+{
+	struct packet_dyn *pktd = &packet_dyn[i];
+
+	return (packet_var && packet_var[i].num) ||
+	       pktd->clen + pktd->rlen + pktd->slen == 0;
+}
+
+static inline bool stats_wanted(unsigned long *epoch)
+{
+	if (likely(stats_epoch == NULL) || likely(*stats_epoch == *epoch))
+		return false;
+
+	*epoch = *stats_epoch;
+	return true;
+}
+
+static void stats_publish(int cpu, unsigned long long tx_packets,
+			  unsigned long long tx_bytes, struct ring *ring,
+			  unsigned int inflight)
+{
+	if (ring) {
+		stats[cpu].ring_used = inflight;
+		stats[cpu].ring_frames = ring->layout.tp_frame_nr;
+	}
+
+	stats[cpu].tx_packets = tx_packets;
+	stats[cpu].tx_bytes = tx_bytes;
+	stats[cpu].tx_retries = tx_retries;
+	stats[cpu].ts_ns = now_ns();
+}
+
+static void xmit_batch_or_die(int sock, struct xmit_batch *b)
+{
+	int ret;
+	unsigned int sent = 0;
+
+	while (sent < b->len) {
+		ret = sendmmsg(sock, &b->msgs[sent], b->len - sent, 0);
+		if (unlikely(ret < 0)) {
+			if (errno == ENOBUFS || errno == EINTR) {
+				tx_retries++;
+				sched_yield();
+				continue;
+			}
+
+			panic("Sendmmsg error: %s!\n", strerror(errno));
+		}
+
+		sent += ret;
+	}
+}
+
 static void xmit_slowpath_or_die(struct ctx *ctx, int cpu)
 {
-	int ret, icmp_sock = -1;
-	unsigned long num = 1, i = 0;
+	unsigned long num = 1, i = 0, seq = 0, epoch = 0;
 	struct timeval start, end, diff;
 	unsigned long long tx_bytes = 0, tx_packets = 0;
-	struct packet_dyn *pktd;
+	unsigned int batch = ctx->gap > 0 ? 1 : SLOW_BATCH;
+	size_t j, k, nbatches = ctx->smoke_test ? SMOKE_HIST : 1, maxlen = 0;
+	struct xmit_batch *batches, *b;
+	struct smoke_ctx smoke;
+	struct rate_ctl rc;
+	uint8_t *pkt;
 	struct sockaddr_ll saddr = {
 		.sll_family = PF_PACKET,
 		.sll_halen = ETH_ALEN,
@@ -753,57 +1292,88 @@ static void xmit_slowpath_or_die(struct ctx *ctx, int cpu)
 	if (ctx->num > 0)
 		num = ctx->num;
 
-	if (ctx->smoke_test)
-		icmp_sock = xmit_smoke_setup(ctx);
+	for (j = 0; j < plen; ++j)
+		maxlen = max(maxlen, packets[j].len);
+
+	batches = xzmalloc(nbatches * sizeof(*batches));
+	for (j = 0; j < nbatches; ++j) {
+		b = &batches[j];
+		b->bufs = xmalloc(batch * maxlen);
+
+		for (k = 0; k < batch; ++k) {
+			b->msgs[k].msg_hdr.msg_name = &saddr;
+			b->msgs[k].msg_hdr.msg_namelen = sizeof(saddr);
+			b->msgs[k].msg_hdr.msg_iov = &b->iovs[k];
+			b->msgs[k].msg_hdr.msg_iovlen = 1;
+		}
+	}
+
+	fmemset(&smoke, 0, sizeof(smoke));
+	if (ctx->smoke_test) {
+		smoke.ctx = ctx;
+		smoke.icmp_sock = xmit_smoke_setup(ctx);
+	}
 
 	drop_privileges(ctx->enforce, ctx->uid, ctx->gid);
 
+	if (ctx->smoke_test &&
+	    pthread_create(&smoke.thread, NULL, xmit_smoke_prober, &smoke))
+		panic("Cannot create smoke test thread!\n");
+
+	if (ctx->rate)
+		rate_init(&rc, ctx->rate, ctx->rate_bytes, ctx->rate_bytes ?
+			  batch * maxlen : batch);
+
 	bug_on(gettimeofday(&start, NULL));
 
 	while (likely(sigint == 0) && likely(num > 0)) {
-		pktd = &packet_dyn[i];
-		if (pktd->clen + pktd->rlen + pktd->slen) {
-			apply_counter(i);
-			apply_randomizer(i);
-			apply_csum16(i);
-		}
-retry:
-		ret = sendto(sock, packets[i].payload, packets[i].len, 0,
-			     (struct sockaddr *) &saddr, sizeof(saddr));
-		if (unlikely(ret < 0)) {
-			if (errno == ENOBUFS) {
-				sched_yield();
-				goto retry;
+		size_t bytes = 0;
+
+		b = &batches[seq % nbatches];
+
+		for (b->len = 0; b->len < batch && likely(num > 0); b->len++) {
+			pkt = packet_materialize(i);
+			if (!packet_stable(i) || ctx->probe >= 0) {
+				fmemcpy(b->bufs + b->len * maxlen, pkt,
+					packets[i].len);
+				pkt = b->bufs + b->len * maxlen;
 			}
 
-			panic("Sendto error: %s!\n", strerror(errno));
-		}
+			if (ctx->probe >= 0)
+				packet_probe_stamp(pkt, i, ctx->probe, cpu,
+						   tx_packets + b->len);
 
-		tx_bytes += packets[i].len;
-		tx_packets++;
+			b->iovs[b->len].iov_base = pkt;
+			b->iovs[b->len].iov_len = packets[i].len;
+			b->ids[b->len] = i;
 
-		if (ctx->smoke_test) {
-			ret = xmit_smoke_probe(icmp_sock, ctx);
-			if (unlikely(ret < 0)) {
-				printf("%sSmoke test alert:%s\n", colorize_start(bold), colorize_end());
-				printf("  Remote host seems to be unresponsive to ICMP probes!\n");
-				printf("  Last instance was packet%lu, seed:%u, trafgen snippet:\n\n",
-				       i, seed);
+			bytes += packets[i].len;
 
-				dump_trafgen_snippet(packets[i].payload, packets[i].len);
-				break;
-			}
+			i = packet_next(ctx, i);
+
+			if (ctx->num > 0)
+				num--;
 		}
 
-		if (!ctx->rand) {
-			i++;
-			if (i >= plen)
-				i = 0;
-		} else
-			i = rand() % plen;
+		if (ctx->rate)
+			rate_wait(&rc, b->len, bytes, -1);
 
-		if (ctx->num > 0)
-			num--;
+		xmit_batch_or_die(sock, b);
+
+		tx_bytes += bytes;
+		tx_packets += b->len;
+
+		if (unlikely(stats_wanted(&epoch)))
+			stats_publish(cpu, tx_packets, tx_bytes, NULL, 0);
+
+		smoke.batch_seq = ++seq;
+		if (ctx->smoke_test &&
+		    __atomic_load_n(&smoke.probe_req, __ATOMIC_SEQ_CST))
+			xmit_smoke_pause(&smoke);
+		if (unlikely(smoke.failed)) {
+			xmit_smoke_report(&smoke, batches, nbatches);
+			break;
+		}
 
 		if (ctx->gap > 0)
 			usleep(ctx->gap);
@@ -812,8 +1382,15 @@ retry:
 	bug_on(gettimeofday(&end, NULL));
 	diff = tv_subtract(end, start);
 
-	if (ctx->smoke_test)
-		close(icmp_sock);
+	if (ctx->smoke_test) {
+		smoke.stop = 1;
+		pthread_join(smoke.thread, NULL);
+		close(smoke.icmp_sock);
+	}
+
+	for (j = 0; j < nbatches; ++j)
+		xfree(batches[j].bufs);
+	xfree(batches);
 
 	stats[cpu].tx_packets = tx_packets;
 	stats[cpu].tx_bytes = tx_bytes;
@@ -823,17 +1400,42 @@ retry:
 	stats[cpu].state |= CPU_STATS_STATE_RES;
 }
 
+/*
+ * Frames [done, done + inflight) of the ring were handed to the kernel.
+ * It hands them back in order by flipping tp_status to available once
+ * sent, so we only ever look at the oldest one.
+ */
+static inline void tx_ring_reap(struct ring *ring, unsigned int *done,
+				unsigned int *inflight)
+{
+	while (*inflight > 0 &&
+	       user_may_pull_from_tx(ring->frames[*done].iov_base)) {
+		if (++(*done) >= ring->layout.tp_frame_nr)
+			*done = 0;
+		(*inflight)--;
+	}
+}
+
+static inline void tx_ring_kick(int sock, unsigned int *pending)
+{
+	if (pull_and_flush_tx_ring(sock) < 0 && errno != EAGAIN)
+		tx_retries++;
+
+	*pending = 0;
+}
+
 static void xmit_fastpath_or_die(struct ctx *ctx, int cpu)
 {
 	int ifindex = device_ifindex(ctx->device);
 	uint8_t *out = NULL;
-	unsigned int it = 0;
-	unsigned long num = 1, i = 0, size;
+	unsigned int it = 0, done = 0, inflight = 0, pending = 0, frames, kick;
+	unsigned long num = 1, i = 0, size, epoch = 0;
+	uint64_t drain;
 	struct ring tx_ring;
 	struct frame_map *hdr;
 	struct timeval start, end, diff;
-	struct packet_dyn *pktd;
 	unsigned long long tx_bytes = 0, tx_packets = 0;
+	struct rate_ctl rc;
 
 	fmemset(&tx_ring, 0, sizeof(tx_ring));
 
@@ -842,6 +1444,10 @@ static void xmit_fastpath_or_die(struct ctx *ctx, int cpu)
 	set_sock_prio(sock, 512);
 	set_packet_loss_discard(sock);
 
+	if (!ctx->qdisc_path && set_packet_qdisc_bypass(sock) < 0 &&
+	    ctx->verbose && cpu == 0)
+		printf("Kernel lacks PACKET_QDISC_BYPASS, using qdisc path\n");
+
 	setup_tx_ring_layout(sock, &tx_ring, size, ctx->jumbo_support);
 	create_tx_ring(sock, &tx_ring, ctx->verbose);
 	mmap_tx_ring(sock, &tx_ring);
@@ -850,57 +1456,90 @@ static void xmit_fastpath_or_die(struct ctx *ctx, int cpu)
 
 	drop_privileges(ctx->enforce, ctx->uid, ctx->gid);
 
-	if (ctx->kpull)
-		interval = ctx->kpull;
+	frames = tx_ring.layout.tp_frame_nr;
+	kick = ctx->kick > 0 ? ctx->kick : TX_KICK_FRAMES;
+	if (kick > frames)
+		kick = frames;
+
 	if (ctx->num > 0)
 		num = ctx->num;
 
-	set_itimer_interval_value(&itimer, 0, interval);
-	setitimer(ITIMER_REAL, &itimer, NULL); 
+	/* Time based kicks only on request, the signal disturbs our loop */
+	if (ctx->kpull) {
+		interval = ctx->kpull;
+		set_itimer_interval_value(&itimer, 0, interval);
+		setitimer(ITIMER_REAL, &itimer, NULL);
+	}
+
+	if (ctx->rate)
+		rate_init(&rc, ctx->rate, ctx->rate_bytes, ctx->rate_bytes ?
+			  RATE_BURST * ETH_FRAME_LEN : RATE_BURST);
 
 	bug_on(gettimeofday(&start, NULL));
 
 	while (likely(sigint == 0) && likely(num > 0)) {
-		while (user_may_pull_from_tx(tx_ring.frames[it].iov_base) && likely(num > 0)) {
-			hdr = tx_ring.frames[it].iov_base;
-			out = ((uint8_t *) hdr) + TPACKET2_HDRLEN - sizeof(struct sockaddr_ll);
-
-			hdr->tp_h.tp_snaplen = packets[i].len;
-			hdr->tp_h.tp_len = packets[i].len;
-
-			pktd = &packet_dyn[i];
-			if (pktd->clen + pktd->rlen + pktd->slen) {
-				apply_counter(i);
-				apply_randomizer(i);
-				apply_csum16(i);
+		if (unlikely(inflight == frames)) {
+			tx_ring_reap(&tx_ring, &done, &inflight);
+
+			if (inflight == frames) {
+				/* Ring is full, make sure the kernel is on it */
+				if (pending > 0)
+					tx_ring_kick(sock, &pending);
+				if (unlikely(stats_wanted(&epoch)))
+					stats_publish(cpu, tx_packets, tx_bytes,
+						      &tx_ring, inflight);
+				continue;
 			}
+		}
 
-			fmemcpy(out, packets[i].payload, packets[i].len);
+		hdr = tx_ring.frames[it].iov_base;
+		out = ((uint8_t *) hdr) + TPACKET2_HDRLEN - sizeof(struct sockaddr_ll);
 
-			tx_bytes += packets[i].len;
-			tx_packets++;
+		if (ctx->rate)
+			rate_wait(&rc, 1, packets[i].len, sock);
 
-			if (!ctx->rand) {
-				i++;
-				if (i >= plen)
-					i = 0;
-			} else
-				i = rand() % plen;
+		hdr->tp_h.tp_snaplen = packets[i].len;
+		hdr->tp_h.tp_len = packets[i].len;
 
-			kernel_may_pull_from_tx(&hdr->tp_h);
+		fmemcpy(out, packet_materialize(i), packets[i].len);
 
-			it++;
-			if (it >= tx_ring.layout.tp_frame_nr)
-				it = 0;
+		if (ctx->probe >= 0)
+			packet_probe_stamp(out, i, ctx->probe, cpu, tx_packets);
 
-			if (ctx->num > 0)
-				num--;
+		tx_bytes += packets[i].len;
+		tx_packets++;
 
-			if (unlikely(sigint == 1))
-				break;
+		i = packet_next(ctx, i);
+
+		kernel_may_pull_from_tx(&hdr->tp_h);
+		inflight++;
+
+		it++;
+		if (it >= frames)
+			it = 0;
+
+		if (++pending >= kick)
+			tx_ring_kick(sock, &pending);
+
+		if (ctx->num > 0)
+			num--;
+
+		if (unlikely(stats_wanted(&epoch))) {
+			tx_ring_reap(&tx_ring, &done, &inflight);
+			stats_publish(cpu, tx_packets, tx_bytes, &tx_ring,
+				      inflight);
 		}
 	}
 
+	/* Push out the rest and give the kernel a moment to get it done */
+	tx_ring_kick(sock, &pending);
+	drain = now_ns() + NSEC_PER_SEC;
+	while (inflight > 0 && likely(sigint == 0) && now_ns() < drain) {
+		tx_ring_reap(&tx_ring, &done, &inflight);
+		if (inflight > 0)
+			sched_yield();
+	}
+
 	bug_on(gettimeofday(&end, NULL));
 	diff = tv_subtract(end, start);
 
@@ -997,7 +1636,7 @@ static int xmit_packet_precheck(struct ctx *ctx, int cpu)
 {
 	int i;
 	unsigned long plen_total, orig = ctx->num;
-	size_t mtu, total_len = 0;
+	size_t j, mtu, total_len = 0;
 
 	bug_on(plen != dlen);
 
@@ -1025,18 +1664,139 @@ static int xmit_packet_precheck(struct ctx *ctx, int cpu)
 			panic("Device MTU < than packet%d's size!\n", i);
 		if (packets[i].len <= 14)
 			panic("Packet%d's size too short!\n", i);
+		if (ctx->probe >= 0 &&
+		    packets[i].len < ctx->probe + sizeof(struct probe_hdr))
+			panic("Packet%d's size too short for a probe at "
+			      "offset %ld!\n", i, ctx->probe);
+		for (j = 0; ctx->probe >= 0 && j < packet_dyn[i].slen; ++j) {
+			off_t off = packet_dyn[i].csum[j].off;
+
+			if (off + 2 > ctx->probe &&
+			    off < ctx->probe + (off_t) sizeof(struct probe_hdr))
+				panic("Packet%d's checksum at offset %jd overlaps "
+				      "the probe!\n", i, (intmax_t) off);
+		}
 	}
 
 	return 0;
 }
 
+/* Our even share of the rate among all CPUs that have packets to send */
+static unsigned long long rate_share(struct ctx *ctx, int cpu)
+{
+	int i;
+	unsigned long long share, active = 0, idx = 0;
+
+	for (i = 0; i < ctx->cpus; i++) {
+		if (stats[i].cf_packets == 0)
+			continue;
+		if (i < cpu)
+			idx++;
+		active++;
+	}
+
+	share = ctx->rate / active + (idx < ctx->rate % active ? 1 : 0);
+
+	return share ? : 1;
+}
+
+static void stats_print(struct ctx *ctx, struct cpu_stats *prev)
+{
+	int i;
+	double pps, mbit, pps_sum = 0, mbit_sum = 0;
+	unsigned long long retries = 0;
+
+	if (ctx->stats_json)
+		printf("{\"time\":%.3f,\"cpus\":[", probe_clock_ns() / 1e9);
+
+	for (i = 0; i < ctx->cpus; i++) {
+		struct cpu_stats *s = &stats[i], *p = &prev[i];
+		double ring = s->ring_frames ?
+			      100.0 * s->ring_used / s->ring_frames : 0;
+
+		pps = mbit = 0;
+		if (p->ts_ns > 0 && s->ts_ns > p->ts_ns) {
+			pps = (s->tx_packets - p->tx_packets) * 1e9 /
+			      (s->ts_ns - p->ts_ns);
+			mbit = (s->tx_bytes - p->tx_bytes) * 8e3 /
+			       (s->ts_ns - p->ts_ns);
+		}
+
+		pps_sum += pps;
+		mbit_sum += mbit;
+		retries += s->tx_retries;
+
+		if (ctx->stats_json)
+			printf("%s{\"cpu\":%d,\"pps\":%.0f,\"mbps\":%.2f,"
+			       "\"ring\":%.1f,\"retries\":%llu,"
+			       "\"packets\":%llu,\"bytes\":%llu}",
+			       i ? "," : "", i, pps, mbit, ring, s->tx_retries,
+			       s->tx_packets, s->tx_bytes);
+		else
+			printf("CPU%3d: %12.0f pps %10.2f Mbit/s ring %5.1f%% "
+			       "retries %llu\n", i, pps, mbit, ring,
+			       s->tx_retries);
+
+		*p = *s;
+	}
+
+	if (ctx->stats_json)
+		printf("],\"pps\":%.0f,\"mbps\":%.2f,\"retries\":%llu}\n",
+		       pps_sum, mbit_sum, retries);
+	else
+		printf("Total:  %12.0f pps %10.2f Mbit/s retries %llu\n\n",
+		       pps_sum, mbit_sum, retries);
+
+	fflush(stdout);
+}
+
+/*
+ * Reports on the running CPUs until they all exited, returns how many of
+ * them we have already reaped.
+ */
+static unsigned long stats_report_loop(struct ctx *ctx)
+{
+	int status;
+	unsigned long reaped = 0;
+	struct cpu_stats *prev = xzmalloc(ctx->cpus * sizeof(*prev));
+
+	while (reaped < ctx->cpus) {
+		usleep(ctx->stats_ival * 1000);
+
+		while (reaped < ctx->cpus && waitpid(-1, &status, WNOHANG) > 0) {
+			reaped++;
+			if (WEXITSTATUS(status) == EXIT_FAILURE)
+				die();
+		}
+
+		if (reaped < ctx->cpus)
+			stats_print(ctx, prev);
+
+		(*stats_epoch)++;
+	}
+
+	xfree(prev);
+	return reaped;
+}
+
 static void main_loop(struct ctx *ctx, char *confname, bool slow,
 		      int cpu, bool invoke_cpp)
 {
-	compile_packets(confname, ctx->verbose, cpu, invoke_cpp);
+	if (ctx->load)
+		load_packets(confname, ctx->verbose, cpu);
+	else
+		compile_packets(confname, ctx->verbose, cpu, invoke_cpp);
 	if (xmit_packet_precheck(ctx, cpu) < 0)
 		return;
 
+	if (ctx->variants > 0)
+		precompute_variants(ctx, cpu);
+
+	build_packet_alias(cpu);
+
+	if (ctx->rate)
+		ctx->rate = rate_share(ctx, cpu);
+
 	if (cpu == 0) {
 		int i;
 		size_t total_len = 0, total_pkts = 0;
@@ -1061,9 +1821,45 @@ static void main_loop(struct ctx *ctx, char *confname, bool slow,
 
 	close(sock);
 
+	destroy_packet_alias();
+	destroy_variants();
 	cleanup_packets();
 }
 
+static void parse_rate(struct ctx *ctx, const char *arg)
+{
+	int i;
+	char *ptr;
+	long double rate = strtold(arg, &ptr);
+	static const struct {
+		const char *unit;
+		long double scale;
+		bool bytes;
+	} units[] = {
+		{ "pps",	1,		false },
+		{ "kpps",	1e3,		false },
+		{ "Mpps",	1e6,		false },
+		{ "kbit/s",	1e3 / 8,	true },
+		{ "Mbit/s",	1e6 / 8,	true },
+		{ "Gbit/s",	1e9 / 8,	true },
+	};
+
+	for (i = 0; i < array_size(units); ++i) {
+		if (!strcmp(ptr, units[i].unit))
+			break;
+	}
+
+	if (i == array_size(units))
+		panic("Syntax error in rate param!\n");
+
+	rate *= units[i].scale;
+	if (rate < 1)
+		panic("Rate must be at least 1 pps or 8 bit/s!\n");
+
+	ctx->rate = (unsigned long long) nearbyintl(rate);
+	ctx->rate_bytes = units[i].bytes;
+}
+
 static unsigned int generate_srand_seed(void)
 {
 	int fd;
@@ -1083,12 +1879,13 @@ int main(int argc, char **argv)
 {
 	bool slow = false, invoke_cpp = false, reseed = true;
 	int c, opt_index, i, j, vals[4] = {0}, irq;
-	char *confname = NULL, *ptr;
-	unsigned long cpus_tmp;
+	char *confname = NULL, *compile_to = NULL, *ptr;
+	unsigned long cpus_tmp, reaped = 0;
 	unsigned long long tx_packets, tx_bytes;
 	struct ctx ctx;
 
 	fmemset(&ctx, 0, sizeof(ctx));
+	ctx.probe = -1;
 	ctx.cpus = get_number_cpus_online();
 	ctx.uid = getuid();
 	ctx.gid = getgid();
@@ -1147,6 +1944,14 @@ int main(int argc, char **argv)
 			confname = xstrdup(optarg);
 			if (!strncmp("-", confname, strlen("-")))
 				ctx.cpus = 1;
+			ctx.load = false;
+			break;
+		case 'L':
+			confname = xstrdup(optarg);
+			ctx.load = true;
+			break;
+		case 'C':
+			compile_to = xstrdup(optarg);
 			break;
 		case 'u':
 			ctx.uid = strtoul(optarg, NULL, 0);
@@ -1159,6 +1964,12 @@ int main(int argc, char **argv)
 		case 'k':
 			ctx.kpull = strtoul(optarg, NULL, 0);
 			break;
+		case 'K':
+			ctx.kick = strtoul(optarg, NULL, 0);
+			break;
+		case 'q':
+			ctx.qdisc_path = true;
+			break;
 		case 'E':
 			seed = strtoul(optarg, NULL, 0);
 			reseed = false;
@@ -1166,6 +1977,23 @@ int main(int argc, char **argv)
 		case 'n':
 			ctx.num = strtoul(optarg, NULL, 0);
 			break;
+		case 'M':
+			ctx.variants = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			parse_rate(&ctx, optarg);
+			break;
+		case 'A':
+			ctx.stats_ival = strtoul(optarg, NULL, 0);
+			break;
+		case 'j':
+			ctx.stats_json = true;
+			break;
+		case 'O':
+			ctx.probe = strtol(optarg, NULL, 0);
+			if (ctx.probe < 0)
+				panic("Probe offset must not be negative!\n");
+			break;
 		case 't':
 			slow = true;
 			ctx.gap = strtoul(optarg, NULL, 0);
@@ -1214,6 +2042,13 @@ int main(int argc, char **argv)
 			case 'g':
 			case 't':
 			case 'e':
+			case 'M':
+			case 'b':
+			case 'C':
+			case 'L':
+			case 'A':
+			case 'O':
+			case 'K':
 				panic("Option -%c requires an argument!\n",
 				      optopt);
 			default:
@@ -1226,6 +2061,18 @@ int main(int argc, char **argv)
 		}
 	}
 
+	if (compile_to) {
+		if (confname == NULL || ctx.load)
+			panic("No configuration file to compile given!\n");
+
+		compile_packets_to(confname, compile_to, ctx.verbose, invoke_cpp);
+		cleanup_packets();
+
+		xfree(compile_to);
+		xfree(confname);
+		return 0;
+	}
+
 	if (argc < 5)
 		help();
 	if (ctx.device == NULL)
@@ -1234,6 +2081,8 @@ int main(int argc, char **argv)
 		panic("No configuration file given!\n");
 	if (device_mtu(ctx.device) == 0)
 		panic("This is no networking device!\n");
+	if (ctx.rate > 0 && ctx.gap > 0)
+		panic("Either use --gap or --rate, not both!\n");
 	if (!ctx.rfraw && device_up_and_running(ctx.device) == 0)
 		panic("Networking device not running!\n");
 
@@ -1260,6 +2109,15 @@ int main(int argc, char **argv)
 
 	stats = setup_shared_var(ctx.cpus);
 
+	if (ctx.stats_ival) {
+		stats_epoch = mmap(NULL, sizeof(*stats_epoch),
+				   PROT_READ | PROT_WRITE,
+				   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (stats_epoch == MAP_FAILED)
+			panic("Cannot setup shared variable!\n");
+		*stats_epoch = 0;
+	}
+
 	for (i = 0; i < ctx.cpus; i++) {
 		pid_t pid = fork();
 
@@ -1278,7 +2136,10 @@ int main(int argc, char **argv)
 		}
 	}
 
-	for (i = 0; i < ctx.cpus; i++) {
+	if (ctx.stats_ival)
+		reaped = stats_report_loop(&ctx);
+
+	for (i = reaped; i < ctx.cpus; i++) {
 		int status;
 
 		wait(&status);
@@ -1312,6 +2173,8 @@ int main(int argc, char **argv)
 thread_out:
 	xunlockme();
 	destroy_shared_var(stats, ctx.cpus);
+	if (stats_epoch)
+		munmap((void *) stats_epoch, sizeof(*stats_epoch));
 
 	free(ctx.device);
 	free(ctx.device_trans);
@@ -9,6 +9,7 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <stdbool.h>
 #include <sys/types.h>
 
 #define TYPE_INC	0
@@ -20,24 +21,48 @@ enum csum {
 	CSUM_TCP,
 };
 
+/* Max. number of checksums per packet that are updated incrementally */
+#define CSUM_INC_MAX	32
+
+/*
+ * csum_mask has bit j set if the dynamic byte(s) lie within the area
+ * covered by csum[j] of its packet, csum_odd bit j if the (first) byte
+ * sits at an odd offset relative to the start of that area.
+ *
+ * Counters are 1, 2, 4 or 8 bytes wide and written in network byte order.
+ * A counter that is carried is not advanced per packet, but only when the
+ * counter that follows it wraps around, referenced through carry.
+ */
 struct counter {
-	int type;
-	uint8_t min, max, inc, val;
+	uint64_t min, max, inc, val;
 	off_t off;
+	uint32_t csum_mask, csum_odd;
+	int16_t carry;
+	uint8_t type, len;
+	bool carried;
 };
 
 struct randomizer {
 	off_t off;
+	uint32_t csum_mask, csum_odd;
 };
 
 struct csum16 {
 	off_t off, from, to;
 	enum csum which;
+	bool full;
+	uint32_t diff;
 };
 
+/*
+ * A mapped payload points into a pcap or .tgc file, not ours to free.
+ * Packets are picked in proportion to their weight, if they differ.
+ */
 struct packet {
 	uint8_t *payload;
 	size_t len;
+	uint32_t weight;
+	bool mapped;
 };
 
 struct packet_dyn {
@@ -47,9 +72,15 @@ struct packet_dyn {
 	size_t rlen;
 	struct csum16 *csum;
 	size_t slen;
+	bool csum_ready;
 };
 
 extern int compile_packets(char *file, int verbose, int cpu, bool invoke_cpp);
+extern int compile_packets_to(char *file, char *out, int verbose,
+			      bool invoke_cpp);
+extern int load_packets(char *file, int verbose, int cpu);
 extern void cleanup_packets(void);
+extern bool csum_covers_range(struct packet *pkt, struct csum16 *s,
+			      off_t off, size_t len);
 
 #endif /* TRAFGEN_CONF */
@@ -17,6 +17,9 @@
 #include <errno.h>
 #include <stdbool.h>
 #include <libgen.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "xmalloc.h"
 #include "trafgen_parser.tab.h"
@@ -25,6 +28,8 @@
 #include "die.h"
 #include "csum.h"
 #include "xutils.h"
+#include "xio.h"
+#include "pcap_io.h"
 
 #define YYERROR_VERBOSE		0
 #define YYDEBUG			0
@@ -55,9 +60,56 @@ extern size_t dlen;
 #define packetds_last		(packet_dyn[packetd_last].slen - 1)
 
 static int our_cpu, min_cpu = -1, max_cpu = -1;
+static uint32_t next_weight = 1;
+
+/*
+ * An overlay element of a pcap() template, parsed into the scratch packet
+ * at start and placed at off of every packet loaded from the pcap file.
+ */
+struct overlay {
+	off_t start, off;
+	size_t len;
+};
+
+static struct overlay *overlay = NULL;
+static size_t olen = 0;
+static bool in_overlay = false;
+
+/*
+ * Fields of the current packet that depend on bytes yet to come: lengths
+ * and the static checksums that might cover them, filled in in order of
+ * appearance once the packet is complete.
+ */
+struct fixup {
+	off_t off, from, to;
+	enum csum which;
+	bool csum;
+};
+
+static struct fixup *fixups = NULL;
+static size_t flen = 0;
+
+/* Files our packet payloads point into, unmapped on cleanup */
+struct file_map {
+	uint8_t *base;
+	size_t len;
+};
+
+static struct file_map *fmaps = NULL;
+static size_t fmlen = 0;
+
+/* When compiling to a .tgc file, we keep the packets of all CPUs */
+struct cpu_range {
+	int min, max;
+};
+
+static bool keep_all = false;
+static struct cpu_range *cpu_ranges = NULL;
 
 static inline int test_ignore(void)
 {
+	if (keep_all)
+		return 0;
 	if (min_cpu < 0 && max_cpu < 0)
 		return 0;
 	else if (max_cpu >= our_cpu && min_cpu <= our_cpu)
@@ -75,6 +127,8 @@ static inline void __init_new_packet_slot(struct packet *slot)
 {
 	slot->payload = NULL;
 	slot->len = 0;
+	slot->weight = 1;
+	slot->mapped = false;
 }
 
 static inline void __init_new_counter_slot(struct packet_dyn *slot)
@@ -93,23 +147,42 @@ static inline void __init_new_csum_slot(struct packet_dyn *slot)
 {
 	slot->csum = NULL;
 	slot->slen = 0;
+	slot->csum_ready = false;
 }
 
-static inline void __setup_new_counter(struct counter *c, uint8_t start,
-				       uint8_t stop, uint8_t stepping,
-				       int type)
+static inline void __setup_new_counter(struct counter *c, uint64_t start,
+				       uint64_t stop, uint64_t stepping,
+				       int type, size_t len, bool carried)
 {
+	uint64_t mask = len < sizeof(mask) ? (1ULL << (8 * len)) - 1 : ~0ULL;
+
+	start &= mask;
+	stop &= mask;
+
+	if (start > stop) {
+		uint64_t tmp = start;
+
+		start = stop;
+		stop = tmp;
+	}
+
 	c->min = start;
 	c->max = stop;
-	c->inc = stepping;
+	/* Steps of a whole range or more would wrap more than once */
+	c->inc = stop - start + 1 ? stepping % (stop - start + 1) : stepping;
 	c->val = (type == TYPE_INC) ? start : stop;
-	c->off = payload_last;
+	c->off = payload_last - len + 1;
 	c->type = type;
+	c->len = len;
+	c->carried = carried;
+	c->carry = -1;
+	c->csum_mask = c->csum_odd = 0;
 }
 
 static inline void __setup_new_randomizer(struct randomizer *r)
 {
 	r->off = payload_last;
+	r->csum_mask = r->csum_odd = 0;
 }
 
 static inline void __setup_new_csum16(struct csum16 *s, off_t from, off_t to,
@@ -119,13 +192,59 @@ static inline void __setup_new_csum16(struct csum16 *s, off_t from, off_t to,
 	s->from = from;
 	s->to = to;
 	s->which = which;
+	s->full = false;
+	s->diff = 0;
+}
+
+static void resolve_fixups(struct packet *pkt)
+{
+	size_t i;
+
+	for (i = 0; i < flen; ++i) {
+		struct fixup *f = &fixups[i];
+		uint16_t val;
+
+		if (f->csum) {
+			val = htons(calc_csum(pkt->payload + f->from,
+					      f->to - f->from, 0));
+		} else {
+			if (pkt->len - f->from > UINT16_MAX)
+				panic("Packet too large for a 16 bit length!\n");
+			val = cpu_to_be16(pkt->len - f->from);
+		}
+
+		fmemcpy(&pkt->payload[f->off], &val, sizeof(val));
+	}
+
+	free(fixups);
+	fixups = NULL;
+	flen = 0;
 }
 
 static void realloc_packet(void)
 {
+	uint32_t weight = next_weight;
+
+	next_weight = 1;
+
 	if (test_ignore())
 		return;
 
+	if (plen > 0) {
+		packets[packet_last].weight = weight;
+		resolve_fixups(&packets[packet_last]);
+	}
+
+	if (keep_all) {
+		cpu_ranges = xrealloc(cpu_ranges, 1, (plen + 1) * sizeof(*cpu_ranges));
+		cpu_ranges[plen].min = cpu_ranges[plen].max = -1;
+		/* The rule of the packet we close has just set its range */
+		if (plen > 0) {
+			cpu_ranges[packet_last].min = min_cpu;
+			cpu_ranges[packet_last].max = max_cpu;
+		}
+	}
+
 	plen++;
 	packets = xrealloc(packets, 1, plen * sizeof(*packets));
 
@@ -139,6 +258,22 @@ static void realloc_packet(void)
 	__init_new_csum_slot(&packet_dyn[packetd_last]);
 }
 
+static void set_weight(long long int weight)
+{
+	if (weight <= 0 || weight > UINT32_MAX)
+		panic("Packet weight must be within [1, %u]!\n", UINT32_MAX);
+
+	next_weight = weight;
+}
+
+static void register_map(uint8_t *base, size_t len)
+{
+	fmlen++;
+	fmaps = xrealloc(fmaps, 1, fmlen * sizeof(*fmaps));
+	fmaps[fmlen - 1].base = base;
+	fmaps[fmlen - 1].len = len;
+}
+
 static void set_byte(uint8_t val)
 {
 	struct packet *pkt = &packets[packet_last];
@@ -187,6 +322,23 @@ static void __set_csum16_dynamic(size_t from, size_t to, enum csum which)
 	__setup_new_csum16(&pktd->csum[packetds_last], from, to, which);
 }
 
+static void add_fixup(off_t from, off_t to, enum csum which, bool csum)
+{
+	struct packet *pkt = &packets[packet_last];
+
+	flen++;
+	fixups = xrealloc(fixups, 1, flen * sizeof(*fixups));
+
+	fixups[flen - 1].off = pkt->len;
+	fixups[flen - 1].from = from;
+	fixups[flen - 1].to = to;
+	fixups[flen - 1].which = which;
+	fixups[flen - 1].csum = csum;
+
+	set_byte(0);
+	set_byte(0);
+}
+
 static void __set_csum16_static(size_t from, size_t to, enum csum which)
 {
 	struct packet *pkt = &packets[packet_last];
@@ -218,15 +370,67 @@ static void set_csum16(size_t from, size_t to, enum csum which)
 
 	bug_on(!(from < to));
 
-	if (to >= pkt->len || which == CSUM_TCP || which == CSUM_UDP)
+	/* Overlay bytes only get their final neighbours at load time */
+	if (to >= pkt->len || in_overlay || which == CSUM_TCP ||
+	    which == CSUM_UDP)
 		make_it_dynamic = 1;
 
 	if (has_dynamic_elems(pktd) || make_it_dynamic)
 		__set_csum16_dynamic(from, to, which);
+	else if (flen > 0)
+		/* Might cover a length field, sum up once it is known */
+		add_fixup(from, to, which, true);
 	else
 		__set_csum16_static(from, to, which);
 }
 
+/*
+ * Length of the packet from offset from to its end, so that e.g. ip4len()
+ * is the IPv4 total length and udplen() the UDP length of our packet.
+ */
+static void set_len16(long long int from)
+{
+	struct packet *pkt = &packets[packet_last];
+
+	if (test_ignore())
+		return;
+	if (in_overlay)
+		panic("Length fields are not supported in pcap overlays!\n");
+	if (from < 0 || from > pkt->len)
+		panic("Length field at %zu cannot start counting at %lld!\n",
+		      pkt->len, from);
+
+	add_fixup(from, 0, CSUM_IP, false);
+}
+
+static void set_ip4(uint32_t addr)
+{
+	uint32_t val = cpu_to_be32(addr);
+
+	set_multi_byte((uint8_t *) &val, sizeof(val));
+}
+
+static void set_port(long long int port)
+{
+	uint16_t val;
+
+	if (port < 0 || port > UINT16_MAX)
+		panic("Port %lld out of range!\n", port);
+
+	val = cpu_to_be16(port);
+	set_multi_byte((uint8_t *) &val, sizeof(val));
+}
+
+static void set_mac(char *str)
+{
+	int i;
+
+	for (i = 0; i < 6; ++i)
+		set_byte((uint8_t) strtoul(str + 3 * i, NULL, 16));
+
+	xfree(str);
+}
+
 static void set_rnd(size_t len)
 {
 	size_t i;
@@ -294,22 +498,282 @@ static void set_dynamic_rnd(void)
 	__setup_new_randomizer(&pktd->rnd[packetdr_last]);
 }
 
-static void set_dynamic_incdec(uint8_t start, uint8_t stop, uint8_t stepping,
-			       int type)
+static void set_dynamic_incdec(uint64_t start, uint64_t stop,
+			       uint64_t stepping, int type, size_t len,
+			       bool carried)
 {
 	struct packet *pkt = &packets[packet_last];
 	struct packet_dyn *pktd = &packet_dyn[packetd_last];
+	struct counter *c;
+	uint64_t val;
 
 	if (test_ignore())
 		return;
 
-	pkt->len++;
+	bug_on(len == 0 || len > sizeof(val));
+
+	pkt->len += len;
 	pkt->payload = xrealloc(pkt->payload, 1, pkt->len);
 
 	pktd->clen++;
-	pktd->cnt =xrealloc(pktd->cnt, 1, pktd->clen * sizeof(struct counter));
+	pktd->cnt = xrealloc(pktd->cnt, 1, pktd->clen * sizeof(struct counter));
+
+	c = &pktd->cnt[packetdc_last];
+	__setup_new_counter(c, start, stop, stepping, type, len, carried);
+
+	/* We drive the carried counter right before us on wrap around */
+	if (pktd->clen > 1 && pktd->cnt[packetdc_last - 1].carried)
+		c->carry = packetdc_last - 1;
+
+	val = cpu_to_be64(c->val);
+	fmemcpy(&pkt->payload[c->off], (uint8_t *) &val + sizeof(val) - len, len);
+}
+
+static void overlay_begin(long long int off)
+{
+	struct packet *pkt = &packets[packet_last];
+
+	if (test_ignore())
+		return;
+	if (off < 0)
+		panic("Invalid pcap overlay offset %lld!\n", off);
+
+	olen++;
+	overlay = xrealloc(overlay, 1, olen * sizeof(*overlay));
+
+	overlay[olen - 1].start = pkt->len;
+	overlay[olen - 1].off = off;
+	overlay[olen - 1].len = 0;
+
+	in_overlay = true;
+}
+
+static void overlay_end(void)
+{
+	struct packet *pkt = &packets[packet_last];
+
+	if (test_ignore())
+		return;
+
+	overlay[olen - 1].len = pkt->len - overlay[olen - 1].start;
+}
+
+/*
+ * Returns the overlay element holding scratch bytes [start, start + len)
+ * if it fits into a packet of pkt_len bytes, or NULL.
+ */
+static struct overlay *overlay_find(off_t start, size_t len, size_t pkt_len)
+{
+	size_t i;
+
+	for (i = 0; i < olen; ++i) {
+		struct overlay *o = &overlay[i];
+
+		if (start < o->start || start + len > o->start + o->len)
+			continue;
+
+		return o->off + o->len <= pkt_len ? o : NULL;
+	}
+
+	return NULL;
+}
+
+static inline off_t overlay_xlate(struct overlay *o, off_t off)
+{
+	return off - o->start + o->off;
+}
+
+/*
+ * Sets up the packet in the current slot to point right into the pcap
+ * mapping. The mapping is private, so overlays and dynamic elements only
+ * ever write into our copy-on-write pages and never back into the file.
+ */
+static void pcap_add_packet(uint8_t *payload, size_t len,
+			    struct packet *scratch,
+			    struct packet_dyn *scratchd)
+{
+	struct packet *pkt = &packets[packet_last];
+	struct packet_dyn *pktd = &packet_dyn[packetd_last];
+	ssize_t map[scratchd->clen ? : 1];
+	struct overlay *o;
+	size_t i;
+
+	pkt->payload = payload;
+	pkt->len = len;
+	pkt->mapped = true;
+
+	for (i = 0; i < olen; ++i) {
+		o = &overlay[i];
+		if (o->len > 0 && o->off + o->len <= len)
+			fmemcpy(payload + o->off, scratch->payload + o->start,
+				o->len);
+	}
+
+	for (i = 0; i < scratchd->clen; ++i) {
+		struct counter *c = &scratchd->cnt[i];
+
+		map[i] = -1;
+
+		o = overlay_find(c->off, c->len, len);
+		if (!o)
+			continue;
+
+		map[i] = pktd->clen++;
+		pktd->cnt = xrealloc(pktd->cnt, 1, pktd->clen * sizeof(*c));
+		pktd->cnt[packetdc_last] = *c;
+		pktd->cnt[packetdc_last].off = overlay_xlate(o, c->off);
+	}
+
+	/* A counter whose carried partner did not fit stays put */
+	for (i = 0; i < pktd->clen; ++i) {
+		struct counter *c = &pktd->cnt[i];
+
+		if (c->carry >= 0)
+			c->carry = map[c->carry];
+	}
+
+	for (i = 0; i < scratchd->rlen; ++i) {
+		struct randomizer *r = &scratchd->rnd[i];
+
+		o = overlay_find(r->off, 1, len);
+		if (!o)
+			continue;
+
+		pktd->rlen++;
+		pktd->rnd = xrealloc(pktd->rnd, 1, pktd->rlen * sizeof(*r));
+		pktd->rnd[packetdr_last] = *r;
+		pktd->rnd[packetdr_last].off = overlay_xlate(o, r->off);
+	}
+
+	for (i = 0; i < scratchd->slen; ++i) {
+		struct csum16 *s = &scratchd->csum[i];
+
+		/* from/to are packet offsets as written, only the field moves */
+		o = overlay_find(s->off, 2, len);
+		if (!o || s->to >= len)
+			continue;
+
+		pktd->slen++;
+		pktd->csum = xrealloc(pktd->csum, 1, pktd->slen * sizeof(*s));
+		pktd->csum[packetds_last] = *s;
+		pktd->csum[packetds_last].off = overlay_xlate(o, s->off);
+	}
+
+	realloc_packet();
+}
+
+static char *unquote(char *str)
+{
+	str[strlen(str) - 1] = 0;
+	return str + 1;
+}
+
+static inline bool pcap_is_magic(uint32_t magic)
+{
+	switch (magic) {
+	case DEFAULT:
+	case NSEC:
+	case KUZNETZOV:
+	case BORKMANN:
+	case DEFAULT_SWAPPED:
+	case NSEC_SWAPPED:
+	case KUZNETZOV_SWAPPED:
+	case BORKMANN_SWAPPED:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/*
+ * Loads up to max packets (0 meaning all) from a pcap file as templates,
+ * with the overlay elements parsed so far applied to each of them. Any
+ * per-packet parsing is done here, so sending them costs the same as for
+ * packets from the configuration itself.
+ */
+static void set_pcap(const char *file, size_t max)
+{
+	int fd;
+	size_t off, num = 0;
+	struct stat sb;
+	uint8_t *base;
+	enum pcap_type type;
+	struct pcap_filehdr *hdr;
+	struct packet scratch = packets[packet_last];
+	struct packet_dyn scratchd = packet_dyn[packetd_last];
+
+	if (test_ignore())
+		goto out;
+
+	__init_new_packet_slot(&packets[packet_last]);
+	__init_new_counter_slot(&packet_dyn[packetd_last]);
+	__init_new_randomizer_slot(&packet_dyn[packetd_last]);
+	__init_new_csum_slot(&packet_dyn[packetd_last]);
+
+	fd = open_or_die(file, O_RDONLY);
+	if (fstat(fd, &sb) < 0)
+		panic("Cannot stat pcap file %s: %s!\n", file, strerror(errno));
+	if (sb.st_size < sizeof(*hdr))
+		panic("This file has not a valid pcap header\n");
+
+	base = mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+		    fd, 0);
+	if (base == MAP_FAILED)
+		panic("Cannot mmap pcap file %s: %s!\n", file, strerror(errno));
+	close(fd);
+
+	madvise(base, sb.st_size, MADV_WILLNEED);
+
+	register_map(base, sb.st_size);
+
+	hdr = (struct pcap_filehdr *) base;
+	pcap_validate_header(hdr);
+	type = hdr->magic;
+
+	off = sizeof(*hdr);
+	while (off < sb.st_size && (max == 0 || num < max)) {
+		pcap_pkthdr_t phdr;
+		size_t hlen, len;
+
+		hlen = pcap_get_hdr_length(&phdr, type);
+		if (off + hlen > sb.st_size)
+			break;
+
+		/* Record headers are not necessarily aligned in the file */
+		fmemcpy(&phdr, base + off, hlen);
+		len = pcap_get_length(&phdr, type);
+		off += hlen;
+
+		if (off + len > sb.st_size)
+			break;
+		if (len > 0) {
+			pcap_add_packet(base + off, len, &scratch, &scratchd);
+			num++;
+		}
+
+		off += len;
+	}
 
-	__setup_new_counter(&pktd->cnt[packetdc_last], start, stop, stepping, type);
+	if (num == 0)
+		panic("No packets found in pcap file %s!\n", file);
+out:
+	if (scratch.len > 0)
+		xfree(scratch.payload);
+	free(scratchd.cnt);
+	free(scratchd.rnd);
+	free(scratchd.csum);
+
+	if (test_ignore()) {
+		__init_new_packet_slot(&packets[packet_last]);
+		__init_new_counter_slot(&packet_dyn[packetd_last]);
+		__init_new_randomizer_slot(&packet_dyn[packetd_last]);
+		__init_new_csum_slot(&packet_dyn[packetd_last]);
+	}
+
+	free(overlay);
+	overlay = NULL;
+	olen = 0;
+	in_overlay = false;
 }
 
 %}
@@ -319,15 +783,17 @@ static void set_dynamic_incdec(uint8_t start, uint8_t stop, uint8_t stepping,
 	char *str;
 }
 
-%token K_COMMENT K_FILL K_RND K_SEQINC K_SEQDEC K_DRND K_DINC K_DDEC K_WHITE
-%token K_CPU K_CSUMIP K_CSUMUDP K_CSUMTCP K_CONST8 K_CONST16 K_CONST32 K_CONST64
+%token K_COMMENT K_FILL K_RND K_SEQINC K_SEQDEC K_DRND K_WHITE
+%token K_CPU K_PCAP K_WEIGHT K_CSUMIP K_CSUMUDP K_CSUMTCP K_CONST8 K_CONST16 K_CONST32 K_CONST64
+%token <number> K_DINC K_DDEC K_CINC K_CDEC
+%token K_IP4 K_MAC K_PORT K_LEN16 K_IP4LEN K_UDPLEN
 
 %token ',' '{' '}' '(' ')' '[' ']' ':' '-' '+' '*' '/' '%' '&' '|' '<' '>' '^'
 
-%token number string
+%token number string ip4addr macaddr
 
-%type <number> number expression
-%type <str> string
+%type <number> number expression ip4addr
+%type <str> string macaddr
 
 %left '-' '+' '*' '/' '%' '&' '|' '<' '>' '^'
 
@@ -336,6 +802,7 @@ static void set_dynamic_incdec(uint8_t start, uint8_t stop, uint8_t stepping,
 packets
 	: { }
 	| packets packet { }
+	| packets pcap { }
 	| packets inline_comment { }
 	| packets K_WHITE { }
 	;
@@ -366,6 +833,36 @@ packet
 			min_cpu = max_cpu = $3;
 			realloc_packet();
 		}
+	| K_WEIGHT '(' number ')' ':' K_WHITE { set_weight($3); } packet { }
+	;
+
+pcap
+	: K_PCAP '(' string ')' {
+			min_cpu = max_cpu = -1;
+			set_pcap(unquote($3), 0);
+		}
+	| K_PCAP '(' string delimiter number ')' {
+			min_cpu = max_cpu = -1;
+			set_pcap(unquote($3), $5);
+		}
+	| K_PCAP '(' string delimiter number ')' ':' K_WHITE '{' delimiter overlay delimiter '}' {
+			min_cpu = max_cpu = -1;
+			set_pcap(unquote($3), $5);
+		}
+	;
+
+overlay
+	: overlay_elem { }
+	| overlay delimiter overlay_elem { }
+	;
+
+overlay_elem
+	: overlay_off elem { overlay_end(); }
+	;
+
+overlay_off
+	: '[' number ']' { overlay_begin($2); }
+	| '[' number ']' K_WHITE { overlay_begin($2); }
 	;
 
 payload
@@ -395,6 +892,7 @@ elem
 	| ddec { }
 	| csum { }
 	| const { }
+	| field { }
 	| inline_comment { }
 	;
 
@@ -455,6 +953,25 @@ rnd
 		{ set_rnd($3); }
 	;
 
+field
+	: K_IP4 '(' ip4addr ')'
+		{ set_ip4($3); }
+	| K_IP4 '(' ip4addr delimiter ip4addr ')'
+		{ set_dynamic_incdec($3, $5, 1, TYPE_INC, 4, false); }
+	| K_MAC '(' macaddr ')'
+		{ set_mac($3); }
+	| K_PORT '(' number ')'
+		{ set_port($3); }
+	| K_PORT '(' number delimiter number ')'
+		{ set_dynamic_incdec($3, $5, 1, TYPE_INC, 2, false); }
+	| K_LEN16 '(' number ')'
+		{ set_len16($3); }
+	| K_IP4LEN '(' ')'
+		{ set_len16((long long int) packets[packet_last].len - 2); }
+	| K_UDPLEN '(' ')'
+		{ set_len16((long long int) packets[packet_last].len - 4); }
+	;
+
 csum
 	: K_CSUMIP '(' number delimiter number ')'
 		{ set_csum16($3, $5, CSUM_IP); }
@@ -491,25 +1008,156 @@ drnd
 
 dinc
 	: K_DINC '(' number delimiter number ')'
-		{ set_dynamic_incdec($3, $5, 1, TYPE_INC); }
+		{ set_dynamic_incdec($3, $5, 1, TYPE_INC, $1, false); }
 	| K_DINC '(' number delimiter number delimiter number ')'
-		{ set_dynamic_incdec($3, $5, $7, TYPE_INC); }
+		{ set_dynamic_incdec($3, $5, $7, TYPE_INC, $1, false); }
+	| K_CINC '(' number delimiter number ')'
+		{ set_dynamic_incdec($3, $5, 1, TYPE_INC, $1, true); }
+	| K_CINC '(' number delimiter number delimiter number ')'
+		{ set_dynamic_incdec($3, $5, $7, TYPE_INC, $1, true); }
 	;
 
 ddec
 	: K_DDEC '(' number delimiter number ')'
-		{ set_dynamic_incdec($3, $5, 1, TYPE_DEC); }
+		{ set_dynamic_incdec($3, $5, 1, TYPE_DEC, $1, false); }
 	| K_DDEC '(' number delimiter number delimiter number ')'
-		{ set_dynamic_incdec($3, $5, $7, TYPE_DEC); }
+		{ set_dynamic_incdec($3, $5, $7, TYPE_DEC, $1, false); }
+	| K_CDEC '(' number delimiter number ')'
+		{ set_dynamic_incdec($3, $5, 1, TYPE_DEC, $1, true); }
+	| K_CDEC '(' number delimiter number delimiter number ')'
+		{ set_dynamic_incdec($3, $5, $7, TYPE_DEC, $1, true); }
 	;
 
 %%
 
+/*
+ * Returns 1 if off is within the area csum s covers in pkt, and sets *odd
+ * to the parity of off relative to the start of the 16 bit word stream.
+ */
+static int csum_covers(struct packet *pkt, struct csum16 *s, off_t off,
+		       int *odd)
+{
+	off_t to;
+
+	if (off == s->off || off == s->off + 1)
+		return 0;
+
+	switch (s->which) {
+	case CSUM_IP:
+		/* An odd last byte is summed as a zero padded word */
+		to = min(s->to, (off_t) pkt->len - 1);
+		*odd = (off - s->from) & 1;
+		return off >= s->from && off <= to;
+	case CSUM_UDP:
+	case CSUM_TCP:
+		/* Source and destination address of the pseudo header */
+		if (off >= s->from + 12 && off < s->from + 20) {
+			*odd = (off - s->from) & 1;
+			return 1;
+		}
+		*odd = (off - s->to) & 1;
+		return off >= s->to && off < pkt->len;
+	}
+
+	return 0;
+}
+
+/* Returns true if s covers any of the len bytes at off in pkt. */
+bool csum_covers_range(struct packet *pkt, struct csum16 *s, off_t off,
+		       size_t len)
+{
+	size_t k;
+	int odd;
+
+	for (k = 0; k < len; ++k) {
+		if (csum_covers(pkt, s, off + k, &odd))
+			return true;
+	}
+
+	return false;
+}
+
+static void __setup_csum_deps(struct packet *pkt, struct packet_dyn *pktd)
+{
+	size_t i, j, k;
+	int odd;
+
+	for (j = 0; j < pktd->slen; ++j) {
+		struct csum16 *s = &pktd->csum[j];
+		size_t rnds = 0, area;
+		uint32_t bit;
+
+		if (j >= CSUM_INC_MAX) {
+			s->full = true;
+			continue;
+		}
+
+		bit = 1U << j;
+
+		/* Another checksum within our area changes behind our back */
+		for (k = 0; k < pktd->slen; ++k) {
+			if (k != j &&
+			    (csum_covers(pkt, s, pktd->csum[k].off, &odd) ||
+			     csum_covers(pkt, s, pktd->csum[k].off + 1, &odd)))
+				s->full = true;
+		}
+
+		for (i = 0; i < pktd->clen; ++i) {
+			struct counter *c = &pktd->cnt[i];
+			size_t covered = 0;
+			int first = 0;
+
+			for (k = 0; k < c->len; ++k) {
+				if (csum_covers(pkt, s, c->off + k, &odd)) {
+					if (covered++ == 0)
+						first = odd ^ (k & 1);
+				}
+			}
+
+			if (covered == c->len) {
+				c->csum_mask |= bit;
+				c->csum_odd |= first ? bit : 0;
+			} else if (covered > 0) {
+				/* Straddles the area, do it the slow way */
+				s->full = true;
+			}
+		}
+
+		for (i = 0; i < pktd->rlen; ++i) {
+			struct randomizer *r = &pktd->rnd[i];
+
+			if (csum_covers(pkt, s, r->off, &odd)) {
+				r->csum_mask |= bit;
+				r->csum_odd |= odd ? bit : 0;
+				rnds++;
+			}
+		}
+
+		/* Large random regions are cheaper to sum up from scratch */
+		area = s->which == CSUM_IP ? s->to - s->from + 1 :
+		       pkt->len - s->to + 8;
+		if (rnds > area / 16)
+			s->full = true;
+
+		if (s->full) {
+			for (i = 0; i < pktd->clen; ++i)
+				pktd->cnt[i].csum_mask &= ~bit;
+			for (i = 0; i < pktd->rlen; ++i)
+				pktd->rnd[i].csum_mask &= ~bit;
+		}
+	}
+}
+
 static void finalize_packet(void)
 {
+	size_t i;
+
 	/* XXX hack ... we allocated one packet pointer too much */
 	plen--;
 	dlen--;
+
+	for (i = 0; i < plen; ++i)
+		__setup_csum_deps(&packets[i], &packet_dyn[i]);
 }
 
 static void dump_conf(void)
@@ -518,10 +1166,12 @@ static void dump_conf(void)
 
 	for (i = 0; i < plen; ++i) {
 		printf("[%zu] pkt\n", i);
-		printf(" len %zu cnts %zu rnds %zu\n",
+		printf(" len %zu weight %u cnts %zu rnds %zu%s\n",
 		       packets[i].len,
+		       packets[i].weight,
 		       packet_dyn[i].clen,
-		       packet_dyn[i].rlen);
+		       packet_dyn[i].rlen,
+		       packets[i].mapped ? " mapped" : "");
 
 		printf(" payload ");
 		for (j = 0; j < packets[i].len; ++j)
@@ -529,17 +1179,29 @@ static void dump_conf(void)
 		printf("\n");
 
 		for (j = 0; j < packet_dyn[i].clen; ++j)
-			printf(" cnt%zu [%u,%u], inc %u, off %ld type %s\n", j,
-			       packet_dyn[i].cnt[j].min,
-			       packet_dyn[i].cnt[j].max,
-			       packet_dyn[i].cnt[j].inc,
+			printf(" cnt%zu [%llu,%llu], inc %llu, off %ld len %u "
+			       "type %s%s carry %d\n", j,
+			       (unsigned long long) packet_dyn[i].cnt[j].min,
+			       (unsigned long long) packet_dyn[i].cnt[j].max,
+			       (unsigned long long) packet_dyn[i].cnt[j].inc,
 			       packet_dyn[i].cnt[j].off,
+			       packet_dyn[i].cnt[j].len,
+			       packet_dyn[i].cnt[j].carried ? "carried " : "",
 			       packet_dyn[i].cnt[j].type == TYPE_INC ?
-			       "inc" : "dec");
+			       "inc" : "dec",
+			       packet_dyn[i].cnt[j].carry);
 
 		for (j = 0; j < packet_dyn[i].rlen; ++j)
 			printf(" rnd%zu off %ld\n", j,
 			       packet_dyn[i].rnd[j].off);
+
+		for (j = 0; j < packet_dyn[i].slen; ++j)
+			printf(" csum%zu off %ld [%ld,%ld] %s\n", j,
+			       packet_dyn[i].csum[j].off,
+			       packet_dyn[i].csum[j].from,
+			       packet_dyn[i].csum[j].to,
+			       packet_dyn[i].csum[j].full ?
+			       "full" : "incremental");
 	}
 }
 
@@ -548,20 +1210,46 @@ void cleanup_packets(void)
 	size_t i;
 
 	for (i = 0; i < plen; ++i) {
-		if (packets[i].len > 0)
+		if (packets[i].len > 0 && !packets[i].mapped)
 			xfree(packets[i].payload);
 	}
 
 	free(packets);
 
+	for (i = 0; i < fmlen; ++i)
+		munmap(fmaps[i].base, fmaps[i].len);
+
+	free(fmaps);
+
 	for (i = 0; i < dlen; ++i) {
 		free(packet_dyn[i].cnt);
 		free(packet_dyn[i].rnd);
+		free(packet_dyn[i].csum);
 	}
 
 	free(packet_dyn);
 }
 
+static bool file_is_pcap(const char *file)
+{
+	int fd;
+	uint32_t magic;
+	bool ret = false;
+
+	if (!strncmp("-", file, strlen("-")))
+		return false;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	if (read(fd, &magic, sizeof(magic)) == sizeof(magic))
+		ret = pcap_is_magic(magic);
+
+	close(fd);
+	return ret;
+}
+
 int compile_packets(char *file, int verbose, int cpu, bool invoke_cpp)
 {
 	char tmp_file[128];
@@ -569,6 +1257,17 @@ int compile_packets(char *file, int verbose, int cpu, bool invoke_cpp)
 	memset(tmp_file, 0, sizeof(tmp_file));
 	our_cpu = cpu;
 
+	if (file_is_pcap(file)) {
+		realloc_packet();
+		set_pcap(file, 0);
+		finalize_packet();
+
+		if (our_cpu == 0 && verbose)
+			dump_conf();
+
+		return 0;
+	}
+
 	if (invoke_cpp) {
 		char cmd[256], *dir, *base, *a, *b;
 
@@ -605,6 +1304,300 @@ int compile_packets(char *file, int verbose, int cpu, bool invoke_cpp)
 	return 0;
 }
 
+/*
+ * Compiled configurations (.tgc) are a plain dump of our packet tables in
+ * host byte order and layout, guarded by a version and the structure
+ * sizes: a header, one struct tgc_pkt per packet, then each packet's
+ * payload and dynamic element descriptors, 8 byte aligned and referenced
+ * by file offset. Payloads are used right from the mapping on load.
+ */
+#define TGC_MAGIC	0x31636774	/* "tgc1" */
+#define TGC_VERSION	1
+
+struct tgc_hdr {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t pkt_size;
+	uint16_t cnt_size;
+	uint16_t rnd_size;
+	uint16_t csum_size;
+	uint16_t reserved;
+	uint64_t num;
+	uint64_t len;
+};
+
+struct tgc_pkt {
+	uint64_t payload, len;
+	uint64_t cnt, rnd, csum;
+	uint32_t clen, rlen, slen;
+	int32_t min_cpu, max_cpu;
+	uint32_t weight;
+};
+
+static inline uint64_t tgc_align(uint64_t off)
+{
+	return (off + 7) & ~7ULL;
+}
+
+static uint64_t tgc_put(int fd, uint64_t off, const void *data, size_t len)
+{
+	static const uint8_t pad[8] = { 0 };
+	uint64_t aligned = tgc_align(off);
+
+	if (aligned > off)
+		write_or_die(fd, pad, aligned - off);
+	if (len > 0)
+		write_or_die(fd, data, len);
+
+	return aligned + len;
+}
+
+int compile_packets_to(char *file, char *out, int verbose, bool invoke_cpp)
+{
+	int fd;
+	size_t i;
+	uint64_t off;
+	struct tgc_hdr hdr;
+	struct tgc_pkt *tp;
+
+	keep_all = true;
+	compile_packets(file, verbose, 0, invoke_cpp);
+
+	tp = xzmalloc((plen ? : 1) * sizeof(*tp));
+
+	off = sizeof(hdr) + plen * sizeof(*tp);
+	for (i = 0; i < plen; ++i) {
+		struct packet_dyn *pktd = &packet_dyn[i];
+
+		tp[i].min_cpu = cpu_ranges[i].min;
+		tp[i].max_cpu = cpu_ranges[i].max;
+
+		tp[i].len = packets[i].len;
+		tp[i].weight = packets[i].weight;
+		tp[i].payload = tgc_align(off);
+		off = tp[i].payload + tp[i].len;
+
+		tp[i].clen = pktd->clen;
+		tp[i].cnt = tgc_align(off);
+		off = tp[i].cnt + pktd->clen * sizeof(*pktd->cnt);
+
+		tp[i].rlen = pktd->rlen;
+		tp[i].rnd = tgc_align(off);
+		off = tp[i].rnd + pktd->rlen * sizeof(*pktd->rnd);
+
+		tp[i].slen = pktd->slen;
+		tp[i].csum = tgc_align(off);
+		off = tp[i].csum + pktd->slen * sizeof(*pktd->csum);
+	}
+
+	fmemset(&hdr, 0, sizeof(hdr));
+	hdr.magic = TGC_MAGIC;
+	hdr.version = TGC_VERSION;
+	hdr.pkt_size = sizeof(struct tgc_pkt);
+	hdr.cnt_size = sizeof(struct counter);
+	hdr.rnd_size = sizeof(struct randomizer);
+	hdr.csum_size = sizeof(struct csum16);
+	hdr.num = plen;
+	hdr.len = off;
+
+	fd = open_or_die_m(out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	off = tgc_put(fd, 0, &hdr, sizeof(hdr));
+	off = tgc_put(fd, off, tp, plen * sizeof(*tp));
+
+	for (i = 0; i < plen; ++i) {
+		struct packet_dyn *pktd = &packet_dyn[i];
+
+		off = tgc_put(fd, off, packets[i].payload, packets[i].len);
+		off = tgc_put(fd, off, pktd->cnt, pktd->clen * sizeof(*pktd->cnt));
+		off = tgc_put(fd, off, pktd->rnd, pktd->rlen * sizeof(*pktd->rnd));
+		off = tgc_put(fd, off, pktd->csum, pktd->slen * sizeof(*pktd->csum));
+	}
+
+	bug_on(off != hdr.len);
+
+	if (fsync(fd) < 0 || close(fd) < 0)
+		panic("Cannot write %s: %s!\n", out, strerror(errno));
+
+	printf("%zu packets compiled into %s\n", plen, out);
+
+	xfree(tp);
+	free(cpu_ranges);
+	cpu_ranges = NULL;
+	keep_all = false;
+
+	return 0;
+}
+
+static inline bool tgc_in_file(uint64_t off, uint64_t len, uint64_t size)
+{
+	return off <= size && len <= size - off;
+}
+
+static inline bool tgc_in_pkt(off_t off, uint64_t len, uint64_t pkt_len)
+{
+	return off >= 0 && tgc_in_file(off, len, pkt_len);
+}
+
+/* Only checksums this packet has may be tracked */
+static inline bool tgc_csum_mask_ok(uint32_t mask, uint32_t slen)
+{
+	return slen >= 32 || (mask >> slen) == 0;
+}
+
+/*
+ * The TX path trusts the descriptors blindly, so whatever they point at
+ * has to lie within the packet and within the descriptor tables.
+ */
+static bool tgc_pkt_valid(uint8_t *base, const struct tgc_pkt *tp)
+{
+	const struct counter *cnt = (const void *) (base + tp->cnt);
+	const struct randomizer *rnd = (const void *) (base + tp->rnd);
+	const struct csum16 *csum = (const void *) (base + tp->csum);
+	uint32_t j;
+
+	if ((tp->cnt | tp->rnd | tp->csum) & 7)
+		return false;
+
+	for (j = 0; j < tp->clen; ++j) {
+		const struct counter *c = &cnt[j];
+
+		if (c->len == 0 || c->len > sizeof(c->val) ||
+		    (c->len & (c->len - 1)) ||
+		    !tgc_in_pkt(c->off, c->len, tp->len) ||
+		    !tgc_csum_mask_ok(c->csum_mask, tp->slen))
+			return false;
+		/* Carries only ever go back to a carried counter */
+		if (c->carry >= (int32_t) j ||
+		    (c->carry >= 0 && !cnt[c->carry].carried))
+			return false;
+	}
+
+	for (j = 0; j < tp->rlen; ++j) {
+		const struct randomizer *r = &rnd[j];
+
+		if (!tgc_in_pkt(r->off, 1, tp->len) ||
+		    !tgc_csum_mask_ok(r->csum_mask, tp->slen))
+			return false;
+	}
+
+	for (j = 0; j < tp->slen; ++j) {
+		const struct csum16 *c = &csum[j];
+
+		if (!tgc_in_pkt(c->off, 2, tp->len) ||
+		    !tgc_in_pkt(c->from, 1, tp->len) || c->to < c->from)
+			return false;
+		if (c->which != CSUM_IP && c->which != CSUM_UDP &&
+		    c->which != CSUM_TCP)
+			return false;
+	}
+
+	return true;
+}
+
+static void *tgc_dup(uint8_t *base, uint64_t off, size_t len)
+{
+	return len ? xmemdupz(base + off, len) : NULL;
+}
+
+int load_packets(char *file, int verbose, int cpu)
+{
+	int fd;
+	size_t i, num = 0;
+	struct stat sb;
+	uint8_t *base;
+	struct tgc_hdr *hdr;
+	struct tgc_pkt *tp;
+
+	fd = open_or_die(file, O_RDONLY);
+	if (fstat(fd, &sb) < 0)
+		panic("Cannot stat %s: %s!\n", file, strerror(errno));
+	if (sb.st_size < sizeof(*hdr))
+		panic("%s is no compiled trafgen configuration!\n", file);
+
+	base = mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+		    fd, 0);
+	if (base == MAP_FAILED)
+		panic("Cannot mmap %s: %s!\n", file, strerror(errno));
+	close(fd);
+
+	register_map(base, sb.st_size);
+
+	hdr = (struct tgc_hdr *) base;
+	if (hdr->magic != TGC_MAGIC)
+		panic("%s is no compiled trafgen configuration!\n", file);
+	if (hdr->version != TGC_VERSION ||
+	    hdr->pkt_size != sizeof(struct tgc_pkt) ||
+	    hdr->cnt_size != sizeof(struct counter) ||
+	    hdr->rnd_size != sizeof(struct randomizer) ||
+	    hdr->csum_size != sizeof(struct csum16))
+		panic("%s was compiled by an incompatible trafgen, "
+		      "please recompile!\n", file);
+	if (hdr->len != sb.st_size || hdr->num > sb.st_size / sizeof(*tp) ||
+	    !tgc_in_file(sizeof(*hdr), hdr->num * sizeof(*tp), sb.st_size))
+		panic("%s is truncated or corrupt!\n", file);
+
+	tp = (struct tgc_pkt *) (base + sizeof(*hdr));
+
+	for (i = 0; i < hdr->num; ++i) {
+		if (!tgc_in_file(tp[i].payload, tp[i].len, sb.st_size) ||
+		    !tgc_in_file(tp[i].cnt, tp[i].clen * sizeof(struct counter), sb.st_size) ||
+		    !tgc_in_file(tp[i].rnd, tp[i].rlen * sizeof(struct randomizer), sb.st_size) ||
+		    !tgc_in_file(tp[i].csum, tp[i].slen * sizeof(struct csum16), sb.st_size) ||
+		    !tgc_pkt_valid(base, &tp[i]))
+			panic("%s is truncated or corrupt!\n", file);
+
+		min_cpu = tp[i].min_cpu;
+		max_cpu = tp[i].max_cpu;
+		our_cpu = cpu;
+
+		if (!test_ignore())
+			num++;
+	}
+
+	if (num > 0) {
+		packets = xzmalloc(num * sizeof(*packets));
+		packet_dyn = xzmalloc(num * sizeof(*packet_dyn));
+	}
+
+	for (i = 0; i < hdr->num; ++i) {
+		struct packet *pkt;
+		struct packet_dyn *pktd;
+
+		min_cpu = tp[i].min_cpu;
+		max_cpu = tp[i].max_cpu;
+		if (test_ignore())
+			continue;
+
+		pkt = &packets[plen];
+		pktd = &packet_dyn[dlen];
+
+		pkt->payload = base + tp[i].payload;
+		pkt->len = tp[i].len;
+		pkt->weight = tp[i].weight ? : 1;
+		pkt->mapped = true;
+
+		/* Descriptors are tiny and freed on cleanup, so copy them */
+		pktd->clen = tp[i].clen;
+		pktd->cnt = tgc_dup(base, tp[i].cnt, pktd->clen * sizeof(*pktd->cnt));
+		pktd->rlen = tp[i].rlen;
+		pktd->rnd = tgc_dup(base, tp[i].rnd, pktd->rlen * sizeof(*pktd->rnd));
+		pktd->slen = tp[i].slen;
+		pktd->csum = tgc_dup(base, tp[i].csum, pktd->slen * sizeof(*pktd->csum));
+		pktd->csum_ready = false;
+
+		plen++;
+		dlen++;
+	}
+
+	min_cpu = max_cpu = -1;
+
+	if (our_cpu == 0 && verbose)
+		dump_conf();
+
+	return 0;
+}
+
 void yyerror(const char *err)
 {
 	panic("Syntax error at line%d, at char '%s'! %s!\n", yylineno, yytext, err);
@@ -0,0 +1,70 @@
+/*
+ * netsniff-ng - the packet sniffing beast
+ * Subject to the GPL, version 2.
+ */
+
+#ifndef TRAFGEN_PROBE_H
+#define TRAFGEN_PROBE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "built_in.h"
+
+/*
+ * Latency probe that trafgen --probe <off> stamps into every packet at
+ * payload offset off, and netsniff-ng --probe <off> evaluates on the
+ * receiving side. The stream is the sending trafgen CPU, the sequence
+ * number counts per stream from 0. The timestamp is CLOCK_REALTIME in ns,
+ * so one-way latency is only meaningful with synchronized clocks (PTP).
+ * All fields are in network byte order.
+ */
+#define PROBE_MAGIC	0x74677062	/* "tgpb" */
+
+struct probe_hdr {
+	uint32_t magic;
+	uint32_t stream;
+	uint64_t seq;
+	uint64_t tx_ns;
+} __packed;
+
+static inline uint64_t probe_clock_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void probe_stamp(uint8_t *pos, uint32_t stream, uint64_t seq)
+{
+	struct probe_hdr probe = {
+		.magic	= cpu_to_be32(PROBE_MAGIC),
+		.stream	= cpu_to_be32(stream),
+		.seq	= cpu_to_be64(seq),
+		.tx_ns	= cpu_to_be64(probe_clock_ns()),
+	};
+
+	fmemcpy(pos, &probe, sizeof(probe));
+}
+
+static inline bool probe_parse(const uint8_t *pkt, size_t len, size_t off,
+			       struct probe_hdr *probe)
+{
+	if (len < off + sizeof(*probe))
+		return false;
+
+	fmemcpy(probe, pkt + off, sizeof(*probe));
+	if (be32_to_cpu(probe->magic) != PROBE_MAGIC)
+		return false;
+
+	probe->stream = be32_to_cpu(probe->stream);
+	probe->seq = be64_to_cpu(probe->seq);
+	probe->tx_ns = be64_to_cpu(probe->tx_ns);
+
+	return true;
+}
+
+#endif /* TRAFGEN_PROBE_H */
@@ -31,7 +31,9 @@ void trie_addr_lookup(char *buff, size_t len, int ipv4, int *fd,
 
 	if (unlikely((ipv4 && ((struct ipv4hdr *) buff)->h_version != 4) ||
 		     (!ipv4 && ((struct ipv6hdr *) buff)->version  != 6))) {
-		memset(addr, 0, sizeof(*addr));
+		/* TCP callers don't want the address */
+		if (addr)
+			memset(addr, 0, sizeof(*addr));
 		(*alen) = 0;
 		(*fd) = -1;
 		return;
@@ -197,6 +197,21 @@ int set_reuseaddr(int fd)
 	return 0;
 }
 
+#ifndef SO_REUSEPORT
+# define SO_REUSEPORT	15
+#endif
+
+int set_reuseport(int fd)
+{
+	int ret, one = 1;
+
+	ret = setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+	if (unlikely(ret < 0))
+		panic("Cannot reuse port!\n");
+
+	return 0;
+}
+
 void set_mtu_disc_dont(int fd)
 {
 	int mtu = IP_PMTUDISC_DONT;
@@ -439,6 +454,47 @@ int ethtool_drvinf(const char *ifname, struct ethtool_drvinfo *drvinf)
 	return ret;
 }
 
+int ethtool_stats_strings(const char *ifname, struct ethtool_gstrings *strings)
+{
+	int ret, sock;
+	struct ifreq ifr;
+
+	sock = af_socket(AF_INET);
+
+	memset(&ifr, 0, sizeof(ifr));
+	strlcpy(ifr.ifr_name, ifname, IFNAMSIZ);
+
+	strings->cmd = ETHTOOL_GSTRINGS;
+	strings->string_set = ETH_SS_STATS;
+	ifr.ifr_data = (char *) strings;
+
+	ret = ioctl(sock, SIOCETHTOOL, &ifr);
+
+	close(sock);
+
+	return ret;
+}
+
+int ethtool_stats(const char *ifname, struct ethtool_stats *stats)
+{
+	int ret, sock;
+	struct ifreq ifr;
+
+	sock = af_socket(AF_INET);
+
+	memset(&ifr, 0, sizeof(ifr));
+	strlcpy(ifr.ifr_name, ifname, IFNAMSIZ);
+
+	stats->cmd = ETHTOOL_GSTATS;
+	ifr.ifr_data = (char *) stats;
+
+	ret = ioctl(sock, SIOCETHTOOL, &ifr);
+
+	close(sock);
+
+	return ret;
+}
+
 u32 device_bitrate(const char *ifname)
 {
 	u32 speed_c, speed_w;
@@ -668,6 +724,33 @@ int device_set_irq_affinity_list(int irq, unsigned long from, unsigned long to)
 	return ret;
 }
 
+int device_get_irq_affinity_list(int irq, char *list, size_t len)
+{
+	int fd;
+	ssize_t ret;
+	char file[256];
+
+	/* Where the IRQ actually fires, if the kernel tells us. */
+	slprintf(file, sizeof(file), "/proc/irq/%d/effective_affinity_list", irq);
+	fd = open(file, O_RDONLY);
+	if (fd < 0) {
+		slprintf(file, sizeof(file), "/proc/irq/%d/smp_affinity_list", irq);
+		fd = open(file, O_RDONLY);
+		if (fd < 0)
+			return -ENOENT;
+	}
+
+	ret = read(fd, list, len - 1);
+	close(fd);
+	if (ret <= 0)
+		return -EIO;
+
+	list[ret] = 0;
+	strtrim_right(list, '\n');
+
+	return 0;
+}
+
 int device_bind_irq_to_cpu(int irq, int cpu)
 {
 	int ret;
@@ -1022,3 +1105,22 @@ void set_itimer_interval_value(struct itimerval *itimer, unsigned long sec,
 	itimer->it_value.tv_sec = sec;
 	itimer->it_value.tv_usec = usec;
 }
+
+struct timeval tv_subtract(struct timeval time1, struct timeval time2)
+{
+	struct timeval result;
+
+	if ((time1.tv_sec < time2.tv_sec) || ((time1.tv_sec == time2.tv_sec) &&
+	    (time1.tv_usec <= time2.tv_usec))) {
+		result.tv_sec = result.tv_usec = 0;
+	} else {
+		result.tv_sec = time1.tv_sec - time2.tv_sec;
+		if (time1.tv_usec < time2.tv_usec) {
+			result.tv_sec--;
+			result.tv_usec = time1.tv_usec + 1000000L - time2.tv_usec;
+		} else
+			result.tv_usec = time1.tv_usec - time2.tv_usec;
+	}
+
+	return result;
+}
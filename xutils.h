@@ -34,10 +34,13 @@ extern u32 ethtool_bitrate(const char *ifname);
 extern u32 device_bitrate(const char *ifname);
 extern int ethtool_drvinf(const char *ifname, struct ethtool_drvinfo *drvinf);
 extern int ethtool_link(const char *ifname);
+extern int ethtool_stats_strings(const char *ifname, struct ethtool_gstrings *strings);
+extern int ethtool_stats(const char *ifname, struct ethtool_stats *stats);
 extern int device_mtu(const char *ifname);
 extern int device_address(const char *ifname, int af, struct sockaddr_storage *ss);
 extern int device_irq_number(const char *ifname);
 extern int device_set_irq_affinity_list(int irq, unsigned long from, unsigned long to);
+extern int device_get_irq_affinity_list(int irq, char *list, size_t len);
 extern int device_bind_irq_to_cpu(int irq, int cpu);
 extern void sock_print_net_stats(int sock, unsigned long skipped);
 extern int device_ifindex(const char *ifname);
@@ -49,6 +52,7 @@ extern void xunlockme(void);
 extern int set_nonblocking(int fd);
 extern int set_nonblocking_sloppy(int fd);
 extern int set_reuseaddr(int fd);
+extern int set_reuseport(int fd);
 extern void set_sock_prio(int fd, int prio);
 extern void set_tcp_cork(int fd);
 extern void set_tcp_uncork(int fd);
@@ -90,5 +94,6 @@ extern void set_system_socket_memory(int *vals, size_t len);
 extern void reset_system_socket_memory(int *vals, size_t len);
 extern void set_itimer_interval_value(struct itimerval *itimer, unsigned long sec,
 				      unsigned long usec);
+extern struct timeval tv_subtract(struct timeval time1, struct timeval time2);
 
 #endif /* XSYS_H */